@@ -0,0 +1,203 @@
+// what SUBMIT_BATCH and ACK_RANGES save per job on small jobs, against a
+// running broker. the submit rows push <jobs> jobs through one connection as
+// pipelined SUBMITs and as SUBMIT_BATCHes of 64 and 1024, with up to 256 jobs
+// outstanding (or one batch, if larger). the drain rows take them back with a
+// prefetch window of 256 and acknowledge every window either with one ACK
+// frame per job or with one ACK_RANGES, in the
+// same write as the next REQUEST both times. every row prints jobs/s, the
+// broker's I/O system calls per job (the syscalls counter in STATS) and the
+// WAL bytes per job its records take, computed from the ids it got.
+//
+//   (libdsjq_client.a built in the repo root, see client.h)
+//   g++ -std=c++20 -O2 -pthread -I.. batch_commands.cpp -L.. -ldsjq_client -o batch_commands
+//   ./batch_commands [jobs] [payload_bytes]
+//
+// start the broker with an empty --wal-dir, the drain rows take everything
+// pending.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "client.h"
+#include "wal.h"
+
+using namespace std;
+
+const uint32_t PREFETCH = 256;
+
+static uint64_t broker_syscalls(BrokerConnection &stats) {
+  string frame;
+  append_frame(frame, OP_STATS, 0);
+  FrameHeader header;
+  string reply;
+  if (!stats.send(frame) || !stats.read_frame(header, reply)) {
+    fprintf(stderr, "STATS failed\n");
+    exit(1);
+  }
+  size_t at = reply.find("syscalls");
+  if (at == string::npos) {
+    return 0;
+  }
+  return strtoull(reply.c_str() + at + 8, nullptr, 10);
+}
+
+static void row(const char *mode, uint64_t jobs, double seconds,
+                uint64_t syscalls, double wal_bytes) {
+  printf("%-24s %12.0f %14.2f %14.1f\n", mode, jobs / seconds,
+         static_cast<double>(syscalls) / jobs, wal_bytes / jobs);
+  fflush(stdout);
+}
+
+// ids as [first, last] runs of consecutive ones
+static vector<pair<uint64_t, uint64_t>> ranges_of(vector<uint64_t> ids) {
+  sort(ids.begin(), ids.end());
+  vector<pair<uint64_t, uint64_t>> ranges;
+  for (uint64_t id : ids) {
+    if (!ranges.empty() && id == ranges.back().second + 1) {
+      ranges.back().second = id;
+    } else {
+      ranges.emplace_back(id, id);
+    }
+  }
+  return ranges;
+}
+
+static void submit(BrokerConnection &stats, uint64_t jobs, size_t batch,
+                   const string &payload) {
+  Producer producer;
+  uint64_t before = broker_syscalls(stats);
+  double wal_bytes = 0;
+  auto start = chrono::steady_clock::now();
+  if (batch == 1) {
+    deque<future<SubmitResult>> inflight;
+    for (uint64_t i = 0; i < jobs; i++) {
+      if (inflight.size() == 256) {
+        SubmitResult r = inflight.front().get();
+        wal_bytes += wal_add_record(r.id, 0, 0, payload).size();
+        inflight.pop_front();
+      }
+      inflight.push_back(producer.submit(payload));
+    }
+    for (auto &result : inflight) {
+      SubmitResult r = result.get();
+      wal_bytes += wal_add_record(r.id, 0, 0, payload).size();
+    }
+  } else {
+    // the same window of outstanding jobs, but at least one batch
+    vector<string> payloads(batch, payload);
+    deque<vector<future<SubmitResult>>> inflight;
+    auto settle = [&] {
+      uint64_t first = inflight.front()[0].get().id;
+      for (size_t i = 1; i < batch; i++) {
+        inflight.front()[i].get();
+      }
+      WalBatch record(first, 0, 0, 0);
+      for (size_t i = 0; i < batch; i++) {
+        record.add(Payload(payload), false);
+      }
+      wal_bytes += static_cast<double>(record.serialize().size());
+      inflight.pop_front();
+    };
+    for (uint64_t done = 0; done < jobs; done += batch) {
+      if (!inflight.empty() && (inflight.size() + 1) * batch > 256) {
+        settle();
+      }
+      inflight.push_back(producer.submit_batch(payloads));
+    }
+    while (!inflight.empty()) {
+      settle();
+    }
+    jobs = (jobs + batch - 1) / batch * batch;
+  }
+  double seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  string mode = batch == 1 ? "SUBMIT"
+                           : "SUBMIT_BATCH of " + to_string(batch);
+  row(mode.c_str(), jobs, seconds, broker_syscalls(stats) - before,
+      wal_bytes);
+}
+
+static void drain(BrokerConnection &stats, uint64_t jobs, bool ranges) {
+  BrokerConnection conn{ClientOptions{}};
+  string frames;
+  FrameHeader header;
+  string payload;
+  append_frame(frames, OP_PREFETCH, PREFETCH);
+  if (!conn.open() || !conn.send(frames) ||
+      !conn.read_frame(header, payload)) {
+    fprintf(stderr, "could not connect\n");
+    exit(1);
+  }
+  uint64_t before = broker_syscalls(stats);
+  double wal_bytes = 0;
+  uint64_t taken = 0;
+  vector<uint64_t> ids;
+  auto start = chrono::steady_clock::now();
+  frames.clear();
+  while (taken < jobs) {
+    append_frame(frames, OP_REQUEST, 0);
+    if (!conn.send(frames)) {
+      exit(1);
+    }
+    frames.clear();
+    ids.clear();
+    while (conn.read_frame(header, payload) && header.opcode == OP_JOB) {
+      ids.push_back(header.job_id);
+      if (!(header.flags & FLAG_MORE)) {
+        break;
+      }
+    }
+    if (ids.empty()) {
+      break; // EMPTY
+    }
+    taken += ids.size();
+    if (!ranges) {
+      for (uint64_t id : ids) {
+        append_frame(frames, OP_ACK, id);
+        wal_bytes += wal_id_record(WalRecord::Done, id).size();
+      }
+      continue;
+    }
+    vector<pair<uint64_t, uint64_t>> runs = ranges_of(ids);
+    string body;
+    unsigned char pair[16];
+    for (auto [first, last] : runs) {
+      store_be64(pair, first);
+      store_be64(pair + 8, last);
+      body.append(reinterpret_cast<const char *>(pair), sizeof(pair));
+    }
+    append_frame(frames, OP_ACK_RANGES, 0, body);
+    wal_bytes += wal_done_ranges_record(runs).size();
+  }
+  conn.send(frames);
+  double seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  row(ranges ? "ACK_RANGES per window" : "ACK per job", taken, seconds,
+      broker_syscalls(stats) - before, wal_bytes);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t jobs = argc > 1 ? strtoull(argv[1], nullptr, 10) : 200000;
+  string payload(argc > 2 ? strtoul(argv[2], nullptr, 10) : 32, 'x');
+  BrokerConnection stats{ClientOptions{}};
+  if (!stats.open()) {
+    fprintf(stderr, "no broker\n");
+    return 1;
+  }
+
+  printf("%-24s %12s %14s %14s\n", "mode", "jobs/s", "syscalls/job",
+         "WAL bytes/job");
+  for (size_t batch : {1, 64, 1024}) {
+    submit(stats, jobs, batch, payload);
+  }
+  // the first drain row leaves the later submits for the second
+  drain(stats, jobs, false);
+  drain(stats, 2 * jobs, true);
+  return 0;
+}
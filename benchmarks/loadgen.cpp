@@ -0,0 +1,850 @@
+// load generator for a running broker. drives producer and worker connections
+// over the binary protocol and reports throughput plus submit->dispatch and
+// dispatch->ack latency percentiles.
+//
+// producers stamp every payload with its submit time (steady clock, so broker
+// and loadgen must share a host). in closed-loop mode each producer keeps
+// --inflight SUBMITs outstanding and sends the next one when a JOB_ID comes
+// back; in open-loop mode producers submit at a fixed --rate no matter how
+// the broker keeps up, and stamp each job with its scheduled send time so
+// that a stalled broker shows up as latency instead of silently lowering the
+// offered load.
+//
+// workers prefetch, long-poll when idle, optionally spend --work-us per job
+// and ACK or (with --fail-ratio) FAIL it. a failed job is FAILed only on its
+// first delivery and its redelivery is not counted as a dispatch. ACKs have
+// no reply, so after each batch the worker TOUCHes the last ACKed id: the
+// broker handles a connection's frames in order, so the "unknown lease"
+// answer proves every ACK before it was processed. dispatch->ack runs from a
+// job's arrival at the worker to that answer.
+//
+// with --queues the producers spread over named queues, the i-th producer
+// USEs the i-th name (round robin), so a name listed several times gets that
+// many producers, e.g. a noisy tenant next to a quiet one. workers WATCH
+// every queue listed, --weights sets their DRR weights with QUEUE first, and
+// submit->dispatch is also reported per queue.
+//
+// the broker's syscalls and jobs_acked counters are read with STATS at both
+// edges of the measured window, which gives the I/O system calls it makes per
+// job, e.g. to compare its --io=epoll and --io=uring engines. STATS is also
+// sampled every --sample-ms over the whole run for the broker's resident
+// memory, jobs held and ACK rate, to show how it behaves when the offered
+// load is more than the workers can take.
+//
+// the summary goes to stderr, one JSON object per run to stdout.
+//
+//   g++ -std=c++20 -O2 -pthread -I.. loadgen.cpp -o loadgen
+//   ./loadgen --producers=4 --workers=4 --mode=open --rate=50000
+//             --payload-bytes=256 --fail-ratio=0.01 --duration-s=10
+//   ./loadgen --producers=4 --queues=bulk,bulk,bulk,ui --weights=ui:3
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "protocol.h"
+
+using namespace std;
+using Clock = chrono::steady_clock;
+
+struct Options {
+  string host = "127.0.0.1";
+  int port = 5003;
+  size_t producers = 1;
+  size_t workers = 1;
+  bool open_loop = false;
+  double rate = 10000; // jobs/s over all producers, open loop
+  size_t inflight = 16; // per producer, closed loop
+  size_t payload_bytes = 64;
+  uint32_t prefetch = 16;
+  double fail_ratio = 0;
+  uint64_t work_us = 0;
+  double duration_s = 10;
+  double warmup_s = 1;
+  string label;
+  uint64_t sample_ms = 1000;
+  vector<string> queues; // per producer, round robin
+  vector<pair<string, uint64_t>> weights; // QUEUE <name> <weight>
+};
+
+static Options opts;
+static atomic<bool> producing{true};
+static atomic<bool> working{true};
+static Clock::time_point measure_from;
+static Clock::time_point measure_until;
+// the distinct names of opts.queues, a job's index into it is its ninth
+// payload byte
+static vector<string> queue_names;
+
+static int64_t now_ns() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+             Clock::now().time_since_epoch())
+      .count();
+}
+
+static bool in_window(int64_t ns) {
+  Clock::time_point t{chrono::nanoseconds(ns)};
+  return t >= measure_from && t < measure_until;
+}
+
+static int connect_broker() {
+  int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (fd == -1) {
+    return -1;
+  }
+  sockaddr_in addr{};
+  addr.sin_family = AF_INET;
+  addr.sin_port = htons(static_cast<uint16_t>(opts.port));
+  ::inet_pton(AF_INET, opts.host.c_str(), &addr.sin_addr);
+  if (::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) ==
+      -1) {
+    ::close(fd);
+    return -1;
+  }
+  int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  // a broker that stops answering must not hang the run
+  timeval timeout{5, 0};
+  ::setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  return fd;
+}
+
+static bool send_all(int fd, const string &data) {
+  size_t sent = 0;
+  while (sent < data.size()) {
+    ssize_t n =
+        ::send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      return false;
+    }
+    sent += static_cast<size_t>(n);
+  }
+  return true;
+}
+
+// buffered frame reader over a blocking socket
+class FrameReader {
+public:
+  explicit FrameReader(int fd) : fd(fd) {}
+
+  bool read_line(string &line) {
+    while (true) {
+      size_t nl = buffer.find('\n', pos);
+      if (nl != string::npos) {
+        line.assign(buffer, pos, nl - pos);
+        pos = nl + 1;
+        return true;
+      }
+      if (!fill()) {
+        return false;
+      }
+    }
+  }
+
+  bool read_frame(FrameHeader &header, string &payload) {
+    while (buffer.size() - pos < FRAME_HEADER_SIZE) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    header = decode_header(buffer.data() + pos);
+    while (buffer.size() - pos < FRAME_HEADER_SIZE + header.payload_len) {
+      if (!fill()) {
+        return false;
+      }
+    }
+    payload.assign(buffer, pos + FRAME_HEADER_SIZE, header.payload_len);
+    pos += FRAME_HEADER_SIZE + header.payload_len;
+    return true;
+  }
+
+private:
+  int fd;
+  string buffer;
+  size_t pos = 0;
+
+  bool fill() {
+    if (pos > 0) {
+      buffer.erase(0, pos);
+      pos = 0;
+    }
+    char chunk[64 * 1024];
+    ssize_t n = ::recv(fd, chunk, sizeof(chunk), 0);
+    if (n <= 0) {
+      return false;
+    }
+    buffer.append(chunk, static_cast<size_t>(n));
+    return true;
+  }
+};
+
+static bool hello(int fd, FrameReader &reader) {
+  string line = "HELLO BINARY " + to_string(BINARY_PROTOCOL_VERSION) + "\n";
+  if (!send_all(fd, line)) {
+    return false;
+  }
+  string reply;
+  return reader.read_line(reply) && reply + "\n" == line;
+}
+
+struct ServerCounters {
+  bool ok = false;
+  uint64_t syscalls = 0;
+  uint64_t acked = 0;
+  uint64_t refused = 0;
+  uint64_t held = 0;
+  uint64_t resident = 0; // bytes, anonymous memory
+};
+
+static ServerCounters read_server_counters() {
+  ServerCounters counters;
+  int fd = connect_broker();
+  if (fd == -1) {
+    return counters;
+  }
+  FrameReader reader(fd);
+  string line;
+  size_t count = 0;
+  if (send_all(fd, "STATS\n") && reader.read_line(line) &&
+      sscanf(line.c_str(), "STATS %zu", &count) == 1) {
+    bool syscalls = false;
+    for (size_t i = 0; i < count && reader.read_line(line); i++) {
+      char name[64];
+      unsigned long long value;
+      if (sscanf(line.c_str(), "%63s %llu", name, &value) != 2) {
+        continue;
+      }
+      if (strcmp(name, "syscalls") == 0) {
+        counters.syscalls = value;
+        syscalls = true;
+      } else if (strcmp(name, "jobs_acked") == 0) {
+        counters.acked = value;
+      } else if (strcmp(name, "jobs_refused") == 0) {
+        counters.refused = value;
+      } else if (strcmp(name, "jobs_held") == 0) {
+        counters.held = value;
+      } else if (strcmp(name, "resident_anon_bytes") == 0) {
+        counters.resident = value;
+      }
+    }
+    counters.ok = syscalls;
+  }
+  ::close(fd);
+  return counters;
+}
+
+struct Samples {
+  vector<int64_t> submit_to_dispatch; // ns
+  // ns, by index into queue_names
+  vector<vector<int64_t>> queue_dispatch =
+      vector<vector<int64_t>>(queue_names.size());
+  vector<int64_t> dispatch_to_ack;    // ns
+  uint64_t submitted = 0;
+  uint64_t accepted = 0;
+  uint64_t busy = 0;
+  uint64_t errors = 0;
+  uint64_t dispatched = 0;
+  uint64_t redelivered = 0;
+  uint64_t acked = 0;
+  uint64_t failed = 0;
+};
+
+static mutex samples_mutex;
+static Samples totals;
+
+static void merge(Samples &local) {
+  lock_guard<mutex> lock(samples_mutex);
+  auto append = [](vector<int64_t> &to, vector<int64_t> &from) {
+    to.insert(to.end(), from.begin(), from.end());
+  };
+  append(totals.submit_to_dispatch, local.submit_to_dispatch);
+  append(totals.dispatch_to_ack, local.dispatch_to_ack);
+  totals.queue_dispatch.resize(queue_names.size());
+  for (size_t q = 0; q < local.queue_dispatch.size(); q++) {
+    append(totals.queue_dispatch[q], local.queue_dispatch[q]);
+  }
+  totals.submitted += local.submitted;
+  totals.accepted += local.accepted;
+  totals.busy += local.busy;
+  totals.errors += local.errors;
+  totals.dispatched += local.dispatched;
+  totals.redelivered += local.redelivered;
+  totals.acked += local.acked;
+  totals.failed += local.failed;
+}
+
+// ids FAILed once, so that their redelivery is neither failed again nor
+// counted as a fresh dispatch
+static mutex failed_mutex;
+static unordered_set<uint64_t> failed_ids;
+
+static string make_submit(int64_t stamp, uint8_t queue) {
+  string payload(max<size_t>(opts.payload_bytes, 9), 'x');
+  store_be64(reinterpret_cast<unsigned char *>(payload.data()),
+             static_cast<uint64_t>(stamp));
+  payload[8] = static_cast<char>(queue);
+  string frame;
+  append_frame(frame, OP_SUBMIT, 0, payload);
+  return frame;
+}
+
+static void count_reply(const FrameHeader &header, Samples &local) {
+  if (header.opcode == OP_JOB_ID) {
+    local.accepted++;
+  } else if (header.opcode == OP_BUSY) {
+    local.busy++;
+  } else {
+    local.errors++;
+  }
+}
+
+// sends a batch of queue commands and waits for as many answers, false if
+// one of them is an ERROR
+static bool configure(int fd, FrameReader &reader, const string &frames,
+                      size_t replies) {
+  if (!send_all(fd, frames)) {
+    return false;
+  }
+  FrameHeader header;
+  string payload;
+  for (size_t i = 0; i < replies; i++) {
+    if (!reader.read_frame(header, payload)) {
+      return false;
+    }
+    if (header.opcode == OP_ERROR) {
+      cerr << "broker refused a queue command: " << payload << endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+// USE of the producer's queue, or none without --queues
+static bool use_queue(int fd, FrameReader &reader, size_t producer,
+                      uint8_t &queue) {
+  queue = 0;
+  if (opts.queues.empty()) {
+    return true;
+  }
+  const string &name = opts.queues[producer % opts.queues.size()];
+  queue = static_cast<uint8_t>(
+      find(queue_names.begin(), queue_names.end(), name) - queue_names.begin());
+  string frame;
+  append_frame(frame, OP_USE, 0, name);
+  return configure(fd, reader, frame, 1);
+}
+
+static void run_closed_producer(size_t index) {
+  Samples local;
+  int fd = connect_broker();
+  FrameReader reader(fd);
+  uint8_t queue;
+  if (fd == -1 || !hello(fd, reader) || !use_queue(fd, reader, index, queue)) {
+    cerr << "producer could not connect" << endl;
+    return;
+  }
+  FrameHeader header;
+  string payload;
+  size_t outstanding = 0;
+  while (producing.load(memory_order_relaxed) || outstanding > 0) {
+    while (producing.load(memory_order_relaxed) &&
+           outstanding < opts.inflight) {
+      if (!send_all(fd, make_submit(now_ns(), queue))) {
+        break;
+      }
+      local.submitted++;
+      outstanding++;
+    }
+    if (outstanding == 0 || !reader.read_frame(header, payload)) {
+      break;
+    }
+    outstanding--;
+    count_reply(header, local);
+  }
+  ::close(fd);
+  merge(local);
+}
+
+static void run_open_producer(size_t index, double rate) {
+  Samples local;
+  int fd = connect_broker();
+  FrameReader reader(fd);
+  uint8_t queue;
+  if (fd == -1 || !hello(fd, reader) || !use_queue(fd, reader, index, queue)) {
+    cerr << "producer could not connect" << endl;
+    return;
+  }
+  atomic<uint64_t> sent{0};
+  thread replies([&] {
+    Samples counts;
+    FrameHeader header;
+    string payload;
+    uint64_t received = 0;
+    while (producing.load(memory_order_relaxed) ||
+           received < sent.load(memory_order_acquire)) {
+      if (!reader.read_frame(header, payload)) {
+        break;
+      }
+      received++;
+      count_reply(header, counts);
+    }
+    local.accepted = counts.accepted;
+    local.busy = counts.busy;
+    local.errors = counts.errors;
+  });
+
+  auto interval = chrono::nanoseconds(static_cast<int64_t>(1e9 / rate));
+  Clock::time_point next = Clock::now();
+  while (producing.load(memory_order_relaxed)) {
+    Clock::time_point now = Clock::now();
+    if (now < next) {
+      this_thread::sleep_until(next);
+    }
+    // the stamp is when the job was due, not when we got around to it
+    int64_t due = chrono::duration_cast<chrono::nanoseconds>(
+                      next.time_since_epoch())
+                      .count();
+    if (!send_all(fd, make_submit(due, queue))) {
+      break;
+    }
+    sent.fetch_add(1, memory_order_release);
+    next += interval;
+  }
+  local.submitted = sent.load();
+  replies.join();
+  ::close(fd);
+  merge(local);
+}
+
+static void run_worker(unsigned seed) {
+  Samples local;
+  int fd = connect_broker();
+  FrameReader reader(fd);
+  if (fd == -1 || !hello(fd, reader)) {
+    cerr << "worker could not connect" << endl;
+    return;
+  }
+  mt19937_64 rng(seed);
+  uniform_real_distribution<double> coin(0, 1);
+  FrameHeader header;
+  string payload;
+  string out;
+
+  append_frame(out, OP_PREFETCH, opts.prefetch);
+  size_t replies = 1;
+  for (const string &name : queue_names) {
+    append_frame(out, OP_WATCH, 0, name);
+    replies++;
+  }
+  if (!queue_names.empty() &&
+      find(queue_names.begin(), queue_names.end(), "default") ==
+          queue_names.end()) {
+    append_frame(out, OP_IGNORE, 0, string_view("default"));
+    replies++;
+  }
+  if (!configure(fd, reader, out, replies)) {
+    return;
+  }
+
+  struct Received {
+    uint64_t id;
+    int64_t arrived;
+    bool ack;
+  };
+  vector<Received> batch;
+  while (working.load(memory_order_relaxed)) {
+    out.clear();
+    // long-poll briefly so that the stop flag is noticed
+    append_frame(out, OP_REQUEST, 100);
+    if (!send_all(fd, out)) {
+      break;
+    }
+    batch.clear();
+    bool ok = true;
+    do {
+      if (!reader.read_frame(header, payload)) {
+        ok = false;
+        break;
+      }
+      if (header.opcode != OP_JOB) {
+        break;
+      }
+      int64_t arrived = now_ns();
+      local.dispatched++;
+      bool redelivery;
+      {
+        lock_guard<mutex> lock(failed_mutex);
+        redelivery = failed_ids.count(header.job_id) > 0;
+      }
+      if (redelivery) {
+        local.redelivered++;
+      } else if (payload.size() >= 8) {
+        int64_t stamp = static_cast<int64_t>(load_be64(
+            reinterpret_cast<const unsigned char *>(payload.data())));
+        if (in_window(stamp)) {
+          local.submit_to_dispatch.push_back(arrived - stamp);
+          size_t queue = static_cast<uint8_t>(payload[8]);
+          if (queue < local.queue_dispatch.size()) {
+            local.queue_dispatch[queue].push_back(arrived - stamp);
+          }
+        }
+      }
+      bool ack = redelivery || coin(rng) >= opts.fail_ratio;
+      if (!ack) {
+        lock_guard<mutex> lock(failed_mutex);
+        failed_ids.insert(header.job_id);
+      }
+      batch.push_back({header.job_id, arrived, ack});
+    } while (header.flags & FLAG_MORE);
+    if (!ok) {
+      break;
+    }
+    if (batch.empty()) {
+      continue;
+    }
+
+    out.clear();
+    uint64_t fence = 0;
+    for (const Received &job : batch) {
+      if (opts.work_us > 0) {
+        this_thread::sleep_for(chrono::microseconds(opts.work_us));
+      }
+      append_frame(out, job.ack ? OP_ACK : OP_FAIL, job.id);
+      if (job.ack) {
+        fence = job.id;
+      }
+    }
+    if (fence != 0) {
+      append_frame(out, OP_TOUCH, fence);
+    }
+    if (!send_all(fd, out)) {
+      break;
+    }
+    if (fence != 0) {
+      if (!reader.read_frame(header, payload)) {
+        break;
+      }
+      int64_t done = now_ns();
+      for (const Received &job : batch) {
+        if (job.ack) {
+          local.acked++;
+          if (in_window(job.arrived)) {
+            local.dispatch_to_ack.push_back(done - job.arrived);
+          }
+        } else {
+          local.failed++;
+        }
+      }
+    } else {
+      local.failed += batch.size();
+    }
+  }
+  ::close(fd);
+  merge(local);
+}
+
+struct Percentiles {
+  double p50, p99, p999, max;
+};
+
+// microseconds
+static Percentiles percentiles(vector<int64_t> &ns) {
+  if (ns.empty()) {
+    return {0, 0, 0, 0};
+  }
+  sort(ns.begin(), ns.end());
+  auto at = [&](double q) {
+    size_t rank = static_cast<size_t>(ceil(q * static_cast<double>(ns.size())));
+    return static_cast<double>(ns[rank == 0 ? 0 : rank - 1]) / 1000.0;
+  };
+  return {at(0.50), at(0.99), at(0.999), static_cast<double>(ns.back()) / 1000.0};
+}
+
+static void usage(const char *prog) {
+  cerr << "Usage: " << prog
+       << " [--host=ADDR] [--port=N] [--producers=N] [--workers=N]"
+          " [--mode=open|closed] [--rate=JOBS_PER_S] [--inflight=N]"
+          " [--payload-bytes=N] [--prefetch=N] [--fail-ratio=F]"
+          " [--work-us=N] [--duration-s=S] [--warmup-s=S] [--label=TEXT]"
+          " [--queues=NAME,...] [--weights=NAME:W,...] [--sample-ms=N]"
+       << endl;
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    size_t eq = arg.find('=');
+    string key = arg.substr(0, eq);
+    string value = (eq == string::npos) ? "" : arg.substr(eq + 1);
+    try {
+      if (key == "--host") {
+        opts.host = value;
+      } else if (key == "--port") {
+        opts.port = stoi(value);
+      } else if (key == "--producers") {
+        opts.producers = stoul(value);
+      } else if (key == "--workers") {
+        opts.workers = stoul(value);
+      } else if (key == "--mode" && (value == "open" || value == "closed")) {
+        opts.open_loop = value == "open";
+      } else if (key == "--rate") {
+        opts.rate = stod(value);
+      } else if (key == "--inflight") {
+        opts.inflight = max<size_t>(1, stoul(value));
+      } else if (key == "--payload-bytes") {
+        opts.payload_bytes = stoul(value);
+      } else if (key == "--prefetch") {
+        opts.prefetch = static_cast<uint32_t>(max<unsigned long>(1, stoul(value)));
+      } else if (key == "--fail-ratio") {
+        opts.fail_ratio = stod(value);
+      } else if (key == "--work-us") {
+        opts.work_us = stoull(value);
+      } else if (key == "--duration-s") {
+        opts.duration_s = stod(value);
+      } else if (key == "--warmup-s") {
+        opts.warmup_s = stod(value);
+      } else if (key == "--label") {
+        opts.label = value;
+      } else if (key == "--sample-ms") {
+        opts.sample_ms = max<uint64_t>(1, stoull(value));
+      } else if (key == "--queues" || key == "--weights") {
+        size_t start = 0;
+        while (start <= value.size()) {
+          size_t comma = min(value.find(',', start), value.size());
+          string item = value.substr(start, comma - start);
+          start = comma + 1;
+          if (key == "--queues") {
+            opts.queues.push_back(item);
+            continue;
+          }
+          size_t colon = item.find(':');
+          if (colon == string::npos) {
+            throw invalid_argument(item);
+          }
+          opts.weights.emplace_back(item.substr(0, colon),
+                                    stoull(item.substr(colon + 1)));
+        }
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } catch (...) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  for (const string &name : opts.queues) {
+    if (find(queue_names.begin(), queue_names.end(), name) ==
+        queue_names.end()) {
+      queue_names.push_back(name);
+    }
+  }
+  if (queue_names.size() > 256) {
+    cerr << "at most 256 queues" << endl;
+    return 1;
+  }
+  if (!opts.weights.empty()) {
+    int fd = connect_broker();
+    FrameReader reader(fd);
+    string frames;
+    for (const auto &[name, weight] : opts.weights) {
+      append_frame(frames, OP_QUEUE, weight, name);
+    }
+    bool ok = fd != -1 && hello(fd, reader) &&
+              configure(fd, reader, frames, opts.weights.size());
+    if (fd != -1) {
+      ::close(fd);
+    }
+    if (!ok) {
+      cerr << "could not set queue weights" << endl;
+      return 1;
+    }
+  }
+
+  auto start = Clock::now();
+  measure_from = start + chrono::duration_cast<Clock::duration>(
+                             chrono::duration<double>(opts.warmup_s));
+  measure_until = measure_from + chrono::duration_cast<Clock::duration>(
+                                     chrono::duration<double>(opts.duration_s));
+
+  vector<thread> workers;
+  for (size_t i = 0; i < opts.workers; i++) {
+    workers.emplace_back(run_worker, static_cast<unsigned>(i + 1));
+  }
+  vector<thread> producers;
+  for (size_t i = 0; i < opts.producers; i++) {
+    if (opts.open_loop) {
+      producers.emplace_back(run_open_producer, i,
+                             opts.rate / static_cast<double>(opts.producers));
+    } else {
+      producers.emplace_back(run_closed_producer, i);
+    }
+  }
+
+  struct Sample {
+    double t;
+    ServerCounters counters;
+  };
+  vector<Sample> timeline;
+  atomic<bool> sampling{true};
+  thread sampler([&] {
+    auto next = start;
+    while (sampling.load()) {
+      next += chrono::milliseconds(opts.sample_ms);
+      this_thread::sleep_until(next);
+      ServerCounters counters = read_server_counters();
+      if (counters.ok) {
+        timeline.push_back(
+            {chrono::duration<double>(Clock::now() - start).count(), counters});
+      }
+    }
+  });
+
+  this_thread::sleep_until(measure_from);
+  ServerCounters before = read_server_counters();
+  this_thread::sleep_until(measure_until);
+  ServerCounters after = read_server_counters();
+  sampling = false;
+  sampler.join();
+  producing = false;
+  for (auto &t : producers) {
+    t.join();
+  }
+  // give the workers a moment to drain what is still queued
+  this_thread::sleep_for(chrono::seconds(1));
+  working = false;
+  for (auto &t : workers) {
+    t.join();
+  }
+
+  double seconds = opts.duration_s;
+  double window_dispatches = static_cast<double>(totals.submit_to_dispatch.size());
+  Percentiles dispatch = percentiles(totals.submit_to_dispatch);
+  Percentiles ack = percentiles(totals.dispatch_to_ack);
+  // the STATS connections themselves cost a handful, negligible over a run
+  string syscalls_per_job = "null";
+  if (before.ok && after.ok && after.acked > before.acked) {
+    char number[32];
+    snprintf(number, sizeof(number), "%.2f",
+             double(after.syscalls - before.syscalls) /
+                 double(after.acked - before.acked));
+    syscalls_per_job = number;
+  }
+
+  fprintf(stderr,
+          "%s loop, %zu producers, %zu workers, %zu B payloads, fail ratio "
+          "%.3f\n"
+          "submitted %llu, accepted %llu, busy %llu, errors %llu\n"
+          "dispatched %llu (%llu redelivered), acked %llu, failed %llu\n"
+          "throughput %.0f jobs/s in the measured window\n"
+          "submit->dispatch us  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n"
+          "dispatch->ack    us  p50 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n"
+          "broker syscalls per job %s\n",
+          opts.open_loop ? "open" : "closed", opts.producers, opts.workers,
+          opts.payload_bytes, opts.fail_ratio,
+          (unsigned long long)totals.submitted,
+          (unsigned long long)totals.accepted, (unsigned long long)totals.busy,
+          (unsigned long long)totals.errors,
+          (unsigned long long)totals.dispatched,
+          (unsigned long long)totals.redelivered,
+          (unsigned long long)totals.acked, (unsigned long long)totals.failed,
+          window_dispatches / seconds, dispatch.p50, dispatch.p99,
+          dispatch.p999, dispatch.max, ack.p50, ack.p99, ack.p999, ack.max,
+          syscalls_per_job.c_str());
+
+  // broker memory and ACK rate over the run
+  string samples;
+  for (size_t i = 0; i < timeline.size(); i++) {
+    const Sample &s = timeline[i];
+    double acked_s = 0, refused_s = 0;
+    if (i > 0) {
+      double dt = s.t - timeline[i - 1].t;
+      acked_s = double(s.counters.acked - timeline[i - 1].counters.acked) / dt;
+      refused_s =
+          double(s.counters.refused - timeline[i - 1].counters.refused) / dt;
+    }
+    double rss_mb = double(s.counters.resident) / (1 << 20);
+    fprintf(stderr,
+            "  t %5.1fs  rss %8.1f MB  held %10llu  acked/s %9.0f  busy/s "
+            "%9.0f\n",
+            s.t, rss_mb, (unsigned long long)s.counters.held, acked_s,
+            refused_s);
+    char entry[160];
+    snprintf(entry, sizeof(entry),
+             "%s{\"t\":%.1f,\"rss_mb\":%.1f,\"held\":%llu,"
+             "\"acked_s\":%.0f,\"busy_s\":%.0f}",
+             i == 0 ? "" : ",", s.t, rss_mb,
+             (unsigned long long)s.counters.held, acked_s, refused_s);
+    samples += entry;
+  }
+
+  string per_queue;
+  for (size_t q = 0; q < queue_names.size(); q++) {
+    Percentiles wait = percentiles(totals.queue_dispatch[q]);
+    fprintf(stderr,
+            "  queue %-12s %8zu dispatched  p50 %.1f  p99 %.1f  p99.9 %.1f "
+            "us\n",
+            queue_names[q].c_str(), totals.queue_dispatch[q].size(), wait.p50,
+            wait.p99, wait.p999);
+    char entry[256];
+    snprintf(entry, sizeof(entry),
+             "%s\"%s\":{\"dispatched\":%zu,\"p50\":%.1f,\"p99\":%.1f,"
+             "\"p999\":%.1f}",
+             q == 0 ? "" : ",", queue_names[q].c_str(),
+             totals.queue_dispatch[q].size(), wait.p50, wait.p99, wait.p999);
+    per_queue += entry;
+  }
+
+  string label;
+  for (char c : opts.label) {
+    if (c == '"' || c == '\\') {
+      label += '\\';
+    }
+    label += c;
+  }
+  printf("{\"label\":\"%s\",\"mode\":\"%s\",\"producers\":%zu,\"workers\":%zu,"
+         "\"payload_bytes\":%zu,\"rate\":%.0f,\"inflight\":%zu,"
+         "\"prefetch\":%u,\"fail_ratio\":%.4f,\"work_us\":%llu,"
+         "\"duration_s\":%.2f,\"submitted\":%llu,\"accepted\":%llu,"
+         "\"busy\":%llu,\"errors\":%llu,\"dispatched\":%llu,"
+         "\"redelivered\":%llu,\"acked\":%llu,\"failed\":%llu,"
+         "\"throughput_jobs_s\":%.1f,"
+         "\"submit_to_dispatch_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,"
+         "\"max\":%.1f},"
+         "\"dispatch_to_ack_us\":{\"p50\":%.1f,\"p99\":%.1f,\"p999\":%.1f,"
+         "\"max\":%.1f},\"server_syscalls_per_job\":%s,"
+         "\"queues\":{%s},\"samples\":[%s]}\n",
+         label.c_str(), opts.open_loop ? "open" : "closed", opts.producers,
+         opts.workers, opts.payload_bytes, opts.open_loop ? opts.rate : 0.0,
+         opts.open_loop ? 0 : opts.inflight, opts.prefetch, opts.fail_ratio,
+         (unsigned long long)opts.work_us, seconds,
+         (unsigned long long)totals.submitted,
+         (unsigned long long)totals.accepted, (unsigned long long)totals.busy,
+         (unsigned long long)totals.errors,
+         (unsigned long long)totals.dispatched,
+         (unsigned long long)totals.redelivered,
+         (unsigned long long)totals.acked, (unsigned long long)totals.failed,
+         window_dispatches / seconds, dispatch.p50, dispatch.p99,
+         dispatch.p999, dispatch.max, ack.p50, ack.p99, ack.p999, ack.max,
+         syscalls_per_job.c_str(), per_queue.c_str(), samples.c_str());
+}
@@ -0,0 +1,170 @@
+// bytes allocated and copied per job along the broker's payload path, for the
+// old std::string job_text against slab-backed shared Payloads. every job is
+// taken from the input buffer, logged as an ADD record in a WAL batch, queued,
+// leased, written to the worker's output queue and requeued once before being
+// acknowledged, i.e. the route of a job that fails once.
+//
+// allocations are counted by replacing the global operator new, copies are
+// counted at each step that duplicates payload bytes.
+//
+//   g++ -std=c++20 -O2 -pthread -I.. payload_copies.cpp -o payload_copies
+//   ./payload_copies [jobs_per_size]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <new>
+#include <string>
+#include <vector>
+
+#include "io_chain.h"
+#include "job_store.h"
+#include "wal.h"
+
+using namespace std;
+
+static atomic<uint64_t> allocated_bytes{0};
+
+void *operator new(size_t n) {
+  allocated_bytes.fetch_add(n, memory_order_relaxed);
+  if (void *p = malloc(n)) {
+    return p;
+  }
+  throw bad_alloc();
+}
+
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+const size_t WAL_BATCH = 64;
+
+struct Result {
+  double alloc_per_job;
+  double copied_per_job;
+  double ns_per_job;
+};
+
+// the pre-slab path: each arrow below copied the payload into a new string
+static Result run_strings(const string &input, size_t n) {
+  struct StringJob {
+    uint64_t job_id;
+    string job_text;
+  };
+  deque<StringJob> queue;
+  string wal_pending;
+  string out;
+  uint64_t copied = 0;
+  uint64_t sink = 0;
+
+  uint64_t before = allocated_bytes.load();
+  auto start = chrono::steady_clock::now();
+  for (uint64_t id = 1; id <= n; id++) {
+    StringJob job{id, string(input)}; // input ring -> job
+    copied += input.size();
+    string record = "ADD " + to_string(id) + " " + job.job_text + "\n";
+    copied += input.size();
+    wal_pending += record; // record -> batch
+    copied += input.size();
+    if (id % WAL_BATCH == 0) {
+      sink += wal_pending.size();
+      wal_pending.clear();
+    }
+    queue.push_back(std::move(job));
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+      StringJob leased = std::move(queue.front());
+      queue.pop_front();
+      out += to_string(leased.job_id); // reply -> output buffer
+      out += ' ';
+      out += leased.job_text;
+      out += '\n';
+      copied += input.size();
+      sink += out.size();
+      out.clear();
+      if (attempt == 0) {
+        queue.push_back(std::move(leased)); // FAIL, requeue
+      }
+    }
+  }
+  chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+  uint64_t alloc = allocated_bytes.load() - before;
+  if (sink == 0) {
+    puts("");
+  }
+  return {double(alloc) / n, double(copied) / n, elapsed.count() / n};
+}
+
+static Result run_payloads(const string &input, size_t n) {
+  deque<Job> queue;
+  IoChain wal_pending;
+  IoChain out;
+  iovec iov[64];
+  uint64_t copied = 0;
+  uint64_t sink = 0;
+  // bytes an IoChain copies instead of referencing
+  size_t chained = input.size() < IoChain::SHARE_BYTES ? input.size() : 0;
+
+  uint64_t before = allocated_bytes.load();
+  auto start = chrono::steady_clock::now();
+  for (uint64_t id = 1; id <= n; id++) {
+    Job job{id, Payload(input)}; // input ring -> slab block, the only copy
+    copied += input.size();
+    wal_pending.append(wal_add_head(id, 0, 0, job.job_text));
+    wal_pending.append(job.job_text);
+    copied += chained;
+    if (id % WAL_BATCH == 0) {
+      while (!wal_pending.empty()) {
+        int count = wal_pending.gather(iov, 64);
+        size_t len = 0;
+        for (int i = 0; i < count; i++) {
+          len += iov[i].iov_len;
+        }
+        sink += len;
+        wal_pending.consume(len);
+      }
+    }
+    queue.push_back(std::move(job));
+
+    for (int attempt = 0; attempt < 2; attempt++) {
+      Job leased = std::move(queue.front());
+      queue.pop_front();
+      out += to_string(leased.job_id);
+      out += ' ';
+      out.append(leased.job_text);
+      out += '\n';
+      copied += chained;
+      sink += out.size();
+      out.clear();
+      if (attempt == 0) {
+        queue.push_back(std::move(leased));
+      }
+    }
+  }
+  chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+  uint64_t alloc = allocated_bytes.load() - before;
+  if (sink == 0) {
+    puts("");
+  }
+  return {double(alloc) / n, double(copied) / n, elapsed.count() / n};
+}
+
+int main(int argc, char *argv[]) {
+  size_t jobs = argc > 1 ? stoull(argv[1]) : 20000;
+
+  printf("%8s %8s %14s %14s %10s\n", "payload", "storage", "alloc B/job",
+         "copied B/job", "ns/job");
+  for (size_t size : {size_t(64), size_t(4096), size_t(256 * 1024)}) {
+    string input(size, 'x');
+    // warm both paths up so that slabs and string capacity are in place
+    run_strings(input, WAL_BATCH);
+    run_payloads(input, WAL_BATCH);
+    Result s = run_strings(input, jobs);
+    Result p = run_payloads(input, jobs);
+    printf("%8zu %8s %14.0f %14.0f %10.0f\n", size, "string", s.alloc_per_job,
+           s.copied_per_job, s.ns_per_job);
+    printf("%8zu %8s %14.0f %14.0f %10.0f\n", size, "slab", p.alloc_per_job,
+           p.copied_per_job, p.ns_per_job);
+  }
+}
@@ -0,0 +1,132 @@
+// jobs/s a single producer process gets out of a running broker, the old way
+// against the client library. "connection per job" is what producer.cpp used
+// to do for every job (connect, text SUBMIT, read the JOB_ID a byte per
+// recv(), close), minus the process start it also paid since it took one
+// job per run. the library rows keep one connection: one submit at a time,
+// then pipelined with a window of outstanding submits, then in batches that
+// go out in a single write.
+//
+//   (libdsjq_client.a built in the repo root, see client.h)
+//   g++ -std=c++20 -O2 -pthread -I.. producer_throughput.cpp -L.. -ldsjq_client -o producer_throughput
+//   ./producer_throughput [seconds_per_run] [payload_bytes]
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "client.h"
+
+using namespace std;
+
+const int PORT = 5003;
+
+static bool submit_with_new_connection(const string &job) {
+  int sock = ::socket(AF_INET, SOCK_STREAM, 0);
+  if (sock == -1) {
+    return false;
+  }
+  sockaddr_in server{};
+  server.sin_family = AF_INET;
+  server.sin_port = htons(PORT);
+  inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
+  if (::connect(sock, (sockaddr *)&server, sizeof(server)) == -1) {
+    ::close(sock);
+    return false;
+  }
+  string message = "SUBMIT " + job + "\n";
+  bool ok = ::send(sock, message.c_str(), message.size(), 0) ==
+            static_cast<ssize_t>(message.size());
+  string reply;
+  char c;
+  while (ok && ::recv(sock, &c, 1, 0) == 1 && c != '\n') {
+    reply.push_back(c);
+  }
+  ::close(sock);
+  return reply.rfind("JOB_ID ", 0) == 0;
+}
+
+struct Run {
+  uint64_t accepted = 0;
+  uint64_t rejected = 0;
+};
+
+template <typename Fn> static double timed(double seconds, Fn &&step) {
+  Run run;
+  auto start = chrono::steady_clock::now();
+  auto until = start + chrono::duration<double>(seconds);
+  while (chrono::steady_clock::now() < until) {
+    step(run);
+  }
+  double elapsed =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  if (run.rejected > 0) {
+    fprintf(stderr, "  %llu submits rejected\n",
+            static_cast<unsigned long long>(run.rejected));
+  }
+  return static_cast<double>(run.accepted) / elapsed;
+}
+
+static void count(Run &run, const SubmitResult &result) {
+  if (result.status == SubmitStatus::Ok) {
+    run.accepted++;
+  } else {
+    run.rejected++;
+  }
+}
+
+int main(int argc, char *argv[]) {
+  double seconds = argc > 1 ? atof(argv[1]) : 3.0;
+  size_t payload_bytes = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+  string payload(payload_bytes, 'x');
+
+  printf("%-28s %12s\n", "mode", "jobs/s");
+  double before = timed(seconds, [&](Run &run) {
+    if (submit_with_new_connection(payload)) {
+      run.accepted++;
+    } else {
+      run.rejected++;
+    }
+  });
+  printf("%-28s %12.0f\n", "connection per job", before);
+
+  Producer producer;
+  double sync = timed(seconds, [&](Run &run) {
+    count(run, producer.submit_sync(payload));
+  });
+  printf("%-28s %12.0f %7.1fx\n", "one connection, sync", sync,
+         sync / before);
+
+  for (size_t window : {16, 256}) {
+    deque<future<SubmitResult>> inflight;
+    double rate = timed(seconds, [&](Run &run) {
+      while (inflight.size() < window) {
+        inflight.push_back(producer.submit(payload));
+      }
+      count(run, inflight.front().get());
+      inflight.pop_front();
+    });
+    while (!inflight.empty()) {
+      inflight.front().get();
+      inflight.pop_front();
+    }
+    string mode = "pipelined, window " + to_string(window);
+    printf("%-28s %12.0f %7.1fx\n", mode.c_str(), rate, rate / before);
+  }
+
+  vector<string> batch(64, payload);
+  double batched = timed(seconds, [&](Run &run) {
+    for (auto &result : producer.submit_batch(batch)) {
+      count(run, result.get());
+    }
+  });
+  printf("%-28s %12.0f %7.1fx\n", "batches of 64", batched, batched / before);
+  return 0;
+}
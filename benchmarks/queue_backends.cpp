@@ -0,0 +1,101 @@
+// pending-queue engines head to head: the original queue<Job> + job_mutex
+// against the lock-free MPMC ring, for single and multi producer/consumer
+// mixes. producers push a fixed number of 64 byte jobs, consumers pop until
+// all of them are through, and the wall time gives jobs/sec.
+//
+//   g++ -std=c++20 -O2 -pthread -I.. queue_backends.cpp -o queue_backends
+//   ./queue_backends [jobs_per_producer]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <mutex>
+#include <queue>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "job_store.h"
+#include "mpmc_ring.h"
+
+using namespace std;
+
+struct LockedQueue {
+  queue<Job> jobs;
+  mutex job_mutex;
+
+  bool push(Job &job) {
+    lock_guard<mutex> lock(job_mutex);
+    jobs.push(std::move(job));
+    return true;
+  }
+
+  bool pop(Job &out) {
+    lock_guard<mutex> lock(job_mutex);
+    if (jobs.empty()) {
+      return false;
+    }
+    out = std::move(jobs.front());
+    jobs.pop();
+    return true;
+  }
+};
+
+struct RingQueue {
+  MpmcRing<Job> ring{4096};
+
+  bool push(Job &job) { return ring.try_push(job); }
+  bool pop(Job &out) { return ring.try_pop(out); }
+};
+
+template <typename Q>
+static double run(size_t producers, size_t consumers, uint64_t per_producer) {
+  Q q;
+  uint64_t total = producers * per_producer;
+  atomic<uint64_t> consumed{0};
+  vector<thread> pool;
+
+  auto start = chrono::steady_clock::now();
+  for (size_t p = 0; p < producers; p++) {
+    pool.emplace_back([&, p] {
+      Payload payload(string(64, 'x'));
+      for (uint64_t i = 0; i < per_producer; i++) {
+        Job job{p * per_producer + i, payload};
+        while (!q.push(job)) {
+          this_thread::yield();
+        }
+      }
+    });
+  }
+  for (size_t c = 0; c < consumers; c++) {
+    pool.emplace_back([&] {
+      Job job;
+      while (consumed.load(memory_order_relaxed) < total) {
+        if (q.pop(job)) {
+          consumed.fetch_add(1, memory_order_relaxed);
+        } else {
+          this_thread::yield();
+        }
+      }
+    });
+  }
+  for (auto &t : pool) {
+    t.join();
+  }
+  chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+  return total / elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t per_producer = argc > 1 ? stoull(argv[1]) : 1000000;
+
+  printf("%4s %4s %18s %18s %8s\n", "prod", "cons", "queue+mutex jobs/s",
+         "mpmc ring jobs/s", "speedup");
+  for (auto [p, c] : vector<pair<size_t, size_t>>{
+           {1, 1}, {1, 4}, {4, 1}, {4, 4}, {8, 8}}) {
+    double locked = run<LockedQueue>(p, c, per_producer / p);
+    double ring = run<RingQueue>(p, c, per_producer / p);
+    printf("%4zu %4zu %18.0f %18.0f %8.2f\n", p, c, locked, ring,
+           ring / locked);
+  }
+}
@@ -0,0 +1,121 @@
+// a deep backlog with and without the spill tier. fills one queue with
+// <jobs> jobs of <payload_bytes>, then drains it a job at a time the way a
+// REQUEST does and reports the fill rate, the anonymous resident memory once
+// everything is queued, the latency of every pop at the head (spinning while
+// a refill is on its way counts against the pop) and the drain rate. every
+// mode runs in a child process of its own so that memory one of them leaves
+// behind with the allocator does not show up in the next.
+//
+//   g++ -std=c++20 -O2 -pthread -I.. spill_backlog.cpp -o spill_backlog
+//   ./spill_backlog [jobs] [payload_bytes] [window] [spill_dir] [modes]
+//
+// modes is memory, spill or both (the default); a backlog that does not fit
+// in RAM can only be run as spill.
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "metrics.h"
+#include "queue_registry.h"
+
+using namespace std;
+
+static double anon_mb() {
+  FILE *statm = fopen("/proc/self/statm", "r");
+  unsigned long long size = 0, resident = 0, shared = 0;
+  if (statm == nullptr || fscanf(statm, "%llu %llu %llu", &size, &resident,
+                                 &shared) != 3) {
+    return 0;
+  }
+  fclose(statm);
+  return static_cast<double>(resident - shared) *
+         static_cast<double>(sysconf(_SC_PAGESIZE)) / (1 << 20);
+}
+
+static void run(const char *mode, uint64_t jobs, size_t payload_bytes,
+                const SpillConfig &config) {
+  QueueRegistry registry(1, 16, QueueBackend::Locked, 4096, {});
+  if (!registry.start_spilling(config, nullptr)) {
+    perror(config.dir.c_str());
+    exit(1);
+  }
+  NamedQueue &queue = registry.at(QueueRegistry::DEFAULT_QUEUE);
+  string payload(payload_bytes, 'x');
+
+  auto start = chrono::steady_clock::now();
+  for (uint64_t i = 0; i < jobs; i++) {
+    registry.push(queue, Job{registry.next_id(), Payload(payload)});
+  }
+  double fill_s =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  // let the spill thread write out what is still buffered
+  this_thread::sleep_for(chrono::milliseconds(100));
+  double rss = anon_mb();
+
+  Histogram latency;
+  vector<Job> out;
+  uint64_t taken = 0;
+  start = chrono::steady_clock::now();
+  while (taken < jobs) {
+    int64_t began = steady_now_ns();
+    out.clear();
+    // a worker would park here; yielding leaves the core to the spill
+    // thread like parking does
+    while (registry.pop(queue, 0, 1, out) == 0) {
+      this_thread::yield();
+    }
+    latency.record(static_cast<uint64_t>(steady_now_ns() - began));
+    taken++;
+  }
+  double drain_s =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  Histogram::Snapshot pops;
+  latency.merge_into(pops);
+  printf("%-10s %12.0f %10.1f %9.2f %9.2f %9.2f %10.1f %12.0f\n", mode,
+         static_cast<double>(jobs) / fill_s, rss,
+         static_cast<double>(pops.quantile(0.5)) / 1000,
+         static_cast<double>(pops.quantile(0.99)) / 1000,
+         static_cast<double>(pops.quantile(0.999)) / 1000,
+         static_cast<double>(pops.max) / 1000,
+         static_cast<double>(jobs) / drain_s);
+  fflush(stdout);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t jobs = argc > 1 ? strtoull(argv[1], nullptr, 10) : 10000000;
+  size_t payload_bytes = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+  SpillConfig spill;
+  spill.window = argc > 3 ? strtoul(argv[3], nullptr, 10) : 65536;
+  spill.dir = argc > 4 ? argv[4] : "spill-bench";
+  string modes = argc > 5 ? argv[5] : "both";
+
+  printf("%llu jobs of %zu bytes, window %zu\n",
+         static_cast<unsigned long long>(jobs), payload_bytes, spill.window);
+  printf("%-10s %12s %10s %9s %9s %9s %10s %12s\n", "mode", "fill/s",
+         "anon MB", "p50 us", "p99 us", "p999 us", "max us", "drain/s");
+  SpillConfig memory;
+  memory.window = 0;
+  fflush(stdout);
+  for (auto [mode, config] : {pair{"memory", memory}, pair{"spill", spill}}) {
+    if (modes != "both" && modes != mode) {
+      continue;
+    }
+    pid_t child = fork();
+    if (child == 0) {
+      run(mode, jobs, payload_bytes, config);
+      _exit(0);
+    }
+    int status;
+    waitpid(child, &status, 0);
+  }
+  rmdir(spill.dir.c_str());
+  return 0;
+}
@@ -0,0 +1,66 @@
+// SUBMIT+REQUEST throughput of the job store as connection threads go from 1
+// to 32. every thread plays one connection: it pushes a job and immediately
+// leases one back from its home shard, which is exactly the store traffic of
+// a SUBMIT followed by a REQUEST. one shard is the old single job_mutex.
+//
+//   g++ -std=c++20 -O2 -pthread -I.. store_contention.cpp -o store_contention
+//   ./store_contention [shards] [seconds_per_run]
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "job_store.h"
+
+using namespace std;
+
+static double run(size_t shards, size_t threads, double seconds) {
+  JobStore store(shards);
+  atomic<bool> stop{false};
+  vector<uint64_t> ops(threads, 0);
+  vector<thread> pool;
+
+  for (size_t t = 0; t < threads; t++) {
+    pool.emplace_back([&, t] {
+      Payload payload(string(64, 'x'));
+      vector<Job> taken;
+      uint64_t done = 0;
+      while (!stop.load(memory_order_relaxed)) {
+        store.push({store.next_id(), payload});
+        taken.clear();
+        store.pop(t % store.shard_count(), 1, taken);
+        done++;
+      }
+      ops[t] = done;
+    });
+  }
+
+  this_thread::sleep_for(chrono::duration<double>(seconds));
+  stop = true;
+  for (auto &th : pool) {
+    th.join();
+  }
+
+  uint64_t total = 0;
+  for (uint64_t n : ops) {
+    total += n;
+  }
+  return total / seconds;
+}
+
+int main(int argc, char *argv[]) {
+  size_t shards = argc > 1 ? stoul(argv[1]) : 64;
+  double seconds = argc > 2 ? stod(argv[2]) : 1.0;
+
+  printf("%8s %16s %16s %8s\n", "threads", "1 shard ops/s",
+         (to_string(shards) + " shards ops/s").c_str(), "speedup");
+  for (size_t threads : {1, 2, 4, 8, 16, 32}) {
+    double single = run(1, threads, seconds);
+    double sharded = run(shards, threads, seconds);
+    printf("%8zu %16.0f %16.0f %8.2f\n", threads, single, sharded,
+           sharded / single);
+  }
+}
@@ -0,0 +1,134 @@
+// what LZ4 buys a WAL bound by sync bandwidth, with JSON payloads shaped
+// like the ones our producers send. for every payload size the same jobs are
+// appended to a fresh WalWriter twice: as they are, and packed the way the
+// client library packs them. a run ends once the writer reports the last
+// record durable. prints the compression ratio and speed (spent by the
+// producer, not the broker), jobs/s made durable, and MB/s of job text and
+// of log written.
+//
+//   g++ -std=c++20 -O2 -pthread -I.. wal_compression.cpp -o wal_compression
+//   ./wal_compression [megabytes_per_run] [dir]
+
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <future>
+#include <random>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "lz4.h"
+#include "wal.h"
+
+using namespace std;
+
+// an order event padded out with line items to about size bytes
+static string json_job(mt19937 &rng, size_t size) {
+  string job = "{\"tenant\":\"acme-" + to_string(rng() % 50) +
+               "\",\"event\":\"order.created\",\"order_id\":" +
+               to_string(rng()) + ",\"items\":[";
+  for (int i = 0; job.size() + 80 < size; i++) {
+    job += i ? "," : "";
+    job += "{\"sku\":\"SKU-" + to_string(10000 + rng() % 5000) +
+           "\",\"qty\":" + to_string(1 + rng() % 9) + ",\"price\":" +
+           to_string(rng() % 10000 / 100.0).substr(0, 5) + "}";
+  }
+  job += "],\"currency\":\"EUR\",\"status\":\"pending\"}";
+  return job;
+}
+
+struct Run {
+  double seconds;
+  size_t logged_bytes;
+};
+
+static Run log_jobs(const string &dir, const vector<Payload> &jobs,
+                    bool compressed) {
+  WalConfig config;
+  config.dir = dir;
+  config.legacy_path = dir + "/none";
+  // nothing to snapshot here, the runs only measure appends and syncs
+  config.snapshot_segments = SIZE_MAX;
+  config.snapshot_interval = chrono::hours(24);
+  WalWriter wal;
+  if (!wal.open(config)) {
+    perror(dir.c_str());
+    exit(1);
+  }
+  promise<void> done;
+  size_t logged = 0;
+  auto start = chrono::steady_clock::now();
+  for (size_t i = 0; i < jobs.size(); i++) {
+    string head = wal_add_head(i + 1, 0, 0, jobs[i], 0, compressed);
+    logged += head.size() + jobs[i].size();
+    WalWriter::Callback last = nullptr;
+    if (i + 1 == jobs.size()) {
+      last = [&done](bool) { done.set_value(); };
+    }
+    wal.append(head, jobs[i], std::move(last));
+  }
+  done.get_future().wait();
+  double seconds =
+      chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  wal.close();
+  WalFiles files = list_wal_files(dir);
+  for (uint64_t seq : files.segments) {
+    unlink(wal_segment_path(dir, seq).c_str());
+  }
+  rmdir(dir.c_str());
+  return {seconds, logged};
+}
+
+int main(int argc, char *argv[]) {
+  size_t budget = (argc > 1 ? strtoul(argv[1], nullptr, 10) : 256) << 20;
+  string dir = argc > 2 ? argv[2] : "wal-compression";
+  mkdir(dir.c_str(), 0755);
+  mt19937 rng(42);
+
+  printf("%-8s %-6s %7s %11s %11s %12s %12s\n", "payload", "mode", "ratio",
+         "lz4 MB/s", "jobs/s", "text MB/s", "log MB/s");
+  for (size_t size : {512, 4096, 16384}) {
+    size_t count = budget / size;
+    vector<string> texts;
+    size_t text_bytes = 0;
+    for (size_t i = 0; i < count; i++) {
+      texts.push_back(json_job(rng, size));
+      text_bytes += texts.back().size();
+    }
+
+    vector<Payload> raw, packed;
+    for (const string &text : texts) {
+      raw.emplace_back(text);
+    }
+    string scratch;
+    size_t packed_bytes = 0;
+    auto start = chrono::steady_clock::now();
+    for (const string &text : texts) {
+      scratch.clear();
+      lz4_pack(text, scratch);
+      packed.emplace_back(scratch);
+      packed_bytes += scratch.size();
+    }
+    double pack_s =
+        chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+    for (bool compressed : {false, true}) {
+      Run run = log_jobs(dir + "/" + to_string(size), compressed ? packed : raw,
+                         compressed);
+      printf("%-8zu %-6s %7.2f %11s %11.0f %12.1f %12.1f\n", size,
+             compressed ? "lz4" : "raw",
+             compressed ? static_cast<double>(packed_bytes) / text_bytes : 1.0,
+             compressed ? to_string(static_cast<int>(text_bytes / pack_s /
+                                                     (1 << 20)))
+                              .c_str()
+                        : "-",
+             count / run.seconds, text_bytes / run.seconds / (1 << 20),
+             run.logged_bytes / run.seconds / (1 << 20));
+    }
+  }
+  rmdir(dir.c_str());
+  return 0;
+}
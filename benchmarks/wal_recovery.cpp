@@ -0,0 +1,92 @@
+// startup recovery time of a large WAL as the recovery threads go from 1 to
+// 16. writes a log directory shaped like one a busy broker leaves behind: a
+// snapshot of the jobs pending at the time, then segments of ADDs with most
+// of them acknowledged by DONEs a little later, and loads it the way the
+// broker does at startup. every run must rebuild the same pending set.
+//
+//   g++ -std=c++20 -O2 -pthread -I.. wal_recovery.cpp -o wal_recovery
+//   ./wal_recovery [jobs] [payload_bytes] [dir]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <sys/stat.h>
+#include <vector>
+
+#include "wal.h"
+
+using namespace std;
+
+static void write_file(const string &path, const string &records) {
+  ofstream out(path, ios::binary | ios::trunc);
+  out << wal_file_header() << records;
+}
+
+// jobs ids 1..jobs: the first tenth pending in the snapshot, the rest in
+// segments of 64 MiB or so, each DONE landing a few thousand records after
+// its ADD. one job in eight is never acknowledged.
+static void write_log(const string &dir, uint64_t jobs, size_t payload_bytes) {
+  mkdir(dir.c_str(), 0755);
+  string payload(payload_bytes, 'x');
+  uint64_t in_snapshot = jobs / 10;
+
+  string records = wal_id_record(WalRecord::MaxId, in_snapshot);
+  for (uint64_t id = 1; id <= in_snapshot; id++) {
+    records += wal_add_record(id, static_cast<uint8_t>(id % 4), 0, payload);
+  }
+  write_file(wal_snapshot_path(dir, 1), records);
+
+  const uint64_t lag = 4096;
+  uint64_t seq = 2;
+  records.clear();
+  for (uint64_t id = in_snapshot + 1; id <= jobs + lag; id++) {
+    if (id <= jobs) {
+      records += wal_add_record(id, static_cast<uint8_t>(id % 4), 0, payload);
+    }
+    uint64_t done = id - lag;
+    if (id > lag && done % 8 != 0) {
+      records += wal_id_record(WalRecord::Done, done);
+    }
+    if (records.size() >= (64u << 20)) {
+      write_file(wal_segment_path(dir, seq++), records);
+      records.clear();
+    }
+  }
+  write_file(wal_segment_path(dir, seq), records);
+}
+
+int main(int argc, char *argv[]) {
+  uint64_t jobs = argc > 1 ? strtoull(argv[1], nullptr, 10) : 4000000;
+  size_t payload_bytes = argc > 2 ? strtoul(argv[2], nullptr, 10) : 64;
+  string dir = argc > 3 ? argv[3] : "wal_recovery_bench";
+
+  write_log(dir, jobs, payload_bytes);
+  WalFiles files = list_wal_files(dir);
+  printf("%llu jobs, %zu B payloads, 1 snapshot + %zu segments in %s\n",
+         static_cast<unsigned long long>(jobs), payload_bytes,
+         files.segments.size(), dir.c_str());
+
+  printf("%8s %10s %12s %8s\n", "threads", "ms", "pending", "speedup");
+  double base_ms = 0;
+  size_t expected = 0;
+  for (unsigned threads : {1u, 4u, 16u}) {
+    auto started = chrono::steady_clock::now();
+    WalRecovery recovery = load_wal_state(dir, threads);
+    double ms = chrono::duration<double, milli>(chrono::steady_clock::now() -
+                                                started)
+                    .count();
+    if (threads == 1) {
+      base_ms = ms;
+      expected = recovery.pending.size();
+    } else if (recovery.pending.size() != expected) {
+      fprintf(stderr, "%u threads recovered %zu jobs, 1 thread %zu\n",
+              threads, recovery.pending.size(), expected);
+      return 1;
+    }
+    printf("%8u %10.1f %12zu %8.2f\n", threads, ms, recovery.pending.size(),
+           base_ms / ms);
+  }
+  return 0;
+}
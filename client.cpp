@@ -0,0 +1,604 @@
+#include "client.h"
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+
+#include "lz4.h"
+
+bool BrokerConnection::open() {
+  close();
+  auto delay = options.reconnect_delay;
+  for (int attempt = 0; attempt < std::max(1, options.connect_attempts);
+       attempt++) {
+    if (attempt > 0) {
+      std::this_thread::sleep_for(delay);
+      delay *= 2;
+    }
+    if (connect_once()) {
+      return true;
+    }
+    close();
+  }
+  return false;
+}
+
+bool BrokerConnection::connect_once() {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  addrinfo *addrs = nullptr;
+  std::string port = std::to_string(options.port);
+  if (::getaddrinfo(options.host.c_str(), port.c_str(), &hints, &addrs) != 0) {
+    return false;
+  }
+  for (addrinfo *a = addrs; a != nullptr && fd == -1; a = a->ai_next) {
+    fd = ::socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+    if (fd == -1) {
+      continue;
+    }
+    if (::connect(fd, a->ai_addr, a->ai_addrlen) == -1) {
+      ::close(fd);
+      fd = -1;
+    }
+  }
+  ::freeaddrinfo(addrs);
+  if (fd == -1) {
+    return false;
+  }
+  // pipelined frames must not wait for the previous ones to be acknowledged
+  int one = 1;
+  ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+  std::string hello = "HELLO BINARY " +
+                      std::to_string(BINARY_PROTOCOL_VERSION) +
+                      (options.compression ? " LZ4\n" : "\n");
+  std::string reply;
+  return send(hello) && read_line(reply) && reply + "\n" == hello;
+}
+
+void BrokerConnection::close() {
+  if (fd != -1) {
+    ::close(fd);
+    fd = -1;
+  }
+  in.clear();
+  pos = 0;
+}
+
+void BrokerConnection::shutdown(int how) {
+  if (fd != -1) {
+    ::shutdown(fd, how);
+  }
+}
+
+bool BrokerConnection::send(std::string_view bytes) {
+  while (!bytes.empty()) {
+    ssize_t n = ::send(fd, bytes.data(), bytes.size(), MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    bytes.remove_prefix(static_cast<size_t>(n));
+  }
+  return true;
+}
+
+bool BrokerConnection::read_line(std::string &line) {
+  size_t nl;
+  while ((nl = in.find('\n', pos)) == std::string::npos) {
+    if (!fill()) {
+      return false;
+    }
+  }
+  line.assign(in, pos, nl - pos);
+  pos = nl + 1;
+  return true;
+}
+
+bool BrokerConnection::read_frame(FrameHeader &header, std::string &payload) {
+  while (in.size() - pos < FRAME_HEADER_SIZE) {
+    if (!fill()) {
+      return false;
+    }
+  }
+  header = decode_header(in.data() + pos);
+  while (in.size() - pos < FRAME_HEADER_SIZE + header.payload_len) {
+    if (!fill()) {
+      return false;
+    }
+  }
+  payload.assign(in, pos + FRAME_HEADER_SIZE, header.payload_len);
+  pos += FRAME_HEADER_SIZE + header.payload_len;
+  return true;
+}
+
+// one recv of up to 64 KiB, which typically holds many frames
+bool BrokerConnection::fill() {
+  if (pos > 0) {
+    in.erase(0, pos);
+    pos = 0;
+  }
+  size_t old_size = in.size();
+  in.resize(old_size + 64 * 1024);
+  ssize_t n;
+  do {
+    n = ::recv(fd, in.data() + old_size, 64 * 1024, 0);
+  } while (n < 0 && errno == EINTR);
+  in.resize(old_size + static_cast<size_t>(std::max<ssize_t>(n, 0)));
+  return n > 0;
+}
+
+// the payload as it goes out, packed if that is wanted and pays
+static bool maybe_pack(std::string_view &payload, std::string &packed,
+                       const ClientOptions &client) {
+  if (client.compression && payload.size() >= client.compress_min_bytes &&
+      lz4_pack(payload, packed)) {
+    payload = packed;
+    return true;
+  }
+  return false;
+}
+
+// the priority and not-before time ahead of a SUBMIT's or SUBMIT_BATCH's
+// jobs, and the flags that announce them
+static std::string submit_prefix(const SubmitOptions &opts, uint8_t &flags) {
+  std::string prefix;
+  if (opts.priority != 0) {
+    flags |= FLAG_PRIORITY;
+    prefix.push_back(static_cast<char>(opts.priority));
+  }
+  if (opts.not_before_ms != 0) {
+    flags |= FLAG_NOT_BEFORE;
+    unsigned char when[8];
+    store_be64(when, static_cast<uint64_t>(opts.not_before_ms));
+    prefix.append(reinterpret_cast<const char *>(when), sizeof(when));
+  }
+  return prefix;
+}
+
+static void append_submit(std::string &out, std::string_view payload,
+                          const SubmitOptions &opts,
+                          const ClientOptions &client) {
+  uint8_t flags = 0;
+  std::string packed;
+  if (maybe_pack(payload, packed, client)) {
+    flags |= FLAG_COMPRESSED;
+  }
+  std::string prefix = submit_prefix(opts, flags);
+  append_frame_header(out, OP_SUBMIT, 0, prefix.size() + payload.size(),
+                      flags);
+  out.append(prefix);
+  out.append(payload);
+}
+
+static void append_submit_batch(std::string &out,
+                                const std::vector<std::string_view> &payloads,
+                                const SubmitOptions &opts,
+                                const ClientOptions &client) {
+  // the header goes in once the length is known
+  size_t start = out.size();
+  out.append(FRAME_HEADER_SIZE, '\0');
+  uint8_t flags = 0;
+  out += submit_prefix(opts, flags);
+  std::string packed;
+  for (std::string_view payload : payloads) {
+    packed.clear();
+    uint32_t len = static_cast<uint32_t>(payload.size());
+    if (maybe_pack(payload, packed, client)) {
+      len = static_cast<uint32_t>(payload.size()) | BATCH_COMPRESSED;
+    }
+    unsigned char prefix[4];
+    store_be32(prefix, len);
+    out.append(reinterpret_cast<const char *>(prefix), sizeof(prefix));
+    out.append(payload);
+  }
+  std::string header;
+  append_frame_header(header, OP_SUBMIT_BATCH, payloads.size(),
+                      out.size() - start - FRAME_HEADER_SIZE, flags);
+  out.replace(start, FRAME_HEADER_SIZE, header);
+}
+
+static std::future<SubmitResult> ready(SubmitStatus status,
+                                       std::string error = {}) {
+  std::promise<SubmitResult> promise;
+  promise.set_value({status, 0, std::move(error)});
+  return promise.get_future();
+}
+
+Producer::Producer(ClientOptions options) : conn(std::move(options)) {}
+
+Producer::~Producer() {
+  drain();
+  std::unique_lock<std::mutex> lock(mutex);
+  conn.shutdown();
+  lock.unlock();
+  if (reader.joinable()) {
+    reader.join();
+  }
+}
+
+// a reader that has given up has already failed every pending promise and
+// no longer touches the connection
+bool Producer::ensure_open() {
+  if (conn.is_open() && !broken) {
+    return true;
+  }
+  if (reader.joinable()) {
+    reader.join();
+  }
+  broken = false;
+  if (!conn.open()) {
+    return false;
+  }
+  current_queue = "default";
+  reader = std::thread(&Producer::read_replies, this);
+  return true;
+}
+
+void Producer::use_queue(const std::string &queue) {
+  if (queue == current_queue) {
+    return;
+  }
+  std::string frame;
+  append_frame(frame, OP_USE, 0, queue);
+  pending.emplace_back().use = true;
+  current_queue = queue;
+  if (!conn.send(frame)) {
+    conn.shutdown();
+  }
+}
+
+std::future<SubmitResult> Producer::submit(std::string_view payload,
+                                           const SubmitOptions &opts) {
+  if (payload.empty()) {
+    return ready(SubmitStatus::Error, "empty payload");
+  }
+  std::string frame;
+  append_submit(frame, payload, opts, conn.client_options());
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!ensure_open()) {
+    return ready(SubmitStatus::Disconnected);
+  }
+  use_queue(opts.queue);
+  pending.emplace_back();
+  std::future<SubmitResult> result = promises.emplace_back().get_future();
+  // a failed send is seen by the reader too, which fails the promise
+  if (!conn.send(frame)) {
+    conn.shutdown();
+  }
+  return result;
+}
+
+std::vector<std::future<SubmitResult>>
+Producer::submit_batch(const std::vector<std::string> &payloads,
+                       const SubmitOptions &opts) {
+  std::vector<std::future<SubmitResult>> results(payloads.size());
+  std::string frames;
+  std::vector<size_t> sent;
+  std::vector<size_t> frame_jobs;
+  std::vector<std::string_view> batch;
+  size_t batch_bytes = 0;
+  // a batch of one is a plain SUBMIT
+  auto end_batch = [&] {
+    if (batch.size() == 1) {
+      append_submit(frames, batch[0], opts, conn.client_options());
+    } else if (batch.size() > 1) {
+      append_submit_batch(frames, batch, opts, conn.client_options());
+    }
+    if (!batch.empty()) {
+      frame_jobs.push_back(batch.size());
+    }
+    batch.clear();
+    batch_bytes = 0;
+  };
+  for (size_t i = 0; i < payloads.size(); i++) {
+    if (payloads[i].empty()) {
+      results[i] = ready(SubmitStatus::Error, "empty payload");
+      continue;
+    }
+    batch.push_back(payloads[i]);
+    batch_bytes += payloads[i].size();
+    sent.push_back(i);
+    if (batch.size() == MAX_BATCH_JOBS || batch_bytes >= MAX_BATCH_BYTES) {
+      end_batch();
+    }
+  }
+  end_batch();
+  if (sent.empty()) {
+    return results;
+  }
+  std::unique_lock<std::mutex> lock(mutex);
+  if (!ensure_open()) {
+    for (size_t i : sent) {
+      results[i] = ready(SubmitStatus::Disconnected);
+    }
+    return results;
+  }
+  use_queue(opts.queue);
+  for (size_t jobs : frame_jobs) {
+    pending.push_back({false, jobs});
+  }
+  for (size_t i : sent) {
+    results[i] = promises.emplace_back().get_future();
+  }
+  if (!conn.send(frames)) {
+    conn.shutdown();
+  }
+  return results;
+}
+
+void Producer::drain() {
+  std::unique_lock<std::mutex> lock(mutex);
+  drained.wait(lock, [this] { return pending.empty(); });
+}
+
+size_t Producer::outstanding() {
+  std::lock_guard<std::mutex> lock(mutex);
+  return promises.size();
+}
+
+void Producer::read_replies() {
+  FrameHeader header;
+  std::string payload;
+  while (conn.read_frame(header, payload)) {
+    SubmitResult result;
+    switch (header.opcode) {
+    case OP_USE:
+      break;
+    case OP_JOB_ID:
+    case OP_JOB_IDS: // the first of as many ids as the batch had jobs
+      result.status = SubmitStatus::Ok;
+      result.id = header.job_id;
+      break;
+    case OP_BUSY:
+      result.status = SubmitStatus::Busy;
+      result.retry_after_ms = header.job_id;
+      break;
+    case OP_ERROR:
+      result.status = SubmitStatus::Error;
+      result.error = payload;
+      break;
+    default:
+      continue; // not an answer to a SUBMIT
+    }
+    std::lock_guard<std::mutex> lock(mutex);
+    if (pending.empty()) {
+      continue;
+    }
+    if (pending.front().use) {
+      // the SUBMITs behind a refused USE are refused too, the next submit
+      // tries again
+      if (header.opcode == OP_ERROR) {
+        current_queue.clear();
+      }
+    } else if (header.opcode != OP_USE) {
+      // a refused batch refuses every job of it
+      for (size_t i = 0; i < pending.front().jobs; i++) {
+        SubmitResult job = result;
+        if (result.status == SubmitStatus::Ok) {
+          job.id = result.id + i;
+        }
+        promises.front().set_value(std::move(job));
+        promises.pop_front();
+      }
+    } else {
+      continue;
+    }
+    pending.pop_front();
+    if (pending.empty()) {
+      drained.notify_all();
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  for (std::promise<SubmitResult> &promise : promises) {
+    promise.set_value({SubmitStatus::Disconnected, 0, {}});
+  }
+  promises.clear();
+  pending.clear();
+  broken = true;
+  drained.notify_all();
+}
+
+bool WorkerConnection::open() {
+  std::lock_guard<std::mutex> lock(send_mutex);
+  if (conn.is_open()) {
+    return true;
+  }
+  if (stopped) {
+    return false;
+  }
+  {
+    // acknowledgements for leases of the old session
+    std::lock_guard<std::mutex> out_lock(out_mutex);
+    out.clear();
+    acks.clear();
+  }
+  awaiting_reply = false;
+  if (!conn.open()) {
+    return false;
+  }
+  sessions++;
+  std::string frame;
+  append_frame(frame, OP_PREFETCH, wanted_prefetch);
+  FrameHeader header;
+  std::string payload;
+  if (!conn.send(frame) || !conn.read_frame(header, payload) ||
+      header.opcode != OP_PREFETCH) {
+    conn.close();
+    return false;
+  }
+  granted_prefetch = static_cast<uint32_t>(header.job_id);
+  if (!subscribe()) {
+    conn.close();
+    return false;
+  }
+  return true;
+}
+
+// every queue is WATCHed before "default" is IGNOREd, which the broker
+// refuses while it is the only one
+bool WorkerConnection::subscribe() {
+  if (queues.empty()) {
+    return true;
+  }
+  std::string frames;
+  size_t replies = 0;
+  for (const std::string &queue : queues) {
+    append_frame(frames, OP_WATCH, 0, queue);
+    replies++;
+  }
+  if (std::find(queues.begin(), queues.end(), "default") == queues.end()) {
+    append_frame(frames, OP_IGNORE, 0, std::string_view("default"));
+    replies++;
+  }
+  if (!conn.send(frames)) {
+    return false;
+  }
+  FrameHeader header;
+  std::string payload;
+  for (size_t i = 0; i < replies; i++) {
+    if (!conn.read_frame(header, payload)) {
+      return false;
+    }
+    if (header.opcode != OP_WATCH && header.opcode != OP_IGNORE) {
+      error = payload;
+      return false;
+    }
+  }
+  return true;
+}
+
+void WorkerConnection::shutdown() {
+  std::lock_guard<std::mutex> lock(send_mutex);
+  stopped = true;
+  // reads only, acknowledgements of jobs still running may follow
+  conn.shutdown(SHUT_RD);
+}
+
+bool WorkerConnection::flush() {
+  bool ok = true;
+  do {
+    std::unique_lock<std::mutex> sending(send_mutex, std::try_to_lock);
+    if (!sending.owns_lock()) {
+      return true; // whoever holds it sends ours too, or is reconnecting
+    }
+    while (ok) {
+      std::string batch;
+      {
+        std::lock_guard<std::mutex> lock(out_mutex);
+        if (out.empty() && acks.empty()) {
+          break;
+        }
+        batch = take_output();
+      }
+      if (!conn.is_open() || !conn.send(batch)) {
+        // the reading thread sees it too, and reconnects
+        conn.shutdown(SHUT_RDWR);
+        ok = false;
+      }
+    }
+    // frames queued after our last look but before the unlock
+  } while (ok && has_output());
+  return ok;
+}
+
+// ACKs go first, so that they free the prefetch window a REQUEST behind them
+// may need. more than one travel as [first, last] ranges of consecutive ids.
+std::string WorkerConnection::take_output() {
+  std::string frames;
+  if (acks.size() == 1) {
+    append_frame(frames, OP_ACK, acks[0]);
+  } else if (acks.size() > 1) {
+    std::sort(acks.begin(), acks.end());
+    std::string ranges;
+    unsigned char pair[16];
+    for (size_t i = 0; i < acks.size();) {
+      size_t j = i + 1;
+      while (j < acks.size() && acks[j] <= acks[j - 1] + 1) {
+        j++;
+      }
+      store_be64(pair, acks[i]);
+      store_be64(pair + 8, acks[j - 1]);
+      ranges.append(reinterpret_cast<const char *>(pair), sizeof(pair));
+      i = j;
+    }
+    append_frame(frames, OP_ACK_RANGES, 0, ranges);
+  }
+  acks.clear();
+  frames += out;
+  out.clear();
+  return frames;
+}
+
+bool WorkerConnection::send_request(uint64_t timeout_ms) {
+  if (!open()) {
+    return false;
+  }
+  queue(OP_REQUEST, timeout_ms);
+  if (!flush()) {
+    return false;
+  }
+  awaiting_reply = true;
+  return true;
+}
+
+RequestStatus WorkerConnection::disconnected() {
+  std::lock_guard<std::mutex> lock(send_mutex);
+  conn.close();
+  awaiting_reply = false;
+  return RequestStatus::Disconnected;
+}
+
+RequestStatus WorkerConnection::read_jobs(std::deque<ClientJob> &jobs) {
+  if (!awaiting_reply) {
+    return RequestStatus::Empty;
+  }
+  // acknowledgements may be what frees the window the broker is waiting on
+  if (!flush()) {
+    return disconnected();
+  }
+  FrameHeader header;
+  std::string payload;
+  while (conn.read_frame(header, payload)) {
+    switch (header.opcode) {
+    case OP_JOB:
+      if (header.flags & FLAG_COMPRESSED) {
+        std::string text;
+        if (!lz4_unpack(payload, text)) {
+          error = "invalid compressed payload";
+          return disconnected();
+        }
+        payload.swap(text);
+      }
+      jobs.push_back({header.job_id, std::move(payload)});
+      if (!(header.flags & FLAG_MORE)) {
+        awaiting_reply = false;
+        return RequestStatus::Jobs;
+      }
+      break;
+    case OP_EMPTY:
+      awaiting_reply = false;
+      return RequestStatus::Empty;
+    case OP_ERROR:
+      // a TOUCH of a lease that has already expired, not our answer
+      if (payload == "unknown lease") {
+        break;
+      }
+      error = payload;
+      awaiting_reply = false;
+      return RequestStatus::Error;
+    default:
+      break; // TOUCHED
+    }
+  }
+  return disconnected();
+}
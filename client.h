@@ -0,0 +1,251 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <sys/socket.h>
+#include <vector>
+
+#include "protocol.h"
+
+// client side of the broker protocol, for producers and workers. both keep
+// one connection open across jobs, speak the binary framing (so payloads may
+// hold any bytes) and read replies through a buffer a socket read at a time.
+// a dropped connection is re-established on the next call, with a few
+// retries and a doubling delay in between.
+//
+//   g++ -std=c++20 -O2 -c client.cpp worker_runtime.cpp
+//   ar rcs libdsjq_client.a client.o worker_runtime.o
+//   g++ -std=c++20 -O2 -pthread producer.cpp -L. -ldsjq_client -o producer
+
+struct ClientOptions {
+  std::string host = "127.0.0.1";
+  int port = 5003;
+  // attempts per (re)connect before an operation gives up
+  int connect_attempts = 5;
+  // delay after the first failed attempt, doubled after each one
+  std::chrono::milliseconds reconnect_delay{50};
+  // negotiates LZ4: a producer compresses payloads of at least
+  // compress_min_bytes whenever that makes them smaller, and a worker gets
+  // compressed jobs as the broker stored them and unpacks them itself
+  bool compression = false;
+  size_t compress_min_bytes = 512;
+};
+
+// one framed connection to the broker. not thread safe, except that
+// shutdown() may be called while another thread is blocked reading.
+class BrokerConnection {
+public:
+  explicit BrokerConnection(ClientOptions options) : options(std::move(options)) {}
+  BrokerConnection(const BrokerConnection &) = delete;
+  BrokerConnection &operator=(const BrokerConnection &) = delete;
+  ~BrokerConnection() { close(); }
+
+  // connects and switches to binary frames, retrying as configured
+  bool open();
+  void close();
+  bool is_open() const { return fd != -1; }
+  const ClientOptions &client_options() const { return options; }
+  // makes a read blocked in another thread return false. SHUT_RD still
+  // lets frames out.
+  void shutdown(int how = SHUT_RDWR);
+
+  bool send(std::string_view bytes);
+  // blocks for the next frame, false once the connection is gone
+  bool read_frame(FrameHeader &header, std::string &payload);
+
+private:
+  ClientOptions options;
+  int fd = -1;
+  std::string in;
+  size_t pos = 0;
+
+  bool connect_once();
+  bool read_line(std::string &line);
+  bool fill();
+};
+
+enum class SubmitStatus {
+  Ok,           // durable in the broker's WAL, id assigned
+  Busy,         // the broker refused it for now, see retry_after_ms
+  Error,        // rejected, see error
+  Disconnected, // the connection dropped before the answer came
+};
+
+struct SubmitResult {
+  SubmitStatus status = SubmitStatus::Disconnected;
+  uint64_t id = 0;
+  std::string error;
+  // Busy: how long the broker asks to wait before submitting again
+  uint64_t retry_after_ms = 0;
+};
+
+struct SubmitOptions {
+  uint8_t priority = 0;
+  // unix time in ms before which the job must not run, 0 for none
+  int64_t not_before_ms = 0;
+  // the named queue, created by the broker on first use
+  std::string queue = "default";
+};
+
+// submits jobs over one pipelined connection. submit() returns as soon as the
+// frame is written; the answer, which the broker sends once the job is
+// durable, fulfils the future from a reader thread. submits may come from any
+// number of threads. replies arrive in submit order, so promises are kept in
+// a queue and matched as they come.
+//
+// a submit to another queue than the last one is preceded by a USE on the
+// same pipeline; its answer is matched like the others but has no future.
+// submit_batch() sends its jobs as SUBMIT_BATCH frames, each of which the
+// broker logs and answers as one, with a single JOB_IDS for all of its jobs.
+//
+// a Disconnected answer does not say whether the job was logged: the broker
+// may have made it durable just before the connection went.
+class Producer {
+public:
+  explicit Producer(ClientOptions options = {});
+  Producer(const Producer &) = delete;
+  Producer &operator=(const Producer &) = delete;
+  // waits for every outstanding answer
+  ~Producer();
+
+  std::future<SubmitResult> submit(std::string_view payload,
+                                   const SubmitOptions &opts = {});
+  // SUBMIT_BATCH frames of up to MAX_BATCH_JOBS jobs or about
+  // MAX_BATCH_BYTES, all in a single write. a batch the broker answers BUSY
+  // or ERROR is refused as a whole, so every job of it gets that answer.
+  static const size_t MAX_BATCH_JOBS = 4096;
+  static const size_t MAX_BATCH_BYTES = 1 << 20;
+  std::vector<std::future<SubmitResult>>
+  submit_batch(const std::vector<std::string> &payloads,
+               const SubmitOptions &opts = {});
+  SubmitResult submit_sync(std::string_view payload,
+                           const SubmitOptions &opts = {}) {
+    return submit(payload, opts).get();
+  }
+
+  // blocks until every submit so far has its answer
+  void drain();
+  size_t outstanding();
+
+private:
+  std::mutex mutex; // the connection's write side, pending and reader
+  std::condition_variable drained;
+  BrokerConnection conn;
+  // one per answer expected. the answer to a SUBMIT settles the next jobs
+  // promises, which are in submit order.
+  struct Pending {
+    bool use = false; // the answer to a USE rather than a SUBMIT
+    size_t jobs = 1;  // more than one for a SUBMIT_BATCH
+  };
+  std::deque<Pending> pending;
+  std::deque<std::promise<SubmitResult>> promises;
+  std::thread reader;
+  bool broken = false; // set by the reader once the connection is gone
+  // the queue USEd last, empty after a USE the broker refused
+  std::string current_queue;
+
+  // with mutex held
+  bool ensure_open();
+  void use_queue(const std::string &queue);
+  void read_replies();
+};
+
+struct ClientJob {
+  uint64_t id;
+  std::string payload;
+};
+
+enum class RequestStatus {
+  Jobs,         // one or more jobs were appended
+  Empty,        // nothing pending (or the long poll timed out)
+  Error,        // the broker refused the request
+  Disconnected, // the connection dropped, every lease held is gone
+};
+
+// the worker side: leases jobs and acknowledges them over one connection.
+// REQUEST can be sent ahead of reading its reply, so the next batch travels
+// while the current one runs. ACK, FAIL and TOUCH are buffered and written
+// together with the next REQUEST, flush() or read; the ACKs buffered by then
+// go out as one ACK_RANGES frame, which the broker logs as one record.
+//
+// REQUESTs lease from the named queues given, which the broker serves by
+// weight (see QUEUE); none means just "default". they are WATCHed again on
+// every reconnect.
+//
+// reads (open, send_request, read_jobs) belong to one thread. ack, fail,
+// touch and flush may be called from any thread meanwhile: a flush that
+// finds another one writing leaves its frames to it, so acknowledgements
+// from jobs finishing together leave in one write.
+class WorkerConnection {
+public:
+  explicit WorkerConnection(ClientOptions options = {}, uint32_t prefetch = 1,
+                            std::vector<std::string> queues = {})
+      : conn(std::move(options)), wanted_prefetch(prefetch),
+        queues(std::move(queues)) {}
+
+  // connects if needed. the broker may grant a smaller window than asked.
+  bool open();
+  uint32_t prefetch() const { return granted_prefetch; }
+  // bumped on every reconnect
+  uint64_t session() const { return sessions; }
+  // ends a blocked read and every later open(), for good
+  void shutdown();
+
+  // REQUEST, long-polling for up to timeout_ms if nothing is pending
+  bool send_request(uint64_t timeout_ms = 0);
+  // the reply to the REQUEST sent last, appending its jobs to out
+  RequestStatus read_jobs(std::deque<ClientJob> &out);
+  RequestStatus request(std::deque<ClientJob> &out, uint64_t timeout_ms = 0) {
+    if (!send_request(timeout_ms)) {
+      return RequestStatus::Disconnected;
+    }
+    return read_jobs(out);
+  }
+  bool request_outstanding() const { return awaiting_reply; }
+
+  void ack(uint64_t id) {
+    std::lock_guard<std::mutex> lock(out_mutex);
+    acks.push_back(id);
+  }
+  void fail(uint64_t id) { queue(OP_FAIL, id); }
+  void touch(uint64_t id) { queue(OP_TOUCH, id); }
+  bool flush();
+  std::string last_error() const { return error; }
+
+private:
+  BrokerConnection conn;
+  uint32_t wanted_prefetch;
+  std::vector<std::string> queues;
+  uint32_t granted_prefetch = 0;
+  uint64_t sessions = 0;
+  bool awaiting_reply = false;
+  std::string error;
+
+  std::mutex out_mutex; // out, acks
+  std::string out;
+  std::vector<uint64_t> acks;
+  // the socket's write side, and opening or closing it
+  std::mutex send_mutex;
+  bool stopped = false;
+
+  void queue(uint8_t opcode, uint64_t id) {
+    std::lock_guard<std::mutex> lock(out_mutex);
+    append_frame(out, opcode, id);
+  }
+  bool has_output() {
+    std::lock_guard<std::mutex> lock(out_mutex);
+    return !out.empty() || !acks.empty();
+  }
+  // with out_mutex held: the buffered ACKs as frames ahead of out
+  std::string take_output();
+  bool subscribe();
+  RequestStatus disconnected();
+};
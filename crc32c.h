@@ -0,0 +1,73 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+// CRC32C (Castagnoli), the checksum of the WAL records. uses the SSE4.2
+// crc32 instruction, eight bytes a cycle or so, where the CPU has it and a
+// table otherwise. crc32c_extend continues a finished checksum over more
+// bytes, so a record can be summed in pieces: header, then payload.
+namespace crc32c_detail {
+
+struct Table {
+  uint32_t entries[256];
+
+  Table() {
+    for (uint32_t i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (int bit = 0; bit < 8; bit++) {
+        crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+      }
+      entries[i] = crc;
+    }
+  }
+};
+
+inline uint32_t software(uint32_t crc, const unsigned char *p, size_t n) {
+  static const Table table;
+  while (n-- > 0) {
+    crc = table.entries[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2"))) inline uint32_t
+hardware(uint32_t crc, const unsigned char *p, size_t n) {
+  uint64_t wide = crc;
+  while (n >= 8) {
+    uint64_t word;
+    std::memcpy(&word, p, 8);
+    wide = _mm_crc32_u64(wide, word);
+    p += 8;
+    n -= 8;
+  }
+  crc = static_cast<uint32_t>(wide);
+  while (n-- > 0) {
+    crc = _mm_crc32_u8(crc, *p++);
+  }
+  return crc;
+}
+#endif
+
+} // namespace crc32c_detail
+
+inline uint32_t crc32c_extend(uint32_t crc, const void *data, size_t n) {
+  const unsigned char *p = static_cast<const unsigned char *>(data);
+#if defined(__x86_64__)
+  static const bool has_sse42 = __builtin_cpu_supports("sse4.2");
+  if (has_sse42) {
+    return ~crc32c_detail::hardware(~crc, p, n);
+  }
+#endif
+  return ~crc32c_detail::software(~crc, p, n);
+}
+
+inline uint32_t crc32c(const void *data, size_t n) {
+  return crc32c_extend(0, data, n);
+}
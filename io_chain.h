@@ -0,0 +1,119 @@
+#pragma once
+
+#include <cstddef>
+#include <deque>
+#include <string>
+#include <string_view>
+#include <sys/uio.h>
+
+#include "payload.h"
+
+// outgoing bytes as a chain of owned byte runs and shared payloads, written
+// with one writev/sendmsg per batch. small pieces are copied into the current
+// run, payloads of at least SHARE_BYTES are referenced instead, so a large job
+// goes from its slab block to the socket or the log without ever being copied.
+class IoChain {
+public:
+  static const size_t SHARE_BYTES = 512;
+
+  size_t size() const { return total; }
+  bool empty() const { return total == 0; }
+
+  void append(std::string_view bytes) {
+    if (bytes.empty()) {
+      return;
+    }
+    if (pieces.empty() || !pieces.back().shared.empty()) {
+      pieces.emplace_back();
+    }
+    pieces.back().bytes.append(bytes.data(), bytes.size());
+    total += bytes.size();
+  }
+
+  void append(const char *bytes, size_t len) { append(std::string_view(bytes, len)); }
+
+  void append(const Payload &payload) {
+    if (payload.size() < SHARE_BYTES) {
+      append(payload.view());
+      return;
+    }
+    if (pieces.empty() || !pieces.back().shared.empty()) {
+      pieces.emplace_back();
+    }
+    pieces.back().shared = payload;
+    total += payload.size();
+  }
+
+  IoChain &operator+=(std::string_view bytes) {
+    append(bytes);
+    return *this;
+  }
+
+  IoChain &operator+=(char c) {
+    append(std::string_view(&c, 1));
+    return *this;
+  }
+
+  // fills up to max iovecs with the unsent bytes, front first
+  int gather(iovec *iov, int max) const {
+    int n = 0;
+    size_t skip = offset;
+    for (const Piece &piece : pieces) {
+      for (std::string_view part : {std::string_view(piece.bytes),
+                                    piece.shared.view()}) {
+        if (n == max) {
+          return n;
+        }
+        if (skip >= part.size()) {
+          skip -= part.size();
+          continue;
+        }
+        iov[n].iov_base = const_cast<char *>(part.data() + skip);
+        iov[n].iov_len = part.size() - skip;
+        skip = 0;
+        n++;
+      }
+    }
+    return n;
+  }
+
+  // drops n bytes that have been written. the last piece is kept and reset
+  // rather than freed, so an idle chain holds on to its buffer.
+  void consume(size_t n) {
+    total -= n;
+    offset += n;
+    while (!pieces.empty()) {
+      Piece &front = pieces.front();
+      if (offset < front.bytes.size() + front.shared.size()) {
+        break;
+      }
+      if (pieces.size() == 1) {
+        front.bytes.clear();
+        front.shared = Payload();
+        offset = 0;
+        break;
+      }
+      offset -= front.bytes.size() + front.shared.size();
+      pieces.pop_front();
+    }
+  }
+
+  void clear() { consume(total); }
+
+  void swap(IoChain &other) {
+    pieces.swap(other.pieces);
+    std::swap(total, other.total);
+    std::swap(offset, other.offset);
+  }
+
+private:
+  // a run of owned bytes followed by an optional shared payload
+  struct Piece {
+    std::string bytes;
+    Payload shared;
+  };
+
+  std::deque<Piece> pieces;
+  size_t total = 0;  // unsent bytes
+  size_t offset = 0; // bytes of the front piece already sent
+};
@@ -0,0 +1,369 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "mpmc_ring.h"
+#include "payload.h"
+
+const int PRIORITY_LEVELS = 256;
+
+struct Job {
+  uint64_t job_id;
+  Payload job_text; // shared, never copied once submitted
+  uint8_t priority = 0; // 0-255, higher is dispatched first
+  // job_text is LZ4 packed as the producer sent it, see lz4.h
+  bool compressed = false;
+  // when the job entered its current priority level, for aging
+  int64_t queued_ms = 0;
+  // unix time in ms before which the job must not be dispatched, 0 for none
+  int64_t not_before_ms = 0;
+  // steady clock ns when the job last became pending, for STATS
+  int64_t enqueued_ns = 0;
+  // the named queue it was submitted to, see QueueRegistry
+  uint32_t queue = 0;
+};
+
+inline int64_t steady_now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// one FIFO per priority level plus a 256 bit map of the non-empty ones, so
+// the highest waiting job is found with a couple of count-leading-zeros
+// instead of a heap walk. levels are allocated on first use.
+class BucketQueue {
+public:
+  bool empty() const { return count == 0; }
+  size_t size() const { return count; }
+
+  // highest non-empty level, -1 when empty
+  int top() const {
+    for (int word = 3; word >= 0; word--) {
+      if (bitmap[word] != 0) {
+        return word * 64 + 63 - __builtin_clzll(bitmap[word]);
+      }
+    }
+    return -1;
+  }
+
+  size_t level_size(int level) const {
+    return levels[level] ? levels[level]->size() : 0;
+  }
+
+  void push(Job job, int level) {
+    if (!levels[level]) {
+      levels[level] = std::make_unique<std::deque<Job>>();
+    }
+    levels[level]->push_back(std::move(job));
+    bitmap[level / 64] |= 1ull << (level % 64);
+    count++;
+  }
+
+  void push(Job job) {
+    int level = job.priority;
+    push(std::move(job), level);
+  }
+
+  Job pop(int level) {
+    std::deque<Job> &fifo = *levels[level];
+    Job job = std::move(fifo.front());
+    fifo.pop_front();
+    if (fifo.empty()) {
+      bitmap[level / 64] &= ~(1ull << (level % 64));
+    }
+    count--;
+    return job;
+  }
+
+  // raises every job by one level per step_ms it has waited at its current
+  // one, so nothing starves forever however busy the higher levels are.
+  // levels are visited top down so a job is moved at most once per pass.
+  void age(int64_t now_ms, int64_t step_ms) {
+    for (int level = PRIORITY_LEVELS - 2; level >= 0; level--) {
+      if (!(bitmap[level / 64] & (1ull << (level % 64)))) {
+        continue;
+      }
+      std::deque<Job> &fifo = *levels[level];
+      while (!fifo.empty() && fifo.front().queued_ms + step_ms <= now_ms) {
+        Job job = pop(level);
+        int64_t steps = (now_ms - job.queued_ms) / step_ms;
+        int target = static_cast<int>(
+            std::min<int64_t>(level + steps, PRIORITY_LEVELS - 1));
+        job.queued_ms += (target - level) * step_ms;
+        push(std::move(job), target);
+      }
+    }
+  }
+
+private:
+  std::array<std::unique_ptr<std::deque<Job>>, PRIORITY_LEVELS> levels;
+  uint64_t bitmap[4] = {0, 0, 0, 0};
+  size_t count = 0;
+};
+
+enum class QueueBackend {
+  Locked, // priority buckets behind the shard mutex
+  Ring,   // lock-free MPMC ring for priority 0, spilling into the buckets
+};
+
+// pending jobs split over independently locked shards. a job lives in shard
+// job_id % shards, so SUBMITs from all connections spread evenly. every shard
+// publishes the highest priority it holds, and a REQUEST serves the shard with
+// the highest one, preferring its connection's home shard on ties and
+// stealing from the others round robin (see pop). FIFO order
+// therefore holds per shard and priority, not globally. in-flight jobs are not
+// kept here at all: each connection owns its leases and only touches the store
+// to hand a job back.
+//
+// with the ring backend every shard also gets a lock-free ring for priority 0
+// jobs in front of its level 0 bucket. that bucket then only holds overflow:
+// once anything has spilled, pushes keep going to the bucket until it drains,
+// and pops take from the ring first, so the ring always holds the oldest
+// priority 0 jobs of the shard. ring jobs do not take part in aging. a ring
+// is only allocated by the first push that wants it, so a queue that never
+// sees priority 0 jobs on a shard does not pay for its ring there.
+class JobStore {
+public:
+  explicit JobStore(size_t num_shards = 16,
+                    QueueBackend backend = QueueBackend::Locked,
+                    size_t ring_slots = 4096,
+                    std::chrono::milliseconds aging = {})
+      : shards(num_shards == 0 ? 1 : num_shards),
+        ring_slots(backend == QueueBackend::Ring ? ring_slots : 0),
+        aging_ms(aging.count()) {}
+
+  size_t shard_count() const { return shards.size(); }
+
+  uint64_t next_id() {
+    return last_id.fetch_add(1, std::memory_order_relaxed) + 1;
+  }
+
+  // n contiguous ids, returns the first
+  uint64_t next_ids(uint64_t n) {
+    return last_id.fetch_add(n, std::memory_order_relaxed) + 1;
+  }
+
+  // used by recovery so that new ids continue after the logged ones
+  void set_last_id(uint64_t id) {
+    last_id.store(id, std::memory_order_relaxed);
+  }
+
+  void push(Job job) {
+    Shard &shard = shards[job.job_id % shards.size()];
+    if (ring_slots > 0 && job.priority == 0 &&
+        shard.level0.load(std::memory_order_acquire) == 0 &&
+        ring_for_push(shard)->try_push(job)) {
+      return;
+    }
+    job.queued_ms = aging_ms > 0 ? steady_now_ms() : 0;
+    std::lock_guard<std::mutex> lock(shard.mutex);
+    shard.jobs.push(std::move(job));
+    shard.publish();
+  }
+
+  // pushes a whole batch with one lock acquisition per shard it touches
+  void push(std::vector<Job> &batch) {
+    size_t n = shards.size();
+    std::sort(batch.begin(), batch.end(), [n](const Job &a, const Job &b) {
+      return a.job_id % n != b.job_id % n ? a.job_id % n < b.job_id % n
+                                          : a.job_id < b.job_id;
+    });
+    int64_t now = aging_ms > 0 ? steady_now_ms() : 0;
+    size_t i = 0;
+    while (i < batch.size()) {
+      Shard &shard = shards[batch[i].job_id % n];
+      std::unique_lock<std::mutex> lock(shard.mutex, std::defer_lock);
+      for (; i < batch.size() && &shards[batch[i].job_id % n] == &shard; i++) {
+        Job &job = batch[i];
+        // same rule as a single push: the ring only until the first spill
+        if (!lock.owns_lock() && ring_slots > 0 && job.priority == 0 &&
+            shard.level0.load(std::memory_order_acquire) == 0 &&
+            ring_for_push(shard)->try_push(job)) {
+          continue;
+        }
+        if (!lock.owns_lock()) {
+          lock.lock();
+        }
+        job.queued_ms = now;
+        shard.jobs.push(std::move(job));
+      }
+      if (lock.owns_lock()) {
+        shard.publish();
+      }
+    }
+  }
+
+  // moves up to max jobs into out, highest priority first. the home shard is
+  // drained first as long as it holds the best level; past that, jobs are
+  // stolen one at a time, starting each scan after the shard stolen from
+  // last, so a steady backlog spread over the shards is served round robin
+  // rather than nearest shard first. returns how many were taken.
+  size_t pop(size_t home, size_t max, std::vector<Job> &out) {
+    if (aging_ms > 0) {
+      maybe_age();
+    }
+
+    size_t n = shards.size();
+    home %= n;
+    size_t taken = 0;
+    size_t misses = 0;
+    Job job;
+    while (taken < max && misses <= n) {
+      // peek without locks so idle shards cost no cache line transfers.
+      // strictly greater: home keeps ties
+      size_t chosen = home;
+      int best = peek_top(shards[home]);
+      size_t start = steal_from.load(std::memory_order_relaxed);
+      for (size_t i = 0; i < n; i++) {
+        size_t at = (start + i) % n;
+        int top = peek_top(shards[at]);
+        if (top > best) {
+          best = top;
+          chosen = at;
+        }
+      }
+      if (best < 0) {
+        break;
+      }
+      Shard &shard = shards[chosen];
+      size_t limit = max;
+      if (chosen != home) {
+        limit = taken + 1;
+        steal_from.store((chosen + 1) % n, std::memory_order_relaxed);
+      }
+
+      size_t before = taken;
+      MpmcRing<Job> *ring = shard.ring.load(std::memory_order_acquire);
+      if (best == 0 && ring) {
+        while (taken < limit && ring->try_pop(job)) {
+          out.push_back(std::move(job));
+          taken++;
+        }
+      }
+      if (taken < limit && shard.top.load(std::memory_order_relaxed) >= best) {
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        int level = shard.jobs.top();
+        // stay on this shard while it holds the best level we saw
+        while (taken < limit && level >= best) {
+          out.push_back(shard.jobs.pop(level));
+          taken++;
+          level = shard.jobs.top();
+        }
+        shard.publish();
+      }
+      // somebody else emptied the shard between the peek and the lock
+      if (taken == before) {
+        misses++;
+      }
+    }
+    return taken;
+  }
+
+  size_t size() const {
+    size_t total = 0;
+    for (const Shard &shard : shards) {
+      total += shard.size.load(std::memory_order_relaxed);
+      if (MpmcRing<Job> *ring = shard.ring.load(std::memory_order_acquire)) {
+        total += ring->size();
+      }
+    }
+    return total;
+  }
+
+  // true when a job with this id would have to go to the locked overflow
+  // bucket, used to push back on producers instead (approximate, lock-free)
+  bool would_spill(uint64_t job_id) const {
+    const Shard &shard = shards[job_id % shards.size()];
+    MpmcRing<Job> *ring = shard.ring.load(std::memory_order_acquire);
+    return ring_slots > 0 &&
+           (shard.level0.load(std::memory_order_relaxed) > 0 ||
+            (ring && ring->size() >= ring->capacity()));
+  }
+
+private:
+  // padded so that two shards never share a cache line
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    BucketQueue jobs;
+    // lock-free views of jobs for peeking, written under mutex
+    std::atomic<size_t> size{0};
+    std::atomic<size_t> level0{0};
+    std::atomic<int> top{-1};
+    // ring backend only, null until the first push that wants it
+    std::atomic<MpmcRing<Job> *> ring{nullptr};
+
+    ~Shard() { delete ring.load(std::memory_order_relaxed); }
+
+    void publish() {
+      size.store(jobs.size(), std::memory_order_relaxed);
+      level0.store(jobs.level_size(0), std::memory_order_release);
+      top.store(jobs.top(), std::memory_order_release);
+    }
+  };
+
+  std::vector<Shard> shards;
+  size_t ring_slots; // 0 without the ring backend
+  int64_t aging_ms;
+  alignas(64) std::atomic<uint64_t> last_id{0};
+  // where the next steal scan starts, shared by every REQUEST. racy by
+  // design: it only spreads steals out.
+  alignas(64) std::atomic<size_t> steal_from{0};
+  std::atomic<int64_t> next_aging_ms{0};
+
+  // the shard's ring, allocated on first use. pushes racing to create it
+  // all end up with the one that was installed first.
+  MpmcRing<Job> *ring_for_push(Shard &shard) {
+    MpmcRing<Job> *ring = shard.ring.load(std::memory_order_acquire);
+    if (ring != nullptr) {
+      return ring;
+    }
+    auto made = std::make_unique<MpmcRing<Job>>(ring_slots);
+    if (shard.ring.compare_exchange_strong(ring, made.get(),
+                                           std::memory_order_acq_rel,
+                                           std::memory_order_acquire)) {
+      return made.release();
+    }
+    return ring;
+  }
+
+  // the best level a shard holds, -1 for none
+  static int peek_top(const Shard &shard) {
+    int top = shard.top.load(std::memory_order_relaxed);
+    MpmcRing<Job> *ring = shard.ring.load(std::memory_order_acquire);
+    if (top < 0 && ring && ring->size() > 0) {
+      top = 0;
+    }
+    return top;
+  }
+
+  // one aging pass over every shard per aging interval, run by whichever
+  // REQUEST notices first
+  void maybe_age() {
+    int64_t now = steady_now_ms();
+    int64_t due = next_aging_ms.load(std::memory_order_relaxed);
+    if (now < due || !next_aging_ms.compare_exchange_strong(
+                         due, now + aging_ms, std::memory_order_relaxed)) {
+      return;
+    }
+    for (Shard &shard : shards) {
+      if (shard.size.load(std::memory_order_relaxed) == 0) {
+        continue;
+      }
+      std::lock_guard<std::mutex> lock(shard.mutex);
+      shard.jobs.age(now, aging_ms);
+      shard.publish();
+    }
+  }
+};
@@ -0,0 +1,365 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// asynchronous logging. a call site copies its format string pointer and
+// arguments into a fixed-size record in the calling thread's own ring and
+// returns; nothing is formatted, locked or written on the caller's thread. a
+// background thread drains all rings, orders the records by time, formats
+// them and writes them out in one go, debug/info to stdout and warn/error to
+// stderr. a full ring drops the record and counts it rather than blocking.
+//
+// formats use {} placeholders, filled from integers, floats and anything
+// convertible to std::string_view. text arguments share ~180 bytes per record
+// and are truncated beyond that.
+//
+//   LOG_INFO("Job {} ACKed by client {}", id, fd);
+//   LOG_WARN_EVERY(1, "Invalid command {}", line); // at most once a second
+
+enum class LogLevel : int { Debug = 0, Info = 1, Warn = 2, Error = 3, Off = 4 };
+
+inline bool parse_log_level(std::string_view name, LogLevel &level) {
+  static const std::pair<const char *, LogLevel> names[] = {
+      {"debug", LogLevel::Debug}, {"info", LogLevel::Info},
+      {"warn", LogLevel::Warn},   {"error", LogLevel::Error},
+      {"off", LogLevel::Off},
+  };
+  for (auto &entry : names) {
+    if (name.size() == std::strlen(entry.first) &&
+        std::equal(name.begin(), name.end(), entry.first, [](char a, char b) {
+          return (a | 0x20) == b;
+        })) {
+      level = entry.second;
+      return true;
+    }
+  }
+  return false;
+}
+
+class Logger {
+public:
+  static const size_t RING_RECORDS = 1024;
+  static const int MAX_ARGS = 6;
+  static const size_t TEXT_BYTES = 180;
+
+  struct Record {
+    int64_t wall_us;
+    const char *format;
+    uint8_t level;
+    uint8_t nargs;
+    uint8_t kinds[MAX_ARGS]; // Int, Uint, Float or Text
+    union Arg {
+      int64_t i;
+      uint64_t u;
+      double f;
+      struct {
+        uint16_t offset;
+        uint16_t len;
+      } text;
+    } args[MAX_ARGS];
+    uint64_t suppressed; // rate-limited repeats since the last one
+    uint16_t text_used;
+    char text[TEXT_BYTES];
+  };
+
+  // never destroyed, so threads still running during exit may keep logging;
+  // whatever they log after the final drain is simply not written
+  static Logger &instance() {
+    static Logger *logger = new Logger();
+    return *logger;
+  }
+
+  static bool enabled(LogLevel level) {
+    return static_cast<int>(level) >=
+           instance().min_level.load(std::memory_order_relaxed);
+  }
+
+  void set_level(LogLevel level) {
+    min_level.store(static_cast<int>(level), std::memory_order_relaxed);
+  }
+
+  LogLevel level() const {
+    return static_cast<LogLevel>(min_level.load(std::memory_order_relaxed));
+  }
+
+  template <typename... Args>
+  void log(LogLevel level, uint64_t suppressed, const char *format,
+           const Args &...args) {
+    static_assert(sizeof...(Args) <= MAX_ARGS, "too many log arguments");
+    Ring &ring = local_ring();
+    uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+    if (tail - ring.head.load(std::memory_order_acquire) == RING_RECORDS) {
+      ring.dropped.store(ring.dropped.load(std::memory_order_relaxed) + 1,
+                         std::memory_order_relaxed);
+      return;
+    }
+    Record &r = ring.slots[tail % RING_RECORDS];
+    r.wall_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::system_clock::now().time_since_epoch())
+                    .count();
+    r.format = format;
+    r.level = static_cast<uint8_t>(level);
+    r.nargs = 0;
+    r.suppressed = suppressed;
+    r.text_used = 0;
+    (store_arg(r, args), ...);
+    ring.tail.store(tail + 1, std::memory_order_release);
+    if (idle.load(std::memory_order_relaxed)) {
+      wake.notify_one();
+    }
+  }
+
+  // drains everything logged so far and stops the writer, run at exit
+  void stop() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_one();
+    if (writer.joinable()) {
+      writer.join();
+    }
+  }
+
+private:
+  enum Kind : uint8_t { Int, Uint, Float, Text };
+
+  // single producer (the owning thread), single consumer (the writer)
+  struct Ring {
+    alignas(64) std::atomic<uint64_t> tail{0};
+    alignas(64) std::atomic<uint64_t> head{0};
+    std::atomic<uint64_t> dropped{0};
+    Record slots[RING_RECORDS];
+  };
+
+  std::atomic<int> min_level{static_cast<int>(LogLevel::Info)};
+  std::mutex mutex; // guards rings (registration) and stopping
+  std::condition_variable wake;
+  std::atomic<bool> idle{false};
+  std::vector<std::unique_ptr<Ring>> rings;
+  bool stopping = false;
+  std::thread writer;
+
+  Logger() {
+    writer = std::thread(&Logger::run, this);
+    std::atexit([] { instance().stop(); });
+  }
+
+  Ring &local_ring() {
+    // rings outlive their threads so that nothing logged is lost
+    thread_local Ring *ring = [this] {
+      std::lock_guard<std::mutex> lock(mutex);
+      rings.push_back(std::make_unique<Ring>());
+      return rings.back().get();
+    }();
+    return *ring;
+  }
+
+  template <typename T> static void store_arg(Record &r, const T &value) {
+    Record::Arg &arg = r.args[r.nargs];
+    if constexpr (std::is_floating_point_v<T>) {
+      r.kinds[r.nargs] = Float;
+      arg.f = static_cast<double>(value);
+    } else if constexpr (std::is_integral_v<T> && std::is_signed_v<T>) {
+      r.kinds[r.nargs] = Int;
+      arg.i = static_cast<int64_t>(value);
+    } else if constexpr (std::is_integral_v<T>) {
+      r.kinds[r.nargs] = Uint;
+      arg.u = static_cast<uint64_t>(value);
+    } else {
+      std::string_view text(value);
+      size_t len = std::min(text.size(), TEXT_BYTES - r.text_used);
+      std::memcpy(r.text + r.text_used, text.data(), len);
+      r.kinds[r.nargs] = Text;
+      arg.text.offset = r.text_used;
+      arg.text.len = static_cast<uint16_t>(len);
+      r.text_used = static_cast<uint16_t>(r.text_used + len);
+    }
+    r.nargs++;
+  }
+
+  static void format_record(const Record &r, std::string &out) {
+    static const char *const names[] = {"DEBUG", "INFO", "WARN", "ERROR"};
+    time_t seconds = static_cast<time_t>(r.wall_us / 1000000);
+    tm local;
+    localtime_r(&seconds, &local);
+    char stamp[64];
+    size_t n = std::strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", &local);
+    std::snprintf(stamp + n, sizeof(stamp) - n, ".%06lld %-5s ",
+                  static_cast<long long>(r.wall_us % 1000000),
+                  names[r.level]);
+    out += stamp;
+
+    int next = 0;
+    for (const char *p = r.format; *p != '\0'; p++) {
+      if (p[0] == '{' && p[1] == '}' && next < r.nargs) {
+        const Record::Arg &arg = r.args[next];
+        switch (r.kinds[next]) {
+        case Int:
+          out += std::to_string(arg.i);
+          break;
+        case Uint:
+          out += std::to_string(arg.u);
+          break;
+        case Float: {
+          char number[32];
+          std::snprintf(number, sizeof(number), "%g", arg.f);
+          out += number;
+          break;
+        }
+        case Text:
+          out.append(r.text + arg.text.offset, arg.text.len);
+          break;
+        }
+        next++;
+        p++;
+      } else {
+        out += *p;
+      }
+    }
+    if (r.suppressed > 0) {
+      out += " (" + std::to_string(r.suppressed) + " similar suppressed)";
+    }
+    out += '\n';
+  }
+
+  void run() {
+    std::vector<const Record *> batch;
+    std::vector<std::pair<Ring *, uint64_t>> drained;
+    std::string out_normal;
+    std::string out_errors;
+    while (true) {
+      bool stop;
+      std::vector<Ring *> snapshot;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = stopping;
+        for (auto &ring : rings) {
+          snapshot.push_back(ring.get());
+        }
+      }
+
+      batch.clear();
+      drained.clear();
+      uint64_t dropped = 0;
+      for (Ring *ring : snapshot) {
+        uint64_t head = ring->head.load(std::memory_order_relaxed);
+        uint64_t tail = ring->tail.load(std::memory_order_acquire);
+        for (uint64_t i = head; i < tail; i++) {
+          batch.push_back(&ring->slots[i % RING_RECORDS]);
+        }
+        drained.push_back({ring, tail});
+        dropped += ring->dropped.exchange(0, std::memory_order_relaxed);
+      }
+      // interleave threads by time within one pass
+      std::stable_sort(batch.begin(), batch.end(),
+                       [](const Record *a, const Record *b) {
+                         return a->wall_us < b->wall_us;
+                       });
+      for (const Record *r : batch) {
+        format_record(*r, r->level >= static_cast<uint8_t>(LogLevel::Warn)
+                              ? out_errors
+                              : out_normal);
+      }
+      // the slots are only handed back once formatted
+      for (auto &[ring, tail] : drained) {
+        ring->head.store(tail, std::memory_order_release);
+      }
+      if (dropped > 0) {
+        out_errors += "log ring full, dropped " + std::to_string(dropped) +
+                      " records\n";
+      }
+      if (!out_normal.empty()) {
+        std::fwrite(out_normal.data(), 1, out_normal.size(), stdout);
+        std::fflush(stdout);
+        out_normal.clear();
+      }
+      if (!out_errors.empty()) {
+        std::fwrite(out_errors.data(), 1, out_errors.size(), stderr);
+        std::fflush(stderr);
+        out_errors.clear();
+      }
+
+      if (stop) {
+        return;
+      }
+      if (batch.empty()) {
+        // nothing to do: sleep until a record arrives or a few ms pass
+        std::unique_lock<std::mutex> lock(mutex);
+        idle.store(true, std::memory_order_relaxed);
+        wake.wait_for(lock, std::chrono::milliseconds(10),
+                      [this] { return stopping; });
+        idle.store(false, std::memory_order_relaxed);
+      }
+    }
+  }
+};
+
+// lets through at most per_second records a second per call site and
+// thread, and tells the next one that gets through how many were held back
+class LogRateLimit {
+public:
+  // returns false to suppress; suppressed is set when returning true
+  bool allow(double per_second, uint64_t &suppressed) {
+    int64_t now = std::chrono::duration_cast<std::chrono::microseconds>(
+                      std::chrono::steady_clock::now().time_since_epoch())
+                      .count();
+    double burst = per_second < 1 ? 1 : per_second;
+    tokens = std::min(burst, tokens + (now - last_us) * per_second / 1e6);
+    last_us = now;
+    if (tokens < 1) {
+      held_back++;
+      return false;
+    }
+    tokens -= 1;
+    suppressed = held_back;
+    held_back = 0;
+    return true;
+  }
+
+private:
+  double tokens = 1;
+  int64_t last_us = 0;
+  uint64_t held_back = 0;
+};
+
+#define LOG_AT(level, ...)                                                     \
+  do {                                                                         \
+    if (Logger::enabled(level)) {                                              \
+      Logger::instance().log(level, 0, __VA_ARGS__);                           \
+    }                                                                          \
+  } while (0)
+
+#define LOG_AT_EVERY(level, per_second, ...)                                   \
+  do {                                                                         \
+    if (Logger::enabled(level)) {                                              \
+      static thread_local LogRateLimit log_limit_;                             \
+      uint64_t log_suppressed_ = 0;                                            \
+      if (log_limit_.allow(per_second, log_suppressed_)) {                     \
+        Logger::instance().log(level, log_suppressed_, __VA_ARGS__);           \
+      }                                                                        \
+    }                                                                          \
+  } while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LogLevel::Debug, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LogLevel::Info, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LogLevel::Warn, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LogLevel::Error, __VA_ARGS__)
+#define LOG_WARN_EVERY(per_second, ...)                                        \
+  LOG_AT_EVERY(LogLevel::Warn, per_second, __VA_ARGS__)
@@ -0,0 +1,271 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+
+// the LZ4 block format, see lz4_Block_format.md in the LZ4 sources, so that
+// clients in other languages can use any LZ4 library. a block is a
+// run of sequences: a token (literal length << 4 | match length - 4), longer
+// lengths continued in bytes of 255, the literals, a 2 byte little endian
+// offset back into the output and the match length continuation. the last
+// sequence is literals only, and the last 5 bytes are always literals.
+//
+// the compressor is the single pass greedy one of LZ4's fast mode: a 4 KiB
+// hash table of the last position every 4 byte prefix was seen at, extended
+// backwards and forwards once a match is found. the decompressor checks every
+// length and offset against both buffers, since blocks come off the network.
+const size_t LZ4_MIN_MATCH = 4;
+const size_t LZ4_LAST_LITERALS = 5;
+const size_t LZ4_MFLIMIT = 12; // no match starts in the last 12 bytes
+const size_t LZ4_MAX_OFFSET = 65535;
+
+inline size_t lz4_bound(size_t size) { return size + size / 255 + 16; }
+
+inline uint32_t lz4_load32(const uint8_t *p) {
+  uint32_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint64_t lz4_load64(const uint8_t *p) {
+  uint64_t v;
+  std::memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+inline uint8_t *lz4_put_length(uint8_t *out, size_t n) {
+  while (n >= 255) {
+    *out++ = 255;
+    n -= 255;
+  }
+  *out++ = static_cast<uint8_t>(n);
+  return out;
+}
+
+// the closing sequence, literals only
+inline uint8_t *lz4_put_last_literals(uint8_t *out, const uint8_t *from,
+                                      size_t n) {
+  *out++ = static_cast<uint8_t>((n < 15 ? n : 15) << 4);
+  if (n >= 15) {
+    out = lz4_put_length(out, n - 15);
+  }
+  std::memcpy(out, from, n);
+  return out + n;
+}
+
+// bytes a and b have in common, up to limit - b
+inline size_t lz4_common(const uint8_t *a, const uint8_t *b,
+                         const uint8_t *limit) {
+  const uint8_t *start = b;
+  while (b + 8 <= limit) {
+    uint64_t diff = lz4_load64(a) ^ lz4_load64(b);
+    if (diff != 0) {
+      return static_cast<size_t>(b - start) +
+             static_cast<size_t>(__builtin_ctzll(diff) / 8);
+    }
+    a += 8;
+    b += 8;
+  }
+  while (b < limit && *a == *b) {
+    a++;
+    b++;
+  }
+  return static_cast<size_t>(b - start);
+}
+
+// walks a block, copying into dst unless it is null. false unless the block
+// is well formed and decodes to exactly raw_size bytes.
+inline bool lz4_walk(const char *src, size_t size, char *dst,
+                     size_t raw_size) {
+  auto ip = reinterpret_cast<const uint8_t *>(src);
+  const uint8_t *iend = ip + size;
+  size_t op = 0;
+  auto length = [&](size_t &n) {
+    uint8_t byte;
+    do {
+      if (ip == iend) {
+        return false;
+      }
+      byte = *ip++;
+      n += byte;
+    } while (byte == 255);
+    return true;
+  };
+  while (ip < iend) {
+    uint8_t token = *ip++;
+    size_t literals = token >> 4;
+    if (literals == 15 && !length(literals)) {
+      return false;
+    }
+    if (literals > static_cast<size_t>(iend - ip) ||
+        literals > raw_size - op) {
+      return false;
+    }
+    if (dst != nullptr) {
+      std::memcpy(dst + op, ip, literals);
+    }
+    ip += literals;
+    op += literals;
+    if (ip == iend) {
+      break;
+    }
+    if (iend - ip < 2) {
+      return false;
+    }
+    size_t offset =
+        static_cast<size_t>(ip[0]) | static_cast<size_t>(ip[1]) << 8;
+    ip += 2;
+    size_t match = token & 15;
+    if (match == 15 && !length(match)) {
+      return false;
+    }
+    match += LZ4_MIN_MATCH;
+    if (offset == 0 || offset > op || match > raw_size - op) {
+      return false;
+    }
+    if (dst != nullptr) {
+      char *to = dst + op;
+      const char *from = to - offset;
+      if (offset >= match) {
+        std::memcpy(to, from, match);
+      } else {
+        // overlapping: a short offset repeats the bytes just written
+        for (size_t i = 0; i < match; i++) {
+          to[i] = from[i];
+        }
+      }
+    }
+    op += match;
+  }
+  return op == raw_size;
+}
+
+// compresses size bytes at src into dst, which must have room for
+// lz4_bound(size) bytes, and returns the compressed size
+inline size_t lz4_compress(const char *src, size_t size, char *dst) {
+  const int HASH_BITS = 12;
+  uint32_t table[1 << HASH_BITS] = {};
+  auto in = reinterpret_cast<const uint8_t *>(src);
+  auto out = reinterpret_cast<uint8_t *>(dst);
+  size_t anchor = 0;
+  if (size > LZ4_MFLIMIT) {
+    size_t last_start = size - LZ4_MFLIMIT;
+    const uint8_t *match_limit = in + size - LZ4_LAST_LITERALS;
+    size_t pos = 0;
+    while (pos <= last_start) {
+      uint32_t prefix = lz4_load32(in + pos);
+      uint32_t hash = (prefix * 2654435761u) >> (32 - HASH_BITS);
+      size_t ref = table[hash];
+      table[hash] = static_cast<uint32_t>(pos);
+      if (ref >= pos || pos - ref > LZ4_MAX_OFFSET ||
+          lz4_load32(in + ref) != prefix) {
+        // skip ahead faster through data that does not compress
+        pos += 1 + ((pos - anchor) >> 6);
+        continue;
+      }
+      size_t length =
+          LZ4_MIN_MATCH + lz4_common(in + ref + LZ4_MIN_MATCH,
+                                     in + pos + LZ4_MIN_MATCH, match_limit);
+      while (pos > anchor && ref > 0 && in[pos - 1] == in[ref - 1]) {
+        pos--;
+        ref--;
+        length++;
+      }
+
+      size_t literals = pos - anchor;
+      size_t extra = length - LZ4_MIN_MATCH;
+      uint8_t *token = out++;
+      *token = static_cast<uint8_t>((literals < 15 ? literals : 15) << 4 |
+                                    (extra < 15 ? extra : 15));
+      if (literals >= 15) {
+        out = lz4_put_length(out, literals - 15);
+      }
+      std::memcpy(out, in + anchor, literals);
+      out += literals;
+      size_t offset = pos - ref;
+      *out++ = static_cast<uint8_t>(offset);
+      *out++ = static_cast<uint8_t>(offset >> 8);
+      if (extra >= 15) {
+        out = lz4_put_length(out, extra - 15);
+      }
+      pos += length;
+      anchor = pos;
+      // the position just before the next one, so that runs chain up
+      if (pos - 2 <= last_start) {
+        table[(lz4_load32(in + pos - 2) * 2654435761u) >> (32 - HASH_BITS)] =
+            static_cast<uint32_t>(pos - 2);
+      }
+    }
+  }
+  out = lz4_put_last_literals(out, in + anchor, size - anchor);
+  return static_cast<size_t>(out - reinterpret_cast<uint8_t *>(dst));
+}
+
+// false unless src is a well formed block of exactly raw_size bytes, which
+// are then in dst
+inline bool lz4_decompress(const char *src, size_t size, char *dst,
+                           size_t raw_size) {
+  return lz4_walk(src, size, dst, raw_size);
+}
+
+// a compressed job payload as it travels and is stored: a u32 of the
+// uncompressed length, big endian like every other protocol field, then
+// the block
+const size_t LZ4_PACKED_HEADER = 4;
+
+// appends raw packed to out. false, with out unchanged, if that would not
+// be smaller than raw itself.
+inline bool lz4_pack(std::string_view raw, std::string &out) {
+  size_t start = out.size();
+  out.resize(start + LZ4_PACKED_HEADER + lz4_bound(raw.size()));
+  char *at = &out[start];
+  for (int i = 0; i < 4; i++) {
+    at[i] = static_cast<char>(raw.size() >> (24 - 8 * i));
+  }
+  size_t n = lz4_compress(raw.data(), raw.size(), at + LZ4_PACKED_HEADER);
+  if (LZ4_PACKED_HEADER + n >= raw.size()) {
+    out.resize(start);
+    return false;
+  }
+  out.resize(start + LZ4_PACKED_HEADER + n);
+  return true;
+}
+
+// the uncompressed length a packed payload claims, 0 if it is too short
+inline size_t lz4_packed_length(std::string_view packed) {
+  if (packed.size() < LZ4_PACKED_HEADER) {
+    return 0;
+  }
+  size_t n = 0;
+  for (int i = 0; i < 4; i++) {
+    n = n << 8 | static_cast<uint8_t>(packed[i]);
+  }
+  return n;
+}
+
+// checks a packed payload without decompressing it: lengths and offsets only
+inline bool lz4_packed_valid(std::string_view packed, size_t max_length) {
+  size_t n = lz4_packed_length(packed);
+  return n > 0 && n <= max_length &&
+         lz4_walk(packed.data() + LZ4_PACKED_HEADER,
+                          packed.size() - LZ4_PACKED_HEADER, nullptr, n);
+}
+
+// appends the uncompressed payload to out, false if packed is malformed
+inline bool lz4_unpack(std::string_view packed, std::string &out) {
+  size_t n = lz4_packed_length(packed);
+  if (n == 0) {
+    return false;
+  }
+  size_t start = out.size();
+  out.resize(start + n);
+  if (!lz4_decompress(packed.data() + LZ4_PACKED_HEADER,
+                      packed.size() - LZ4_PACKED_HEADER, &out[start], n)) {
+    out.resize(start);
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,331 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+// counters, gauges and latency histograms for the STATS command. every thread
+// records into its own block, registered once on first use, so the hot path
+// is a handful of relaxed loads and stores on memory nobody else writes: no
+// lock, no shared cache line. STATS merges all blocks on demand; a reader may
+// see a recording half done, which only ever shifts a count by one.
+
+enum class Counter {
+  Submitted,
+  Refused,    // SUBMITs answered BUSY
+  Dispatched, // leases handed out
+  Acked,
+  Failed,
+  Requeued, // FAILed, expired or dropped by a disconnect
+  LeaseExpired,
+  ConnectionsAccepted,
+  Syscalls, // socket, eventfd, io_uring and WAL I/O calls
+  COUNT,
+};
+
+// per-thread deltas summed on read
+enum class Gauge {
+  Inflight,
+  Connections,
+  COUNT,
+};
+
+enum class Timer {
+  JobWait,       // enqueue -> dispatch
+  LeaseDuration, // dispatch -> ACK/FAIL
+  WalWrite,      // append -> batch durable
+  WalFsync,      // the sync alone
+  Command,       // handling one command or frame
+  COUNT,
+};
+
+inline int64_t steady_now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// log-linear buckets in the spirit of HdrHistogram: every power of two is
+// split into 32 linear sub-buckets, so any recorded value is known to within
+// ~3% from 1 ns up to the full 64 bit range in 1920 buckets.
+class Histogram {
+public:
+  static const int SUB_BITS = 5;
+  static const uint64_t SUB = 1 << SUB_BITS;
+  static const size_t BUCKETS = (64 - SUB_BITS + 1) * SUB;
+
+  static size_t index_of(uint64_t v) {
+    if (v < SUB) {
+      return static_cast<size_t>(v);
+    }
+    int e = 63 - __builtin_clzll(v);
+    uint64_t sub = (v >> (e - SUB_BITS)) & (SUB - 1);
+    return static_cast<size_t>(e - SUB_BITS + 1) * SUB + sub;
+  }
+
+  // largest value that lands in bucket i
+  static uint64_t upper_bound(size_t i) {
+    if (i < SUB) {
+      return i;
+    }
+    int e = static_cast<int>(i / SUB) + SUB_BITS - 1;
+    uint64_t sub = i % SUB;
+    uint64_t lower = (SUB + sub) << (e - SUB_BITS);
+    return lower + ((uint64_t(1) << (e - SUB_BITS)) - 1);
+  }
+
+  // single writer only
+  void record(uint64_t v) {
+    bump(counts[index_of(v)], 1);
+    bump(total, 1);
+    bump(sum, v);
+    if (v > max.load(std::memory_order_relaxed)) {
+      max.store(v, std::memory_order_relaxed);
+    }
+  }
+
+  struct Snapshot {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(BUCKETS);
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t max = 0;
+
+    // value at quantile q, reported as its bucket's upper bound
+    uint64_t quantile(double q) const {
+      if (total == 0) {
+        return 0;
+      }
+      uint64_t rank = static_cast<uint64_t>(q * static_cast<double>(total));
+      if (rank >= total) {
+        rank = total - 1;
+      }
+      uint64_t seen = 0;
+      for (size_t i = 0; i < BUCKETS; i++) {
+        seen += counts[i];
+        if (seen > rank) {
+          uint64_t bound = upper_bound(i);
+          return bound < max ? bound : max;
+        }
+      }
+      return max;
+    }
+  };
+
+  void merge_into(Snapshot &out) const {
+    for (size_t i = 0; i < BUCKETS; i++) {
+      out.counts[i] += counts[i].load(std::memory_order_relaxed);
+    }
+    out.total += total.load(std::memory_order_relaxed);
+    out.sum += sum.load(std::memory_order_relaxed);
+    uint64_t m = max.load(std::memory_order_relaxed);
+    if (m > out.max) {
+      out.max = m;
+    }
+  }
+
+private:
+  std::atomic<uint64_t> counts[BUCKETS] = {};
+  std::atomic<uint64_t> total{0};
+  std::atomic<uint64_t> sum{0};
+  std::atomic<uint64_t> max{0};
+
+  // a plain load + store instead of a locked read-modify-write, fine with
+  // one writer
+  static void bump(std::atomic<uint64_t> &cell, uint64_t n) {
+    cell.store(cell.load(std::memory_order_relaxed) + n,
+               std::memory_order_relaxed);
+  }
+};
+
+class Metrics {
+public:
+  static void count(Counter c, uint64_t n = 1) {
+    std::atomic<uint64_t> &cell = local().counters[static_cast<size_t>(c)];
+    cell.store(cell.load(std::memory_order_relaxed) + n,
+               std::memory_order_relaxed);
+  }
+
+  static void gauge_add(Gauge g, int64_t delta) {
+    std::atomic<int64_t> &cell = local().gauges[static_cast<size_t>(g)];
+    cell.store(cell.load(std::memory_order_relaxed) + delta,
+               std::memory_order_relaxed);
+  }
+
+  static void record(Timer t, int64_t ns) {
+    local().timers[static_cast<size_t>(t)].record(
+        ns > 0 ? static_cast<uint64_t>(ns) : 0);
+  }
+
+  // values owned elsewhere, e.g. the queue depth, sampled when rendering
+  struct Sample {
+    const char *name;
+    const char *help;
+    double value;
+  };
+
+  static std::string render_text(const std::vector<Sample> &extra) {
+    Totals t = collect();
+    std::string out;
+    for (size_t i = 0; i < COUNTERS; i++) {
+      line(out, "%-24s %llu\n", COUNTER_INFO[i].name,
+           static_cast<unsigned long long>(t.counters[i]));
+    }
+    for (size_t i = 0; i < GAUGES; i++) {
+      line(out, "%-24s %lld\n", GAUGE_INFO[i].name,
+           static_cast<long long>(t.gauges[i]));
+    }
+    for (const Sample &s : extra) {
+      line(out, "%-24s %.0f\n", s.name, s.value);
+    }
+    line(out, "%-24s %10s %10s %10s %10s %10s %10s\n", "latency (us)", "count",
+         "mean", "p50", "p99", "p99.9", "max");
+    for (size_t i = 0; i < TIMERS; i++) {
+      const Histogram::Snapshot &h = t.timers[i];
+      double mean = h.total ? static_cast<double>(h.sum) / h.total : 0;
+      line(out, "%-24s %10llu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+           TIMER_INFO[i].name, static_cast<unsigned long long>(h.total),
+           mean / 1e3, h.quantile(0.5) / 1e3, h.quantile(0.99) / 1e3,
+           h.quantile(0.999) / 1e3, h.max / 1e3);
+    }
+    return out;
+  }
+
+  // Prometheus text exposition format. latencies are summaries in seconds.
+  static std::string render_prometheus(const std::vector<Sample> &extra) {
+    Totals t = collect();
+    std::string out;
+    for (size_t i = 0; i < COUNTERS; i++) {
+      line(out, "# HELP broker_%s_total %s\n# TYPE broker_%s_total counter\n",
+           COUNTER_INFO[i].name, COUNTER_INFO[i].help, COUNTER_INFO[i].name);
+      line(out, "broker_%s_total %llu\n", COUNTER_INFO[i].name,
+           static_cast<unsigned long long>(t.counters[i]));
+    }
+    auto gauge = [&out](const char *name, const char *help, double value) {
+      line(out, "# HELP broker_%s %s\n# TYPE broker_%s gauge\n", name, help,
+           name);
+      line(out, "broker_%s %.0f\n", name, value);
+    };
+    for (size_t i = 0; i < GAUGES; i++) {
+      gauge(GAUGE_INFO[i].name, GAUGE_INFO[i].help,
+            static_cast<double>(t.gauges[i]));
+    }
+    for (const Sample &s : extra) {
+      gauge(s.name, s.help, s.value);
+    }
+    for (size_t i = 0; i < TIMERS; i++) {
+      const char *name = TIMER_INFO[i].name;
+      const Histogram::Snapshot &h = t.timers[i];
+      line(out, "# HELP broker_%s_seconds %s\n# TYPE broker_%s_seconds summary\n",
+           name, TIMER_INFO[i].help, name);
+      for (double q : {0.5, 0.9, 0.99, 0.999}) {
+        line(out, "broker_%s_seconds{quantile=\"%g\"} %.9f\n", name, q,
+             h.quantile(q) / 1e9);
+      }
+      line(out, "broker_%s_seconds_sum %.9f\n", name, h.sum / 1e9);
+      line(out, "broker_%s_seconds_count %llu\n", name,
+           static_cast<unsigned long long>(h.total));
+    }
+    return out;
+  }
+
+private:
+  static const size_t COUNTERS = static_cast<size_t>(Counter::COUNT);
+  static const size_t GAUGES = static_cast<size_t>(Gauge::COUNT);
+  static const size_t TIMERS = static_cast<size_t>(Timer::COUNT);
+
+  struct Info {
+    const char *name;
+    const char *help;
+  };
+  static constexpr Info COUNTER_INFO[COUNTERS] = {
+      {"jobs_submitted", "Jobs accepted by SUBMIT."},
+      {"jobs_refused", "SUBMITs answered BUSY."},
+      {"jobs_dispatched", "Leases handed out to workers."},
+      {"jobs_acked", "Jobs acknowledged by workers."},
+      {"jobs_failed", "Jobs FAILed by workers."},
+      {"jobs_requeued", "Jobs put back after FAIL, lease expiry or disconnect."},
+      {"leases_expired", "Leases that timed out."},
+      {"connections_accepted", "Client connections accepted."},
+      {"syscalls", "I/O system calls made by the event loops and WAL writer."},
+  };
+  static constexpr Info GAUGE_INFO[GAUGES] = {
+      {"jobs_inflight", "Jobs leased to workers and not yet finished."},
+      {"connections", "Open client connections."},
+  };
+  static constexpr Info TIMER_INFO[TIMERS] = {
+      {"job_wait", "Time from enqueue to dispatch."},
+      {"lease_duration", "Time from dispatch to ACK or FAIL."},
+      {"wal_write", "Time from WAL append until the batch is durable."},
+      {"wal_fsync", "Duration of one WAL sync (msync of a batch)."},
+      {"command", "Time to handle one client command or frame."},
+  };
+
+  // one per thread that ever recorded anything, kept for the lifetime of
+  // the process so that nothing is lost when a thread exits
+  struct alignas(64) Block {
+    std::atomic<uint64_t> counters[COUNTERS] = {};
+    std::atomic<int64_t> gauges[GAUGES] = {};
+    Histogram timers[TIMERS];
+  };
+
+  struct Registry {
+    std::mutex mutex;
+    std::vector<std::unique_ptr<Block>> blocks;
+  };
+
+  static Registry &registry() {
+    static Registry r;
+    return r;
+  }
+
+  static Block &local() {
+    thread_local Block *block = [] {
+      Registry &r = registry();
+      std::lock_guard<std::mutex> lock(r.mutex);
+      r.blocks.push_back(std::make_unique<Block>());
+      return r.blocks.back().get();
+    }();
+    return *block;
+  }
+
+  struct Totals {
+    uint64_t counters[COUNTERS] = {};
+    int64_t gauges[GAUGES] = {};
+    Histogram::Snapshot timers[TIMERS];
+  };
+
+  static Totals collect() {
+    Totals t;
+    Registry &r = registry();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    for (const auto &block : r.blocks) {
+      for (size_t i = 0; i < COUNTERS; i++) {
+        t.counters[i] += block->counters[i].load(std::memory_order_relaxed);
+      }
+      for (size_t i = 0; i < GAUGES; i++) {
+        t.gauges[i] += block->gauges[i].load(std::memory_order_relaxed);
+      }
+      for (size_t i = 0; i < TIMERS; i++) {
+        block->timers[i].merge_into(t.timers[i]);
+      }
+    }
+    return t;
+  }
+
+  template <typename... Args>
+  static void line(std::string &out, const char *format, Args... args) {
+    char buffer[512];
+    int n = std::snprintf(buffer, sizeof(buffer), format, args...);
+    if (n > 0) {
+      out.append(buffer, std::min(static_cast<size_t>(n), sizeof(buffer) - 1));
+    }
+  }
+};
@@ -0,0 +1,97 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <utility>
+
+// bounded lock-free multi-producer multi-consumer ring (Vyukov's design).
+// every slot carries a sequence number that tells producers and consumers
+// whose turn it is, so a push or pop is one CAS on the shared position plus
+// a store to the slot's own cache line. the positions and each slot are
+// padded to separate cache lines so producers and consumers don't false
+// share.
+template <typename T> class MpmcRing {
+public:
+  explicit MpmcRing(size_t min_slots) {
+    size_t slots = 2;
+    while (slots < min_slots) {
+      slots <<= 1;
+    }
+    mask = slots - 1;
+    cells = std::make_unique<Cell[]>(slots);
+    for (size_t i = 0; i < slots; i++) {
+      cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+  }
+
+  size_t capacity() const { return mask + 1; }
+
+  // false when the ring is full, value is left untouched in that case
+  bool try_push(T &value) {
+    Cell *cell;
+    size_t pos = enqueue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells[pos & mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff = static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos);
+      if (diff == 0) {
+        if (enqueue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = enqueue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    cell->value = std::move(value);
+    cell->sequence.store(pos + 1, std::memory_order_release);
+    return true;
+  }
+
+  // false when the ring is empty
+  bool try_pop(T &out) {
+    Cell *cell;
+    size_t pos = dequeue_pos.load(std::memory_order_relaxed);
+    while (true) {
+      cell = &cells[pos & mask];
+      size_t seq = cell->sequence.load(std::memory_order_acquire);
+      intptr_t diff =
+          static_cast<intptr_t>(seq) - static_cast<intptr_t>(pos + 1);
+      if (diff == 0) {
+        if (dequeue_pos.compare_exchange_weak(pos, pos + 1,
+                                              std::memory_order_relaxed)) {
+          break;
+        }
+      } else if (diff < 0) {
+        return false;
+      } else {
+        pos = dequeue_pos.load(std::memory_order_relaxed);
+      }
+    }
+    out = std::move(cell->value);
+    cell->sequence.store(pos + mask + 1, std::memory_order_release);
+    return true;
+  }
+
+  // approximate, exact only while nobody is pushing or popping
+  size_t size() const {
+    size_t tail = enqueue_pos.load(std::memory_order_relaxed);
+    size_t head = dequeue_pos.load(std::memory_order_relaxed);
+    return tail > head ? tail - head : 0;
+  }
+
+private:
+  struct alignas(64) Cell {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::unique_ptr<Cell[]> cells;
+  size_t mask;
+  alignas(64) std::atomic<size_t> enqueue_pos{0};
+  alignas(64) std::atomic<size_t> dequeue_pos{0};
+};
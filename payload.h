@@ -0,0 +1,237 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <new>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// job payloads are written once into a size-classed slab block and from then
+// on only passed around by refcounted handle: the queue, the lease tables,
+// the WAL batch and the socket output queues all share the same bytes.
+// payloads are immutable, so sharing needs no further synchronisation.
+//
+// blocks come in power of two classes from 64 bytes to 64 KiB, carved from
+// slabs that are never returned to the system, and recycled through a small
+// per-thread cache in front of a locked per-class free list. anything larger
+// gets a block of its own from the heap.
+class PayloadPool {
+public:
+  static const size_t MIN_CLASS_BYTES = 64;
+  static const size_t MAX_CLASS_BYTES = 64 * 1024;
+  static const int CLASSES = 11; // 64 B .. 64 KiB
+  static const size_t SLAB_BYTES = 256 * 1024;
+
+  struct Block {
+    std::atomic<uint32_t> refs;
+    int16_t size_class; // -1 for a heap block
+    size_t len;
+    Block *next_free;
+
+    char *data() { return reinterpret_cast<char *>(this + 1); }
+  };
+
+  // capacity is the number of payload bytes the block must hold
+  static Block *allocate(size_t capacity) {
+    int cls = class_of(capacity);
+    Block *block;
+    if (cls < 0) {
+      block = static_cast<Block *>(::operator new(sizeof(Block) + capacity));
+    } else {
+      block = cache().pop(cls);
+    }
+    block->refs.store(1, std::memory_order_relaxed);
+    block->size_class = static_cast<int16_t>(cls);
+    block->len = 0;
+    return block;
+  }
+
+  static void release(Block *block) {
+    if (block->size_class < 0) {
+      ::operator delete(block);
+    } else {
+      cache().push(block);
+    }
+  }
+
+  static size_t class_bytes(int cls) { return MIN_CLASS_BYTES << cls; }
+
+private:
+  static int class_of(size_t capacity) {
+    if (capacity > MAX_CLASS_BYTES) {
+      return -1;
+    }
+    int cls = 0;
+    while (class_bytes(cls) < capacity) {
+      cls++;
+    }
+    return cls;
+  }
+
+  struct FreeList {
+    std::mutex mutex;
+    Block *head = nullptr;
+  };
+
+  static FreeList &shared(int cls) {
+    static FreeList lists[CLASSES];
+    return lists[cls];
+  }
+
+  // blocks freed on a thread are reused by the same thread first. a cache
+  // holds at most ~256 KiB per class and trades half of it with the shared
+  // list when it over- or underflows, so the lock is taken once per batch.
+  struct ThreadCache {
+    Block *heads[CLASSES] = {};
+    size_t counts[CLASSES] = {};
+
+    static size_t limit(int cls) {
+      size_t n = SLAB_BYTES / (sizeof(Block) + class_bytes(cls));
+      return n < 4 ? 4 : n;
+    }
+
+    Block *pop(int cls) {
+      if (heads[cls] == nullptr) {
+        refill(cls);
+      }
+      Block *block = heads[cls];
+      heads[cls] = block->next_free;
+      counts[cls]--;
+      return block;
+    }
+
+    void push(Block *block) {
+      int cls = block->size_class;
+      block->next_free = heads[cls];
+      heads[cls] = block;
+      if (++counts[cls] > limit(cls)) {
+        drain(cls, counts[cls] / 2);
+      }
+    }
+
+    void refill(int cls) {
+      size_t want = limit(cls) / 2 + 1;
+      FreeList &list = shared(cls);
+      {
+        std::lock_guard<std::mutex> lock(list.mutex);
+        while (list.head != nullptr && counts[cls] < want) {
+          Block *block = list.head;
+          list.head = block->next_free;
+          block->next_free = heads[cls];
+          heads[cls] = block;
+          counts[cls]++;
+        }
+      }
+      if (heads[cls] != nullptr) {
+        return;
+      }
+      // carve a fresh slab
+      size_t stride = sizeof(Block) + class_bytes(cls);
+      size_t n = SLAB_BYTES / stride;
+      if (n < 4) {
+        n = 4;
+      }
+      char *slab = static_cast<char *>(::operator new(stride * n));
+      for (size_t i = 0; i < n; i++) {
+        Block *block = reinterpret_cast<Block *>(slab + i * stride);
+        block->size_class = static_cast<int16_t>(cls);
+        block->next_free = heads[cls];
+        heads[cls] = block;
+      }
+      counts[cls] += n;
+    }
+
+    void drain(int cls, size_t n) {
+      FreeList &list = shared(cls);
+      std::lock_guard<std::mutex> lock(list.mutex);
+      while (n-- > 0 && heads[cls] != nullptr) {
+        Block *block = heads[cls];
+        heads[cls] = block->next_free;
+        counts[cls]--;
+        block->next_free = list.head;
+        list.head = block;
+      }
+    }
+
+    ~ThreadCache() {
+      for (int cls = 0; cls < CLASSES; cls++) {
+        drain(cls, counts[cls]);
+      }
+    }
+  };
+
+  static ThreadCache &cache() {
+    thread_local ThreadCache tc;
+    return tc;
+  }
+};
+
+// refcounted handle to an immutable payload. copying a Payload copies a
+// pointer; the bytes are freed with the last handle, on whichever thread
+// drops it.
+class Payload {
+public:
+  Payload() = default;
+
+  explicit Payload(std::string_view bytes) {
+    if (bytes.empty()) {
+      return;
+    }
+    block = PayloadPool::allocate(bytes.size());
+    std::memcpy(block->data(), bytes.data(), bytes.size());
+    block->len = bytes.size();
+  }
+
+  // for payloads built in place: reserves capacity bytes, the caller fills
+  // data() and then sets the final length with resize()
+  static Payload with_capacity(size_t capacity) {
+    Payload p;
+    if (capacity > 0) {
+      p.block = PayloadPool::allocate(capacity);
+    }
+    return p;
+  }
+
+  Payload(const Payload &other) : block(other.block) {
+    if (block != nullptr) {
+      block->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  Payload(Payload &&other) noexcept : block(other.block) {
+    other.block = nullptr;
+  }
+
+  Payload &operator=(Payload other) noexcept {
+    std::swap(block, other.block);
+    return *this;
+  }
+
+  ~Payload() {
+    if (block != nullptr &&
+        block->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+      PayloadPool::release(block);
+    }
+  }
+
+  const char *data() const { return block ? block->data() : ""; }
+  char *mutable_data() { return block->data(); }
+  size_t size() const { return block ? block->len : 0; }
+  bool empty() const { return size() == 0; }
+  void resize(size_t len) { block->len = len; }
+
+  std::string_view view() const { return {data(), size()}; }
+  operator std::string_view() const { return view(); }
+
+private:
+  PayloadPool::Block *block = nullptr;
+};
+
+inline std::ostream &operator<<(std::ostream &os, const Payload &payload) {
+  return os << payload.view();
+}
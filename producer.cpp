@@ -1,49 +1,93 @@
-#include <arpa/inet.h>  // inet_pton
-#include <netinet/in.h> // sockaddr_in
-#include <sys/socket.h> // socket, connect, send, recv
-#include <unistd.h>     // close
-
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <string>
+#include <thread>
+#include <vector>
+
+#include "client.h"
 
 using namespace std;
 
-const int PORT = 5003;
+// ./producer [options] <job>...   submits every job over one connection
+// ./producer [options] -          submits one job per line of stdin
+//
+// options: --queue=NAME submits to a named queue, --compress sends jobs of
+// 512 bytes or more LZ4 compressed.
+//
+// the jobs are pipelined: they all go out before the first answer is read,
+// and each "JOB_ID" comes back once the job is durable in the broker's WAL.
+// jobs the broker answers BUSY are submitted again once the wait it asked
+// for has passed, up to MAX_ROUNDS times.
+const int MAX_ROUNDS = 20;
 
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    cerr << "Usage: " << argv[0] << " <job_name>\n";
-    return 1;
+  SubmitOptions opts;
+  ClientOptions client;
+  int first = 1;
+  for (; first < argc; first++) {
+    string arg = argv[first];
+    if (arg.rfind("--queue=", 0) == 0) {
+      opts.queue = arg.substr(8);
+    } else if (arg == "--compress") {
+      client.compression = true;
+    } else {
+      break;
+    }
   }
-
-  string job = argv[1];
-
-  int sock = ::socket(AF_INET, SOCK_STREAM, 0);
-  if (sock == -1) {
-    cerr << "Failed to create socket\n";
+  if (argc <= first) {
+    cerr << "Usage: " << argv[0]
+         << " [--queue=NAME] [--compress] <job_name>... | -\n";
     return 1;
   }
 
-  sockaddr_in server{
-      .sin_family = AF_INET,
-      .sin_port = htons(PORT),
-  };
-
-  // Convert "127.0.0.1" into binary form
-  inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
-
-  // 3. Connect to the server
-  if (::connect(sock, (sockaddr *)&server, sizeof(server)) == -1) {
-    cerr << "Failed to connect\n";
-    close(sock);
-    return 1;
+  vector<string> jobs;
+  if (string(argv[first]) == "-") {
+    string line;
+    while (getline(cin, line)) {
+      if (!line.empty()) {
+        jobs.push_back(line);
+      }
+    }
+  } else {
+    jobs.assign(argv + first, argv + argc);
   }
 
-  string message = "SUBMIT " + job + "\n";
-  if (::send(sock, message.c_str(), message.size(), 0) == -1) {
-    cerr << "Failed to send data\n";
+  Producer producer(client);
+  int failed = 0;
+  for (int round = 1; !jobs.empty(); round++) {
+    vector<future<SubmitResult>> results = producer.submit_batch(jobs, opts);
+    vector<string> busy;
+    uint64_t wait_ms = 0;
+    for (size_t i = 0; i < results.size(); i++) {
+      SubmitResult r = results[i].get();
+      switch (r.status) {
+      case SubmitStatus::Ok:
+        cout << "Submitted job " << r.id << "\n";
+        break;
+      case SubmitStatus::Busy:
+        if (round < MAX_ROUNDS) {
+          busy.push_back(std::move(jobs[i]));
+          wait_ms = max(wait_ms, r.retry_after_ms);
+        } else {
+          cerr << "Job was not accepted: broker busy\n";
+          failed++;
+        }
+        break;
+      case SubmitStatus::Error:
+        cerr << "Job was not accepted: " << r.error << "\n";
+        failed++;
+        break;
+      case SubmitStatus::Disconnected:
+        cerr << "Lost the connection to the broker\n";
+        failed++;
+        break;
+      }
+    }
+    jobs.swap(busy);
+    if (!jobs.empty()) {
+      this_thread::sleep_for(chrono::milliseconds(wait_ms));
+    }
   }
-
-  ::close(sock);
-  return 0;
-}
\ No newline at end of file
+  return failed == 0 ? 0 : 1;
+}
@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// binary framing, negotiated per connection with the text line
+//   HELLO BINARY <version> [LZ4]
+// which the broker echoes back before both sides switch to frames. LZ4 lets
+// the client SUBMIT compressed payloads and asks for them to be forwarded as
+// they are stored, see FLAG_COMPRESSED. every
+// frame is a fixed 16 byte header in network byte order followed by
+// payload_len bytes of payload:
+//   u8 opcode | u8 flags | u16 reserved | u32 payload_len | u64 job_id
+const int BINARY_PROTOCOL_VERSION = 1;
+const size_t FRAME_HEADER_SIZE = 16;
+
+enum Opcode : uint8_t {
+  // client -> broker
+  OP_SUBMIT = 0x01, // payload = job text
+  OP_REQUEST = 0x02,
+  OP_ACK = 0x03, // job_id
+  OP_FAIL = 0x04, // job_id
+  OP_QUIT = 0x05,
+  OP_PREFETCH = 0x06, // job_id field carries the window size, echoed back
+  OP_TOUCH = 0x07,    // job_id, extends its lease
+  OP_STATS = 0x08,    // job_id 0 for the human format, 1 for Prometheus
+  OP_USE = 0x09,      // payload = queue name for the SUBMITs that follow
+  OP_WATCH = 0x0a,    // payload = queue name to add to the REQUEST set
+  OP_IGNORE = 0x0b,   // payload = queue name to drop from the REQUEST set
+  OP_QUEUE = 0x0c,    // payload = queue name, job_id = its DRR weight
+  // payload = u64 max jobs, u64 max payload bytes, queue name; echoed back
+  OP_LIMIT = 0x0d,
+  // job_id = number of jobs, payload = the priority and not-before time as
+  // for SUBMIT, then per job a u32 length (| BATCH_COMPRESSED) and the job
+  // text. answered by one JOB_IDS, BUSY or ERROR for the whole batch.
+  OP_SUBMIT_BATCH = 0x0e,
+  // payload = one or more u64 first, u64 last id pairs, no reply
+  OP_ACK_RANGES = 0x0f,
+
+  // broker -> client
+  OP_JOB_ID = 0x81, // job_id of an accepted SUBMIT
+  OP_JOB = 0x82,    // job_id + payload
+  OP_EMPTY = 0x83,
+  OP_BUSY = 0x84, // SUBMIT rejected, try again in job_id ms
+  OP_TOUCHED = 0x85, // job_id whose lease was extended
+  OP_STATS_REPLY = 0x86, // payload = rendered stats
+  // the ids of a SUBMIT_BATCH: job_id = the first, payload = u32 count, the
+  // rest follow on one by one
+  OP_JOB_IDS = 0x87,
+  // USE and QUEUE are echoed back as they were sent, WATCH and IGNORE with
+  // the number of queues now watched in job_id
+  OP_ERROR = 0x8f, // payload = message
+};
+
+// set on every JOB frame of a batch except the last
+const uint8_t FLAG_MORE = 0x01;
+// SUBMIT: the payload starts with a one byte priority (0-255, default 0)
+// ahead of the job text
+const uint8_t FLAG_PRIORITY = 0x02;
+// SUBMIT: the payload starts (after the priority byte, if any) with a u64
+// unix time in ms before which the job must not be dispatched
+const uint8_t FLAG_NOT_BEFORE = 0x04;
+// SUBMIT and JOB: the job text is LZ4 packed (see lz4.h). only used on
+// connections that said LZ4 in their HELLO; the broker stores and forwards
+// such payloads as they are and unpacks them only for connections that
+// did not.
+const uint8_t FLAG_COMPRESSED = 0x08;
+// SUBMIT_BATCH: set in a job's length when its text is LZ4 packed, as
+// FLAG_COMPRESSED is for a single SUBMIT
+const uint32_t BATCH_COMPRESSED = 0x80000000;
+
+struct FrameHeader {
+  uint8_t opcode;
+  uint8_t flags;
+  uint32_t payload_len;
+  uint64_t job_id;
+};
+
+inline uint64_t load_be64(const unsigned char *p) {
+  uint64_t v = 0;
+  for (int i = 0; i < 8; i++) {
+    v = (v << 8) | p[i];
+  }
+  return v;
+}
+
+inline uint32_t load_be32(const unsigned char *p) {
+  return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+         (uint32_t(p[2]) << 8) | uint32_t(p[3]);
+}
+
+inline void store_be64(unsigned char *p, uint64_t v) {
+  for (int i = 7; i >= 0; i--) {
+    p[i] = static_cast<unsigned char>(v);
+    v >>= 8;
+  }
+}
+
+inline void store_be32(unsigned char *p, uint32_t v) {
+  p[0] = static_cast<unsigned char>(v >> 24);
+  p[1] = static_cast<unsigned char>(v >> 16);
+  p[2] = static_cast<unsigned char>(v >> 8);
+  p[3] = static_cast<unsigned char>(v);
+}
+
+inline FrameHeader decode_header(const char *data) {
+  auto p = reinterpret_cast<const unsigned char *>(data);
+  return {p[0], p[1], load_be32(p + 4), load_be64(p + 8)};
+}
+
+// out is anything with append(const char *, size_t), e.g. a string or an
+// IoChain. the header alone is for payloads the caller appends by reference.
+template <typename Out>
+void append_frame_header(Out &out, uint8_t opcode, uint64_t job_id,
+                         size_t payload_len, uint8_t flags = 0) {
+  unsigned char header[FRAME_HEADER_SIZE] = {opcode, flags, 0, 0};
+  store_be32(header + 4, static_cast<uint32_t>(payload_len));
+  store_be64(header + 8, job_id);
+  out.append(reinterpret_cast<const char *>(header), sizeof(header));
+}
+
+template <typename Out>
+void append_frame(Out &out, uint8_t opcode, uint64_t job_id,
+                  std::string_view payload = {}, uint8_t flags = 0) {
+  append_frame_header(out, opcode, job_id, payload.size(), flags);
+  out.append(payload.data(), payload.size());
+}
+
+// per-connection input buffer. recv() writes straight into the free space and
+// commands are parsed from the readable bytes in place, so a command is only
+// ever copied once it has to outlive the buffer (e.g. a job payload). the
+// capacity is a power of two and grows for frames larger than the ring.
+class ByteRing {
+public:
+  explicit ByteRing(size_t capacity = 16 * 1024) {
+    size_t cap = 1;
+    while (cap < capacity) {
+      cap <<= 1;
+    }
+    buffer.resize(cap);
+  }
+
+  size_t size() const { return static_cast<size_t>(tail - head); }
+  bool empty() const { return head == tail; }
+
+  // largest contiguous free region, for recv() to fill directly. a full ring
+  // is doubled first so that the caller always gets some space.
+  std::pair<char *, size_t> write_span() {
+    if (size() == buffer.size()) {
+      reserve(buffer.size() * 2);
+    }
+    size_t cap = buffer.size();
+    size_t w = static_cast<size_t>(tail) & (cap - 1);
+    return {buffer.data() + w, std::min(cap - size(), cap - w)};
+  }
+
+  // the whole backing store, which only moves when the ring grows or shrinks
+  char *storage() { return buffer.data(); }
+  size_t capacity() const { return buffer.size(); }
+
+  void commit(size_t n) { tail += n; }
+  void consume(size_t n) { head += n; }
+
+  char at(size_t offset) const {
+    return buffer[static_cast<size_t>(head + offset) & (buffer.size() - 1)];
+  }
+
+  // offset of c in the readable bytes at or after from, npos if absent
+  size_t find(char c, size_t from = 0) const {
+    size_t cap = buffer.size();
+    size_t len = size();
+    while (from < len) {
+      size_t pos = static_cast<size_t>(head + from) & (cap - 1);
+      size_t run = std::min(len - from, cap - pos);
+      const void *hit = std::memchr(buffer.data() + pos, c, run);
+      if (hit != nullptr) {
+        return from + static_cast<size_t>(static_cast<const char *>(hit) -
+                                          (buffer.data() + pos));
+      }
+      from += run;
+    }
+    return std::string::npos;
+  }
+
+  // pointer to the first n readable bytes. they are already contiguous unless
+  // they wrap around the end, in which case the ring is unrolled once.
+  const char *peek(size_t n) {
+    size_t cap = buffer.size();
+    size_t r = static_cast<size_t>(head) & (cap - 1);
+    if (r + n > cap) {
+      std::rotate(buffer.begin(), buffer.begin() + static_cast<long>(r),
+                  buffer.end());
+      tail -= head;
+      head = 0;
+      r = 0;
+    }
+    return buffer.data() + r;
+  }
+
+  // gives memory grown for one large frame back once it has been consumed
+  void shrink_if_empty(size_t max_capacity) {
+    if (empty() && buffer.size() > max_capacity) {
+      std::vector<char>(max_capacity).swap(buffer);
+      head = tail = 0;
+    }
+  }
+
+  // makes room for at least n readable bytes in total
+  void reserve(size_t n) {
+    if (n <= buffer.size()) {
+      return;
+    }
+    size_t cap = buffer.size();
+    while (cap < n) {
+      cap <<= 1;
+    }
+    std::vector<char> grown(cap);
+    size_t len = size();
+    size_t r = static_cast<size_t>(head) & (buffer.size() - 1);
+    size_t first = std::min(len, buffer.size() - r);
+    std::memcpy(grown.data(), buffer.data() + r, first);
+    std::memcpy(grown.data() + first, buffer.data(), len - first);
+    buffer.swap(grown);
+    head = 0;
+    tail = len;
+  }
+
+private:
+  std::vector<char> buffer;
+  uint64_t head = 0; // monotonically increasing read position
+  uint64_t tail = 0; // monotonically increasing write position
+};
@@ -0,0 +1,480 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "job_store.h"
+#include "log.h"
+#include "spill.h"
+
+// a named queue: its own sharded job store plus the weight that sets its
+// share of a worker's dispatches against the other queues it watches
+struct NamedQueue {
+  uint32_t id;
+  std::string name;
+  std::atomic<uint32_t> weight;
+  JobStore store; // the head of the backlog, see QueueRegistry::push
+  // the rest of it on disk, null unless the broker spills
+  std::unique_ptr<SpillFile> spill;
+  std::atomic<size_t> spilled{0};
+  std::mutex spill_mutex; // orders spills against refills
+  std::atomic<bool> spill_wanted{false}; // the spill thread has been woken
+  // admission limits, 0 for the broker's per-queue default
+  std::atomic<uint64_t> max_jobs{0};
+  std::atomic<uint64_t> max_bytes{0};
+  // admitted and not yet acknowledged, wherever they are: pending, delayed
+  // or leased
+  std::atomic<uint64_t> held_jobs{0};
+  std::atomic<uint64_t> held_bytes{0};
+
+  NamedQueue(uint32_t id, std::string name, uint32_t weight, size_t shards,
+             QueueBackend backend, size_t ring_slots,
+             std::chrono::milliseconds aging)
+      : id(id), name(std::move(name)), weight(weight),
+        store(shards, backend, ring_slots, aging) {}
+
+  size_t pending() const {
+    return store.size() + spilled.load(std::memory_order_relaxed);
+  }
+};
+
+// every named queue by dense id. the per-job paths (submit, requeue,
+// dispatch) only ever carry the id, which indexes a fixed array of slots
+// without a lock; names are resolved once per USE / WATCH through a hash
+// map under a reader lock. queues are created on first use, never removed,
+// and id 0 is "default", where every connection starts.
+//
+// on_change runs, under the registry lock, whenever a queue is created or
+// its weight or limits change, so the WAL sees those in the order they happen
+// and always ahead of the first job of a new queue.
+//
+// admission keeps the jobs and payload bytes the broker holds under the
+// limits below, per queue and overall. a job is charged when its SUBMIT is
+// admitted and released when it is acknowledged, so requeues cost nothing.
+//
+// with spilling started, a queue keeps at most SpillConfig::window jobs in
+// its store. past that, new priority 0 jobs are appended to its SpillFile
+// instead, and keep going there until the spill has drained, so FIFO order
+// holds across the two tiers. a pop that leaves the store below half the
+// window wakes the spill thread, which reads the oldest spilled jobs back in
+// batches until the window is full again. jobs with a priority never spill:
+// they would only wait behind the backlog they are meant to overtake.
+class QueueRegistry {
+public:
+  static const uint32_t DEFAULT_QUEUE = 0;
+  static const uint32_t NO_QUEUE = UINT32_MAX;
+  static const uint32_t MAX_WEIGHT = 1000;
+
+  // 0 for no limit. set before the broker starts serving.
+  struct Limits {
+    uint64_t max_jobs = 0;
+    uint64_t max_bytes = 0;
+    uint64_t queue_max_jobs = 0; // for queues without their own
+    uint64_t queue_max_bytes = 0;
+  };
+  Limits limits;
+
+  std::function<void(const NamedQueue &)> on_change;
+
+  QueueRegistry(size_t max_queues, size_t shards, QueueBackend backend,
+                size_t ring_slots, std::chrono::milliseconds aging)
+      : slots(std::max<size_t>(1, max_queues)), shards(shards),
+        backend(backend), ring_slots(ring_slots), aging(aging) {
+    add(DEFAULT_QUEUE, "default", 1);
+  }
+
+  QueueRegistry(const QueueRegistry &) = delete;
+  QueueRegistry &operator=(const QueueRegistry &) = delete;
+
+  ~QueueRegistry() {
+    {
+      std::lock_guard<std::mutex> lock(spiller_mutex);
+      spiller_stopping = true;
+    }
+    spiller_cv.notify_one();
+    if (spiller.joinable()) {
+      spiller.join();
+    }
+  }
+
+  // empties config.dir and starts the spill thread. on_refill runs on it
+  // whenever jobs have come back into a queue's store.
+  bool start_spilling(const SpillConfig &config,
+                      std::function<void(NamedQueue &, size_t)> on_refill) {
+    if (config.window == 0 || !reset_spill_dir(config.dir)) {
+      return config.window == 0;
+    }
+    {
+      std::unique_lock<std::shared_mutex> lock(mutex);
+      spill_config = config;
+      for (auto &queue : owned) {
+        queue->spill = std::make_unique<SpillFile>(spill_config, queue->id);
+      }
+    }
+    refilled = std::move(on_refill);
+    spiller = std::thread(&QueueRegistry::run_spiller, this);
+    return true;
+  }
+
+  // 1 to 64 of [A-Za-z0-9_.-]
+  static bool valid_name(std::string_view name) {
+    if (name.empty() || name.size() > 64) {
+      return false;
+    }
+    return std::all_of(name.begin(), name.end(), [](char c) {
+      return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+             (c >= '0' && c <= '9') || c == '_' || c == '.' || c == '-';
+    });
+  }
+
+  size_t shard_count() const { return shards; }
+
+  NamedQueue &at(uint32_t id) {
+    return *slots[id].load(std::memory_order_acquire);
+  }
+
+  bool contains(uint32_t id) const {
+    return id < slots.size() &&
+           slots[id].load(std::memory_order_acquire) != nullptr;
+  }
+
+  NamedQueue *find(std::string_view name) {
+    std::shared_lock<std::shared_mutex> lock(mutex);
+    auto it = by_name.find(std::string(name));
+    return it == by_name.end() ? nullptr : &at(it->second);
+  }
+
+  // null when the name is invalid or every slot is taken
+  NamedQueue *find_or_create(std::string_view name) {
+    if (NamedQueue *queue = find(name)) {
+      return queue;
+    }
+    if (!valid_name(name)) {
+      return nullptr;
+    }
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    auto it = by_name.find(std::string(name));
+    if (it != by_name.end()) {
+      return &at(it->second);
+    }
+    if (next_free >= slots.size()) {
+      return nullptr;
+    }
+    NamedQueue &queue =
+        add(static_cast<uint32_t>(next_free.load()), std::string(name), 1);
+    if (on_change) {
+      on_change(queue);
+    }
+    return &queue;
+  }
+
+  void set_weight(NamedQueue &queue, uint32_t weight) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    queue.weight.store(weight, std::memory_order_relaxed);
+    if (on_change) {
+      on_change(queue);
+    }
+  }
+
+  void set_limits(NamedQueue &queue, uint64_t max_jobs, uint64_t max_bytes) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    queue.max_jobs.store(max_jobs, std::memory_order_relaxed);
+    queue.max_bytes.store(max_bytes, std::memory_order_relaxed);
+    if (on_change) {
+      on_change(queue);
+    }
+  }
+
+  // recovery: puts a logged queue back under its old id, without logging it
+  bool restore(uint32_t id, const std::string &name, uint32_t weight,
+               uint64_t max_jobs = 0, uint64_t max_bytes = 0) {
+    std::unique_lock<std::shared_mutex> lock(mutex);
+    if (id >= slots.size() || !valid_name(name)) {
+      return false;
+    }
+    weight = std::clamp<uint32_t>(weight, 1, MAX_WEIGHT);
+    NamedQueue *queue = slots[id].load(std::memory_order_relaxed);
+    if (queue == nullptr) {
+      queue = &add(id, name, weight);
+    } else if (queue->name != name) {
+      return false;
+    }
+    queue->weight.store(weight, std::memory_order_relaxed);
+    queue->max_jobs.store(max_jobs, std::memory_order_relaxed);
+    queue->max_bytes.store(max_bytes, std::memory_order_relaxed);
+    return true;
+  }
+
+  // counts a job against its queue and the totals without looking at the
+  // limits, e.g. one recovered from the WAL
+  void charge(NamedQueue &queue, uint64_t bytes) {
+    held_jobs_total.fetch_add(1, std::memory_order_relaxed);
+    held_bytes_total.fetch_add(bytes, std::memory_order_relaxed);
+    queue.held_jobs.fetch_add(1, std::memory_order_relaxed);
+    queue.held_bytes.fetch_add(bytes, std::memory_order_relaxed);
+  }
+
+  // four relaxed fetch_adds per SUBMIT, or per SUBMIT_BATCH of count jobs,
+  // which is admitted or refused as a whole. jobs that take a count past its
+  // limit back out again, so SUBMITs racing each other may both be refused
+  // near a limit but never both let past it.
+  bool admit(NamedQueue &queue, uint64_t bytes, uint64_t count = 1) {
+    uint64_t jobs =
+        held_jobs_total.fetch_add(count, std::memory_order_relaxed);
+    uint64_t total =
+        held_bytes_total.fetch_add(bytes, std::memory_order_relaxed);
+    uint64_t queue_jobs =
+        queue.held_jobs.fetch_add(count, std::memory_order_relaxed);
+    uint64_t queue_bytes =
+        queue.held_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    uint64_t queue_max_jobs = queue.max_jobs.load(std::memory_order_relaxed);
+    uint64_t queue_max_bytes = queue.max_bytes.load(std::memory_order_relaxed);
+    if (over(jobs + count, limits.max_jobs) ||
+        over(total + bytes, limits.max_bytes) ||
+        over(queue_jobs + count,
+             queue_max_jobs ? queue_max_jobs : limits.queue_max_jobs) ||
+        over(queue_bytes + bytes,
+             queue_max_bytes ? queue_max_bytes : limits.queue_max_bytes)) {
+      release(queue, bytes, count);
+      return false;
+    }
+    return true;
+  }
+
+  void release(NamedQueue &queue, uint64_t bytes, uint64_t count = 1) {
+    held_jobs_total.fetch_sub(count, std::memory_order_relaxed);
+    held_bytes_total.fetch_sub(bytes, std::memory_order_relaxed);
+    queue.held_jobs.fetch_sub(count, std::memory_order_relaxed);
+    queue.held_bytes.fetch_sub(bytes, std::memory_order_relaxed);
+  }
+
+  uint64_t held_jobs() const {
+    return held_jobs_total.load(std::memory_order_relaxed);
+  }
+  uint64_t held_bytes() const {
+    return held_bytes_total.load(std::memory_order_relaxed);
+  }
+
+  // a job that became pending: into the store, or behind the rest of the
+  // backlog on disk once the queue's window is full
+  void push(NamedQueue &queue, Job job) {
+    if (!queue.spill || job.priority != 0 || fits(queue)) {
+      queue.store.push(std::move(job));
+      return;
+    }
+    size_t buffered;
+    {
+      std::lock_guard<std::mutex> lock(queue.spill_mutex);
+      if (fits(queue)) {
+        queue.store.push(std::move(job));
+        return;
+      }
+      buffered = queue.spill->append(job);
+      queue.spilled.fetch_add(1, std::memory_order_relaxed);
+    }
+    if (buffered >= spill_config.write_bytes) {
+      wake_spiller(queue);
+    }
+  }
+
+  // the same for a batch, in order, with one lock acquisition
+  void push(NamedQueue &queue, std::vector<Job> &batch) {
+    if (!queue.spill) {
+      queue.store.push(batch);
+      return;
+    }
+    size_t buffered = 0;
+    {
+      std::lock_guard<std::mutex> lock(queue.spill_mutex);
+      size_t room = 0;
+      if (queue.spilled.load(std::memory_order_relaxed) == 0) {
+        room = spill_config.window - std::min(spill_config.window,
+                                              queue.store.size());
+      }
+      std::vector<Job> head;
+      for (Job &job : batch) {
+        if (job.priority != 0 || room > 0) {
+          room -= job.priority == 0 ? 1 : 0;
+          head.push_back(std::move(job));
+        } else {
+          buffered = queue.spill->append(job);
+          queue.spilled.fetch_add(1, std::memory_order_relaxed);
+        }
+      }
+      queue.store.push(head);
+    }
+    if (buffered >= spill_config.write_bytes) {
+      wake_spiller(queue);
+    }
+  }
+
+  // JobStore::pop, asking for a refill once the store runs low
+  size_t pop(NamedQueue &queue, size_t home, size_t max,
+             std::vector<Job> &out) {
+    size_t got = queue.store.pop(home, max, out);
+    if (queue.spilled.load(std::memory_order_relaxed) > 0 &&
+        queue.store.size() < low_water()) {
+      wake_spiller(queue);
+    }
+    return got;
+  }
+
+  // ids are global over all queues, so job ids stay unique in the WAL
+  uint64_t next_id() { return at(DEFAULT_QUEUE).store.next_id(); }
+  uint64_t next_ids(uint64_t n) { return at(DEFAULT_QUEUE).store.next_ids(n); }
+  void set_last_id(uint64_t id) { at(DEFAULT_QUEUE).store.set_last_id(id); }
+
+  template <typename Fn> void for_each(Fn &&fn) {
+    size_t end = std::min(next_free.load(), slots.size());
+    for (size_t id = 0; id < end; id++) {
+      if (NamedQueue *queue = slots[id].load(std::memory_order_acquire)) {
+        fn(*queue);
+      }
+    }
+  }
+
+  size_t pending() {
+    size_t total = 0;
+    for_each([&](NamedQueue &queue) { total += queue.pending(); });
+    return total;
+  }
+
+  size_t spilled() {
+    size_t total = 0;
+    for_each([&](NamedQueue &queue) {
+      total += queue.spilled.load(std::memory_order_relaxed);
+    });
+    return total;
+  }
+
+private:
+  std::vector<std::atomic<NamedQueue *>> slots;
+  std::vector<std::unique_ptr<NamedQueue>> owned;
+  std::shared_mutex mutex; // by_name, owned, writes to next_free
+  std::unordered_map<std::string, uint32_t> by_name;
+  std::atomic<size_t> next_free{0}; // read without the lock by for_each
+  size_t shards;
+  QueueBackend backend;
+  size_t ring_slots;
+  std::chrono::milliseconds aging;
+  alignas(64) std::atomic<uint64_t> held_jobs_total{0};
+  std::atomic<uint64_t> held_bytes_total{0};
+
+  // the spill thread, idle unless start_spilling() was called
+  SpillConfig spill_config;
+  std::function<void(NamedQueue &, size_t)> refilled;
+  std::thread spiller;
+  std::mutex spiller_mutex;
+  std::condition_variable spiller_cv;
+  bool spill_work = false;
+  bool spiller_stopping = false;
+  // small buffers are flushed and missed refills caught up this often
+  static constexpr std::chrono::milliseconds SPILL_TICK{10};
+
+  static bool over(uint64_t count, uint64_t limit) {
+    return limit != 0 && count > limit;
+  }
+
+  size_t low_water() const { return spill_config.window / 2 + 1; }
+
+  bool fits(const NamedQueue &queue) const {
+    return queue.spilled.load(std::memory_order_acquire) == 0 &&
+           queue.store.size() < spill_config.window;
+  }
+
+  void wake_spiller(NamedQueue &queue) {
+    if (queue.spill_wanted.exchange(true, std::memory_order_relaxed)) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(spiller_mutex);
+      spill_work = true;
+    }
+    spiller_cv.notify_one();
+  }
+
+  void run_spiller() {
+    std::vector<Job> batch;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(spiller_mutex);
+        spiller_cv.wait_for(lock, SPILL_TICK,
+                            [this] { return spiller_stopping || spill_work; });
+        if (spiller_stopping) {
+          return;
+        }
+        spill_work = false;
+      }
+      for_each([&](NamedQueue &queue) {
+        if (!queue.spill) {
+          return;
+        }
+        queue.spill_wanted.store(false, std::memory_order_relaxed);
+        refill(queue, batch);
+        if (!queue.spill->flush()) {
+          LOG_WARN_EVERY(1, "Could not write spill file of queue {}: {}",
+                         queue.name, strerror(errno));
+        }
+      });
+    }
+  }
+
+  // tops the store up to the window once it is below half of it
+  void refill(NamedQueue &queue, std::vector<Job> &batch) {
+    if (queue.store.size() >= low_water()) {
+      return;
+    }
+    while (queue.spilled.load(std::memory_order_acquire) > 0 &&
+           queue.store.size() < spill_config.window) {
+      batch.clear();
+      bool ok = queue.spill->read(batch);
+      // all that reached the disk is back, the rest is still buffered
+      if (ok && batch.empty()) {
+        ok = queue.spill->flush() && queue.spill->read(batch);
+      }
+      if (!ok) {
+        LOG_WARN_EVERY(1, "Could not read spill file of queue {}: {}",
+                       queue.name, strerror(errno));
+        return;
+      }
+      if (batch.empty()) {
+        return;
+      }
+      size_t jobs = batch.size();
+      {
+        std::lock_guard<std::mutex> lock(queue.spill_mutex);
+        queue.store.push(batch);
+        queue.spilled.fetch_sub(jobs, std::memory_order_release);
+      }
+      if (refilled) {
+        refilled(queue, jobs);
+      }
+    }
+  }
+
+  NamedQueue &add(uint32_t id, std::string name, uint32_t weight) {
+    owned.push_back(std::make_unique<NamedQueue>(
+        id, name, weight, shards, backend, ring_slots, aging));
+    NamedQueue *queue = owned.back().get();
+    if (spill_config.window > 0) {
+      queue->spill = std::make_unique<SpillFile>(spill_config, id);
+    }
+    by_name[std::move(name)] = id;
+    slots[id].store(queue, std::memory_order_release);
+    next_free.store(std::max<size_t>(next_free.load(), id + size_t(1)));
+    return *queue;
+  }
+};
@@ -0,0 +1,129 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "job_store.h"
+#include "timing_wheel.h"
+
+// milliseconds since the unix epoch, the clock not-before times are given in
+inline int64_t wall_now_ms() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// holds jobs submitted with a not-before time until they are due. a single
+// thread owns a timing wheel with one intrusive timer per job, so scheduling
+// and firing stay O(1) however many jobs are waiting. other threads only hand
+// jobs over through a locked inbox. everything that falls due in the same
+// wheel advance is handed to the sink as one batch.
+class Scheduler {
+public:
+  using Sink = std::function<void(std::vector<Job> &)>;
+
+  Scheduler() = default;
+  Scheduler(const Scheduler &) = delete;
+  Scheduler &operator=(const Scheduler &) = delete;
+
+  ~Scheduler() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cv.notify_one();
+    if (thread.joinable()) {
+      thread.join();
+    }
+  }
+
+  void start(Sink on_due) {
+    sink = std::move(on_due);
+    thread = std::thread(&Scheduler::run, this);
+  }
+
+  // job.not_before_ms is a wall clock time; jobs already due come straight
+  // back through the sink on the scheduler thread
+  void schedule(Job job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      inbox.push_back(std::move(job));
+    }
+    waiting.fetch_add(1, std::memory_order_relaxed);
+    cv.notify_one();
+  }
+
+  size_t size() const { return waiting.load(std::memory_order_relaxed); }
+
+private:
+  struct Entry {
+    Job job;
+    TimerNode timer;
+  };
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  std::vector<Job> inbox;
+  bool stopping = false;
+  std::atomic<size_t> waiting{0};
+  Sink sink;
+  std::thread thread;
+
+  void run() {
+    TimingWheel wheel;
+    std::vector<Job> incoming;
+    std::vector<Job> due;
+    while (true) {
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        int timeout = wheel.next_timeout_ms(TimingWheel::Clock::now());
+        auto ready = [this] { return stopping || !inbox.empty(); };
+        if (timeout < 0) {
+          cv.wait(lock, ready);
+        } else if (timeout > 0) {
+          cv.wait_for(lock, std::chrono::milliseconds(timeout), ready);
+        }
+        if (stopping) {
+          return;
+        }
+        incoming.swap(inbox);
+      }
+
+      // the wheel has not moved while the thread slept with nothing armed,
+      // so it is brought up to now before new delays are counted from it
+      wheel.advance(TimingWheel::Clock::now());
+      int64_t now = wall_now_ms();
+      for (Job &job : incoming) {
+        if (job.not_before_ms <= now) {
+          due.push_back(std::move(job));
+          continue;
+        }
+        std::chrono::milliseconds delay(job.not_before_ms - now);
+        // the entry frees itself once it fires; tick() has already unlinked
+        // the node and runs a copy of the callback
+        Entry *entry = new Entry{std::move(job), {}};
+        entry->timer.on_expire = [entry, &due] {
+          due.push_back(std::move(entry->job));
+          delete entry;
+        };
+        wheel.arm(entry->timer, delay);
+      }
+      incoming.clear();
+
+      if (!due.empty()) {
+        waiting.fetch_sub(due.size(), std::memory_order_relaxed);
+        sink(due);
+        due.clear();
+      }
+    }
+  }
+};
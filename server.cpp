@@ -1,242 +1,2282 @@
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <charconv>
 #include <cstddef>
 #include <cstdint>
-#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
+#include <list>
 #include <netinet/in.h>
-#include <queue>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
 #include <string>
+#include <string_view>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <thread>
 #include <unistd.h>
 #include <unordered_map>
+#include <vector>
 
-using namespace std;
-const int PORT = 5003;
+#include "io_chain.h"
+#include "job_store.h"
+#include "log.h"
+#include "lz4.h"
+#include "metrics.h"
+#include "protocol.h"
+#include "queue_registry.h"
+#include "scheduler.h"
+#include "timing_wheel.h"
+#include "uring.h"
+#include "wal.h"
 
-struct Job {
-  uint64_t job_id;
-  string job_text;
-};
+using namespace std;
+const int DEFAULT_PORT = 5003;
+const int MAX_EVENTS = 256;
+const size_t INPUT_RING_BYTES = 16 * 1024;
+const int MAX_IOVECS = 64;
+// per loop with --io=uring: submission queue depth, and slots in the fixed
+// file and buffer tables (the kernel allows at most 16384 buffers)
+const unsigned URING_ENTRIES = 1024;
+const unsigned URING_FIXED_SLOTS = 16384;
 
-queue<Job> jobs;
-unordered_map<int, Job> inflight;
-uint64_t job_id = 0;
-mutex job_mutex;
+// every named queue, each with its own sharded job store
+unique_ptr<QueueRegistry> queues;
+// spreads connections' home shards round robin
+atomic<size_t> next_home_shard{0};
+WalWriter wal;
+// jobs submitted with a not-before time wait here until they are due
+Scheduler scheduler;
+// largest job payload (and so frame or command line) a client may send
+size_t max_payload_bytes = 64 << 20;
+// upper bound for a worker's PREFETCH window
+uint32_t max_prefetch = 1024;
+// a leased job goes back to the queue unless it is ACKed, FAILed or TOUCHed
+// within this long. zero disables lease timeouts.
+chrono::milliseconds lease_timeout{30000};
+// with the ring backend: answer BUSY instead of spilling into the overflow
+// deque when a shard's ring is full
+bool busy_when_full = false;
+// how long a producer told BUSY is asked to wait before trying again
+chrono::milliseconds retry_after{100};
 
-void write_ahead_log(Job job, string type) {
-  ofstream log_file("write-ahead.log", ios::app);
+// hands the record to the group-commit writer. on_durable runs on the WAL
+// thread once the batch holding this record has been synced to disk.
+void write_ahead_log(const Job &job, const string &type,
+                     WalWriter::Callback on_durable = nullptr) {
   if (type == "ADD") {
-    log_file << "ADD " << job.job_id << " " << job.job_text << "\n";
+    wal.append(wal_add_head(job.job_id, job.priority, job.not_before_ms,
+                            job.job_text, job.queue, job.compressed),
+               job.job_text, std::move(on_durable));
   } else if (type == "DONE") {
-    log_file << "DONE " << job.job_id << "\n";
+    wal.append(wal_id_record(WalRecord::Done, job.job_id),
+               std::move(on_durable));
   }
-  log_file.flush();
-  log_file.close();
 }
 
-void read_ahead_log() {
-  ifstream log_file("write-ahead.log");
-  string line;
-  unordered_map<uint64_t, Job> temp_jobs;
+// rebuilds the queues from the newest snapshot plus the log segments after
+// it, jobs in id order. jobs whose not-before time has not come yet go back to
+// the scheduler.
+void read_ahead_log(const WalConfig &config) {
+  unsigned threads = config.recovery_threads;
+  if (threads == 0) {
+    threads = max(1u, thread::hardware_concurrency());
+  }
+  auto started = chrono::steady_clock::now();
+  WalRecovery state = load_wal_state(config.dir, threads);
+  auto parsed = chrono::steady_clock::now();
+  for (const WalQueue &queue : state.queues) {
+    if (!queues->restore(queue.id, queue.name, queue.weight, queue.max_jobs,
+                         queue.max_bytes)) {
+      LOG_WARN("Could not restore queue {} ({}) from WAL", queue.name,
+               queue.id);
+    }
+  }
+  if (!state.queues.empty()) {
+    LOG_INFO("Recovered {} queues from WAL.", state.queues.size());
+  }
+  queues->set_last_id(state.max_job_id);
+  // recovered jobs count against the limits, which may hold new ones back
+  // until they drain
+  int64_t now = wall_now_ms();
+  size_t delayed = 0;
+  for (auto &[id, entry] : state.pending) {
+    Job job{id, std::move(entry.payload), entry.priority};
+    job.not_before_ms = entry.not_before_ms;
+    job.queue = entry.queue;
+    job.compressed = entry.compressed;
+    if (!queues->contains(job.queue)) {
+      LOG_WARN("Job {} belongs to unknown queue {}, moving it to default", id,
+               job.queue);
+      job.queue = QueueRegistry::DEFAULT_QUEUE;
+    }
+    queues->charge(queues->at(job.queue), job.job_text.size());
+    if (job.not_before_ms > now) {
+      scheduler.schedule(std::move(job));
+      delayed++;
+    } else {
+      queues->push(queues->at(job.queue), std::move(job));
+    }
+  }
+  auto done = chrono::steady_clock::now();
+  LOG_INFO("Recovered {} jobs from WAL ({} scheduled) in {} ms: {} ms parsing "
+           "on {} threads, {} ms queueing.",
+           state.pending.size(), delayed,
+           chrono::duration_cast<chrono::milliseconds>(done - started).count(),
+           chrono::duration_cast<chrono::milliseconds>(parsed - started).count(),
+           threads,
+           chrono::duration_cast<chrono::milliseconds>(done - parsed).count());
+}
 
-  while (getline(log_file, line)) {
-    size_t sp = line.find(' ');
-    string cmd = (sp == string::npos) ? line : line.substr(0, sp);
-    string payload = (sp == string::npos) ? "" : line.substr(sp + 1);
+class EventLoop;
 
-    if (cmd == "ADD") {
-      Job job;
-      size_t sp2 = payload.find(' ');
-      if (sp2 != string::npos) {
-        job.job_id = stoull(payload.substr(0, sp2));
-        job.job_text = payload.substr(sp2 + 1);
-        temp_jobs[job.job_id] = job;
+// per-connection state owned by exactly one event loop. nothing here is
+// shared between threads, so it needs no locking.
+struct Connection {
+  int fd;
+  uint64_t conn_id; // unique per loop, fds get reused after close
+  EventLoop *loop;
+  size_t home_shard; // REQUESTs drain this shard of each job store first
+  ByteRing in{INPUT_RING_BYTES}; // bytes received but not yet parsed
+  IoChain out;  // bytes queued for the client but not yet accepted by send()
+  bool binary = false; // switched by HELLO BINARY, frames instead of lines
+  bool compression = false; // HELLO BINARY <version> LZ4
+  // SUBMITs whose JOB_ID waits for the WAL, and the replies held back behind
+  // them (BUSY, a rejected SUBMIT, USING), so that a pipelining producer gets
+  // its answers in the order it sent its commands
+  struct HeldReply {
+    uint64_t after; // submits logged before it
+    uint8_t opcode; // OP_BUSY, OP_ERROR or OP_USE
+    string text;    // error message or queue name
+  };
+  uint64_t submits_logged = 0;
+  uint64_t submits_answered = 0;
+  deque<HeldReply> held_replies;
+  // the queue SUBMITs go to (USE), NO_QUEUE after a USE that failed
+  uint32_t use_queue = QueueRegistry::DEFAULT_QUEUE;
+  bool closing = false;
+  bool retired = false; // leases requeued, only waiting for the fd to close
 
-        if (job.job_id > job_id)
-          job_id = job.job_id;
-      }
+  // io_uring engine only: the requests in flight that point into this
+  // connection, and what out was swapped into while a send is under way
+  unsigned pending_ops = 0;
+  bool recv_pending = false;
+  bool send_pending = false;
+  bool cancel_pending = false;
+  bool fixed_file = false;
+  char *registered_buffer = nullptr; // input ring storage in the buffer table
+  IoChain sending;
+  msghdr send_msg{};
+  iovec send_iov[MAX_IOVECS];
 
-    } else if (cmd == "DONE") {
-      try {
-        uint64_t id = stoull(payload);
-        temp_jobs.erase(id);
-      } catch (...) {
-      }
-    }
+  // jobs leased to this connection, by job id. a worker may hold up to
+  // prefetch of them at once (PREFETCH <n>, default 1). each lease carries
+  // its visibility timeout in the loop's timing wheel.
+  struct Lease {
+    Job job;
+    TimerNode timer;
+    int64_t leased_ns = 0;
+  };
+  unordered_map<uint64_t, Lease> leases;
+  uint32_t prefetch = 1;
+
+  // the queues REQUESTs lease from (WATCH / IGNORE), served by deficit round
+  // robin: drr_cursor is the queue whose turn it is, and deficit what is left
+  // of that queue's turn
+  struct Watch {
+    uint32_t queue;
+    size_t deficit = 0;
+  };
+  vector<Watch> watched{{QueueRegistry::DEFAULT_QUEUE}};
+  size_t drr_cursor = 0;
+
+  // set while a REQUEST <timeout_ms> waits for a job. the token names this
+  // particular wait in the parked worker list.
+  bool parked = false;
+  uint64_t park_token = 0;
+  int64_t park_deadline_ns = 0; // steady clock, when EMPTY is due
+  TimerNode park_timer;
+};
+
+void unpark_worker(Connection &conn);
+void wake_parked_worker(uint32_t queue);
+void arm_park_timer(Connection &conn);
+
+// every way a job can become pending again goes through here, so that a
+// parked worker gets it right away. a requeued job was at the head of the
+// backlog already and goes straight back into memory.
+void enqueue_job(Job job, bool requeue = false) {
+  job.enqueued_ns = steady_now_ns();
+  uint32_t queue = job.queue;
+  if (requeue) {
+    queues->at(queue).store.push(std::move(job));
+  } else {
+    queues->push(queues->at(queue), std::move(job));
   }
-  log_file.close();
+  wake_parked_worker(queue);
+}
 
-  for (auto &pair : temp_jobs) {
-    jobs.push(pair.second);
+// delayed jobs that fell due in the same scheduler tick, one batch per queue
+void enqueue_due_jobs(vector<Job> &due) {
+  int64_t now = steady_now_ns();
+  unordered_map<uint32_t, vector<Job>> by_queue;
+  for (Job &job : due) {
+    job.enqueued_ns = now;
+    by_queue[job.queue].push_back(std::move(job));
+  }
+  for (auto &[queue, batch] : by_queue) {
+    queues->push(queues->at(queue), batch);
+    for (size_t i = 0; i < batch.size(); i++) {
+      wake_parked_worker(queue);
+    }
   }
-  cout << "Recovered " << temp_jobs.size() << " jobs from WAL." << endl;
 }
 
-void handle_inflight_request(int client_fd) {
+void handle_inflight_request(Connection &conn) {
+  unpark_worker(conn);
   // we want to ensure that if a job is incomplete, but the client disconnects
   // prematurely, the job still belongs to the queue without losing it
-  lock_guard<mutex> lock(job_mutex);
-  auto temp_job = inflight.find(client_fd);
-  if (temp_job != inflight.end()) {
-    jobs.push(temp_job->second);
-    inflight.erase(temp_job);
+  for (auto &lease : conn.leases) {
+    enqueue_job(std::move(lease.second.job), true);
   }
+  Metrics::count(Counter::Requeued, conn.leases.size());
+  Metrics::gauge_add(Gauge::Inflight, -static_cast<int64_t>(conn.leases.size()));
+  conn.leases.clear();
 }
 
-void handle_client(int client_fd) {
-  char data[1024];
-  while (true) {
-    ssize_t message = ::recv(client_fd, data, sizeof(data), 0);
+void handle_command(Connection &conn, string_view line);
+void handle_frame(Connection &conn, const FrameHeader &header,
+                  string_view payload);
 
-    if (message < 0) {
-      cerr << "Error receiving a message" << endl;
-      handle_inflight_request(client_fd);
-      ::close(client_fd);
-      break;
-    } else if (message == 0) {
-      ::close(client_fd);
-      break;
+// one reactor per core. every loop owns its own SO_REUSEPORT listening socket
+// so the kernel spreads new connections across loops, and every connection
+// stays on the loop that accepted it for its whole life.
+//
+// with epoll all sockets are non-blocking and registered edge-triggered, so
+// each readiness event has to be drained until EAGAIN. with io_uring every
+// connection instead keeps one receive and at most one send in flight, and
+// everything a loop iteration queued goes to the kernel in the same
+// io_uring_enter that waits for the next completions.
+class EventLoop {
+public:
+  bool open(int port, bool want_uring) {
+    listen_fd = ::socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (listen_fd == -1) {
+      return false;
     }
 
-    // parsing command submitted by the client
-    string line(data, message);
-    if (!line.empty() && line.back() == '\n') {
-      line.pop_back();
+    int opt = 1;
+    if (::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) <
+            0 ||
+        ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt)) <
+            0) {
+      LOG_ERROR("Resuing a port had an issue");
+      return false;
     }
-    if (!line.empty() && line.back() == '\r') {
-      line.pop_back();
+    // inherited by every accepted socket: replies that leave in more than one
+    // send (e.g. JOB_IDs of one pipelined burst made durable by two WAL
+    // batches) must not wait on the client's delayed ACK
+    ::setsockopt(listen_fd, IPPROTO_TCP, TCP_NODELAY, &opt, sizeof(opt));
+
+    sockaddr_in server_struct{};
+    server_struct.sin_family = AF_INET;
+    server_struct.sin_addr.s_addr = htonl(INADDR_ANY);
+    server_struct.sin_port = htons(static_cast<uint16_t>(port));
+
+    if (::bind(listen_fd, reinterpret_cast<sockaddr *>(&server_struct),
+               sizeof(server_struct)) == -1) {
+      return false;
     }
-    size_t sp = line.find(' ');
-    string cmd = (sp == string::npos) ? line : line.substr(0, sp);
-    string payload = (sp == string::npos) ? "" : line.substr(sp + 1);
 
-    if (cmd == "SUBMIT") {
-      if (payload.empty()) {
-        continue;
+    if (::listen(listen_fd, SOMAXCONN) == -1) {
+      return false;
+    }
+
+    wake_fd = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd == -1) {
+      return false;
+    }
+
+    if (want_uring) {
+      if (open_uring()) {
+        return true;
       }
-      cout << cmd << " " << payload << endl;
-      lock_guard<mutex> lock(job_mutex);
-      jobs.push({++job_id, payload});
-      write_ahead_log(jobs.back(), "ADD");
+      LOG_WARN("io_uring unavailable ({}), falling back to epoll",
+               strerror(errno));
+      ring.reset();
+    }
+    return open_epoll();
+  }
 
-    } else if (cmd == "REQUEST") {
-      string out;
+  bool uses_uring() const { return ring != nullptr; }
 
-      // mutex should start and end in this bracket
-      {
-        lock_guard<mutex> lock(job_mutex);
-        if (jobs.empty()) {
-          out = "EMPTY\n";
-        } else {
-          uint64_t id = jobs.front().job_id;
-          string value = jobs.front().job_text;
-          inflight[client_fd] = jobs.front();
-          jobs.pop();
-          out = to_string(id) + " " + value + "\n";
+  // runs task on this loop's thread. this is the only way other threads
+  // (e.g. the WAL writer) may touch a loop's connections.
+  void post(function<void()> task) {
+    bool wake;
+    {
+      lock_guard<mutex> lock(posted_mutex);
+      wake = posted.empty();
+      posted.push_back(std::move(task));
+    }
+    if (wake) {
+      uint64_t one = 1;
+      Metrics::count(Counter::Syscalls);
+      ssize_t ignored = ::write(wake_fd, &one, sizeof(one));
+      (void)ignored;
+    }
+  }
+
+  // runs fn against the connection if it is still the one we think it is,
+  // then writes whatever fn queued
+  void with_connection(int fd, uint64_t conn_id,
+                       const function<void(Connection &)> &fn) {
+    auto it = connections.find(fd);
+    if (it == connections.end() || it->second->conn_id != conn_id ||
+        it->second->closing) {
+      return;
+    }
+    Connection &conn = *it->second;
+    fn(conn);
+    flush(conn);
+    if (conn.closing) {
+      close_connection(conn);
+    }
+  }
+
+  // lease and long-poll timeouts of this loop's connections. only touched
+  // from the loop's own thread.
+  TimingWheel wheel;
+
+  void run() {
+    if (ring) {
+      run_uring();
+    } else {
+      run_epoll();
+    }
+  }
+
+private:
+  int epoll_fd = -1;
+  int listen_fd = -1;
+  int wake_fd = -1;
+  uint64_t next_conn_id = 0;
+  unordered_map<int, unique_ptr<Connection>> connections;
+
+  mutex posted_mutex;
+  vector<function<void()>> posted;
+
+  // io_uring engine. a connection's fd doubles as its slot in the fixed file
+  // and fixed buffer tables; fds past the end of the tables go without.
+  unique_ptr<Uring> ring;
+  unsigned fixed_slots = 0;
+  bool fixed_buffers = false;
+  uint64_t wake_count = 0;
+
+  // the low bits of a request's user_data say what completed, the rest
+  // points at the connection, or is zero for the loop's own requests
+  static const uint64_t OP_ACCEPT = 1;
+  static const uint64_t OP_WAKE = 2;
+  static const uint64_t OP_RECV = 1;
+  static const uint64_t OP_SEND = 2;
+  static const uint64_t OP_CANCEL = 3;
+  static const uint64_t OP_MASK = 3;
+
+  bool open_epoll() {
+    epoll_fd = ::epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd == -1) {
+      return false;
+    }
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = listen_fd;
+    if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev) == -1) {
+      return false;
+    }
+    ev.events = EPOLLIN | EPOLLET;
+    ev.data.fd = wake_fd;
+    return ::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, wake_fd, &ev) != -1;
+  }
+
+  bool open_uring() {
+    ring = make_unique<Uring>();
+    if (!ring->init(URING_ENTRIES)) {
+      return false;
+    }
+    rlimit files{};
+    ::getrlimit(RLIMIT_NOFILE, &files);
+    fixed_slots = static_cast<unsigned>(
+        min<rlim_t>(files.rlim_cur, URING_FIXED_SLOTS));
+    if (!ring->register_files(fixed_slots)) {
+      fixed_slots = 0;
+    }
+    // pinned memory counts against RLIMIT_MEMLOCK, so this may well be
+    // refused, in which case receives simply go without
+    fixed_buffers = fixed_slots > 0 && ring->register_buffers(fixed_slots);
+    // io_uring answers EAGAIN on non-blocking files instead of waiting for
+    // them, so the listener and the eventfd block as far as it is concerned
+    return set_blocking(listen_fd) && set_blocking(wake_fd);
+  }
+
+  static bool set_blocking(int fd) {
+    int flags = ::fcntl(fd, F_GETFL);
+    return flags != -1 && ::fcntl(fd, F_SETFL, flags & ~O_NONBLOCK) != -1;
+  }
+
+  void run_epoll() {
+    vector<epoll_event> events(MAX_EVENTS);
+
+    while (true) {
+      Metrics::count(Counter::Syscalls);
+      int n = ::epoll_wait(epoll_fd, events.data(), MAX_EVENTS,
+                           wheel.next_timeout_ms(chrono::steady_clock::now()));
+      wheel.advance(chrono::steady_clock::now());
+      if (n == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        LOG_ERROR("epoll_wait failed: {}", strerror(errno));
+        return;
+      }
+
+      for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == listen_fd) {
+          accept_all();
+          continue;
+        }
+        if (fd == wake_fd) {
+          uint64_t count;
+          Metrics::count(Counter::Syscalls);
+          while (::read(wake_fd, &count, sizeof(count)) > 0) {
+            Metrics::count(Counter::Syscalls);
+          }
+          run_posted();
+          continue;
+        }
+
+        auto it = connections.find(fd);
+        if (it == connections.end()) {
+          continue;
+        }
+        Connection &conn = *it->second;
+
+        if (events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) {
+          read_all(conn);
+        }
+        // flushed even when closing, so that e.g. an HTTP reply gets out
+        flush(conn);
+        if (conn.closing) {
+          close_connection(conn);
+        }
+      }
+    }
+  }
+
+  void run_uring() {
+    arm_accept();
+    arm_wake();
+    while (true) {
+      if (!ring->enter(1, wheel.next_timeout_ms(chrono::steady_clock::now()))) {
+        LOG_ERROR("io_uring_enter failed: {}", strerror(errno));
+        return;
+      }
+      wheel.advance(chrono::steady_clock::now());
+      ring->for_each_completion(
+          [this](const io_uring_cqe &cqe) { complete(cqe); });
+    }
+  }
+
+  void run_posted() {
+    vector<function<void()>> tasks;
+    {
+      lock_guard<mutex> lock(posted_mutex);
+      tasks.swap(posted);
+    }
+    for (auto &task : tasks) {
+      task();
+    }
+  }
+
+  void accept_all() {
+    while (true) {
+      sockaddr_in client_struct;
+      socklen_t len_client = sizeof(client_struct);
+      Metrics::count(Counter::Syscalls);
+      int client_fd =
+          ::accept4(listen_fd, reinterpret_cast<sockaddr *>(&client_struct),
+                    &len_client, SOCK_NONBLOCK | SOCK_CLOEXEC);
+
+      if (client_fd == -1) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+          LOG_WARN_EVERY(1, "Client connection failed: {}", strerror(errno));
         }
+        if (errno == EINTR) {
+          continue;
+        }
+        return;
       }
-      if (::send(client_fd, out.c_str(), out.size(), 0) == -1) {
-        handle_inflight_request(client_fd);
+
+      // writability is registered up front: with edge triggering we are only
+      // woken when a full socket buffer drains, so it costs nothing while idle
+      epoll_event ev{};
+      ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+      ev.data.fd = client_fd;
+      Metrics::count(Counter::Syscalls);
+      if (::epoll_ctl(epoll_fd, EPOLL_CTL_ADD, client_fd, &ev) == -1) {
         ::close(client_fd);
+        continue;
+      }
+      add_connection(client_fd);
+    }
+  }
+
+  Connection &add_connection(int client_fd) {
+    auto conn = make_unique<Connection>();
+    conn->fd = client_fd;
+    conn->conn_id = ++next_conn_id;
+    conn->loop = this;
+    conn->home_shard = next_home_shard.fetch_add(1, memory_order_relaxed) %
+                       queues->shard_count();
+    Connection &added = *conn;
+    connections[client_fd] = std::move(conn);
+    Metrics::count(Counter::ConnectionsAccepted);
+    Metrics::gauge_add(Gauge::Connections, 1);
+    return added;
+  }
+
+  void read_all(Connection &conn) {
+    while (!conn.closing) {
+      auto [space, space_len] = conn.in.write_span();
+      Metrics::count(Counter::Syscalls);
+      ssize_t message = ::recv(conn.fd, space, space_len, 0);
+
+      if (message < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          LOG_WARN_EVERY(1, "Error receiving a message: {}", strerror(errno));
+          conn.closing = true;
+        }
+        break;
+      } else if (message == 0) {
+        conn.closing = true;
         break;
       }
 
-    } else if (cmd == "QUIT") {
-      handle_inflight_request(client_fd);
-      ::close(client_fd);
-      break;
+      conn.in.commit(static_cast<size_t>(message));
+      parse_input(conn);
+    }
+    conn.in.shrink_if_empty(INPUT_RING_BYTES);
+  }
 
-    } else if (cmd == "ACK") {
-      uint64_t id = 0;
-      try {
-        id = stoull(payload);
-      } catch (...) {
-        cerr << "Invalid ACK format" << endl;
+  // runs every complete command in the input ring, whether it arrived in one
+  // segment with many others or was split over several reads. a connection
+  // may switch from lines to frames halfway through a buffer.
+  void parse_input(Connection &conn) {
+    while (!conn.closing) {
+      if (conn.binary) {
+        if (conn.in.size() < FRAME_HEADER_SIZE) {
+          break;
+        }
+        FrameHeader header = decode_header(conn.in.peek(FRAME_HEADER_SIZE));
+        if (header.payload_len > max_payload_bytes) {
+          LOG_WARN_EVERY(1, "Frame of {} bytes exceeds limit", header.payload_len);
+          conn.closing = true;
+          break;
+        }
+        size_t frame_len = FRAME_HEADER_SIZE + header.payload_len;
+        if (conn.in.size() < frame_len) {
+          conn.in.reserve(frame_len);
+          break;
+        }
+        const char *frame = conn.in.peek(frame_len);
+        int64_t started = steady_now_ns();
+        handle_frame(conn, header,
+                     string_view(frame + FRAME_HEADER_SIZE, header.payload_len));
+        Metrics::record(Timer::Command, steady_now_ns() - started);
+        conn.in.consume(frame_len);
         continue;
       }
 
-      lock_guard<mutex> lock(job_mutex);
-      auto it = inflight.find(client_fd);
-      if (it != inflight.end() && it->second.job_id == id) {
-        cout << "Job " << id << " ACKed by client " << client_fd << endl;
-        inflight.erase(it);
+      size_t nl = conn.in.find('\n');
+      if (nl == string::npos) {
+        if (conn.in.size() > max_payload_bytes + 64) {
+          LOG_WARN_EVERY(1, "Command line exceeds limit");
+          conn.closing = true;
+        }
+        break;
+      }
+      size_t end = nl;
+      const char *line = conn.in.peek(nl + 1);
+      if (end > 0 && line[end - 1] == '\r') {
+        end--;
+      }
+      int64_t started = steady_now_ns();
+      handle_command(conn, string_view(line, end));
+      Metrics::record(Timer::Command, steady_now_ns() - started);
+      conn.in.consume(nl + 1);
+    }
+  }
+
+  // one sendmsg per up to MAX_IOVECS pieces, payloads go out straight from
+  // their slab blocks
+  void flush(Connection &conn) {
+    if (ring) {
+      arm_send(conn);
+      return;
+    }
+    iovec iov[MAX_IOVECS];
+    while (!conn.out.empty()) {
+      msghdr msg{};
+      msg.msg_iov = iov;
+      msg.msg_iovlen = static_cast<size_t>(conn.out.gather(iov, MAX_IOVECS));
+      Metrics::count(Counter::Syscalls);
+      ssize_t n = ::sendmsg(conn.fd, &msg, MSG_NOSIGNAL);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          conn.closing = true;
+        }
+        break;
+      }
+      conn.out.consume(static_cast<size_t>(n));
+    }
+  }
+
+  // with io_uring a closed connection lingers until its last request has
+  // completed, since the kernel may still write into its buffers. whatever
+  // was queued for it is sent first, so that e.g. an HTTP reply gets out.
+  void close_connection(Connection &conn) {
+    if (!conn.retired) {
+      conn.retired = true;
+      handle_inflight_request(conn);
+      Metrics::gauge_add(Gauge::Connections, -1);
+    }
+    int fd = conn.fd;
+    if (ring) {
+      if (conn.send_pending) {
+        return;
+      }
+      if (conn.recv_pending) {
+        if (!conn.cancel_pending) {
+          conn.cancel_pending = true;
+          io_uring_sqe *sqe = ring->next_sqe();
+          sqe->opcode = IORING_OP_ASYNC_CANCEL;
+          sqe->addr = reinterpret_cast<uint64_t>(&conn) | OP_RECV;
+          sqe->user_data = reinterpret_cast<uint64_t>(&conn) | OP_CANCEL;
+          conn.pending_ops++;
+        }
+        return;
+      }
+      if (conn.pending_ops > 0) {
+        return;
+      }
+      if (conn.fixed_file) {
+        ring->update_file(static_cast<unsigned>(fd), -1);
+      }
+      if (conn.registered_buffer != nullptr) {
+        ring->update_buffer(static_cast<unsigned>(fd), nullptr, 0);
+      }
+    }
+    Metrics::count(Counter::Syscalls);
+    ::close(fd);
+    connections.erase(fd);
+  }
+
+  // a single multishot accept keeps producing connections until the kernel
+  // drops it, e.g. under memory pressure, and then is armed again
+  void arm_accept() {
+    io_uring_sqe *sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listen_fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+    sqe->user_data = OP_ACCEPT;
+  }
+
+  void arm_wake() {
+    io_uring_sqe *sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&wake_count);
+    sqe->len = sizeof(wake_count);
+    sqe->user_data = OP_WAKE;
+  }
+
+  void target(io_uring_sqe *sqe, Connection &conn, uint64_t op) {
+    // a fixed file's slot is its fd
+    sqe->fd = conn.fd;
+    if (conn.fixed_file) {
+      sqe->flags |= IOSQE_FIXED_FILE;
+    }
+    sqe->user_data = reinterpret_cast<uint64_t>(&conn) | op;
+    conn.pending_ops++;
+  }
+
+  // receives straight into the input ring. while the ring is at its default
+  // size it sits in the connection's fixed buffer slot and is read into with
+  // READ_FIXED; a ring grown for a large frame is received into plainly.
+  void arm_recv(Connection &conn) {
+    if (conn.recv_pending || conn.closing) {
+      return;
+    }
+    auto [space, space_len] = conn.in.write_span();
+    io_uring_sqe *sqe = ring->next_sqe();
+    if (register_input(conn)) {
+      sqe->opcode = IORING_OP_READ_FIXED;
+      sqe->buf_index = static_cast<uint16_t>(conn.fd);
+    } else {
+      sqe->opcode = IORING_OP_RECV;
+    }
+    sqe->addr = reinterpret_cast<uint64_t>(space);
+    sqe->len = static_cast<uint32_t>(space_len);
+    target(sqe, conn, OP_RECV);
+    conn.recv_pending = true;
+  }
+
+  bool register_input(Connection &conn) {
+    if (!fixed_buffers || !conn.fixed_file ||
+        conn.in.capacity() != INPUT_RING_BYTES) {
+      return false;
+    }
+    if (conn.registered_buffer == conn.in.storage()) {
+      return true;
+    }
+    if (!ring->update_buffer(static_cast<unsigned>(conn.fd), conn.in.storage(),
+                             conn.in.capacity())) {
+      LOG_WARN("Could not register input buffers, receiving without: {}",
+               strerror(errno));
+      fixed_buffers = false;
+      conn.registered_buffer = nullptr;
+      return false;
+    }
+    conn.registered_buffer = conn.in.storage();
+    return true;
+  }
+
+  // out keeps collecting replies while the kernel works through sending, so
+  // that nothing it points into moves in the meantime
+  void arm_send(Connection &conn) {
+    if (conn.send_pending) {
+      return;
+    }
+    if (conn.sending.empty()) {
+      if (conn.out.empty()) {
+        return;
+      }
+      conn.sending.swap(conn.out);
+    }
+    conn.send_msg = msghdr{};
+    conn.send_msg.msg_iov = conn.send_iov;
+    conn.send_msg.msg_iovlen =
+        static_cast<size_t>(conn.sending.gather(conn.send_iov, MAX_IOVECS));
+    io_uring_sqe *sqe = ring->next_sqe();
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->addr = reinterpret_cast<uint64_t>(&conn.send_msg);
+    sqe->len = 1;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    target(sqe, conn, OP_SEND);
+    conn.send_pending = true;
+  }
+
+  void complete(const io_uring_cqe &cqe) {
+    uint64_t op = cqe.user_data & OP_MASK;
+    Connection *conn =
+        reinterpret_cast<Connection *>(cqe.user_data & ~OP_MASK);
+    if (conn == nullptr) {
+      if (op == OP_ACCEPT) {
+        accepted(cqe);
       } else {
-        cerr << "received ACK for unknown job or client " << client_fd << endl;
+        run_posted();
+        arm_wake();
       }
-      write_ahead_log({id, ""}, "DONE");
+      return;
+    }
 
-    } else if (cmd == "FAIL") {
-      uint64_t id = 0;
-      try {
-        id = stoull(payload);
-      } catch (...) {
-        cerr << "Invalid FAIL format" << endl;
-        continue;
+    conn->pending_ops--;
+    if (op == OP_RECV) {
+      received(*conn, cqe.res);
+    } else if (op == OP_SEND) {
+      sent(*conn, cqe.res);
+    }
+    arm_recv(*conn);
+    arm_send(*conn);
+    if (conn->closing) {
+      close_connection(*conn);
+    }
+  }
+
+  void accepted(const io_uring_cqe &cqe) {
+    if (!(cqe.flags & IORING_CQE_F_MORE)) {
+      arm_accept();
+    }
+    if (cqe.res < 0) {
+      if (cqe.res != -EAGAIN && cqe.res != -EINTR) {
+        LOG_WARN_EVERY(1, "Client connection failed: {}", strerror(-cqe.res));
+      }
+      return;
+    }
+    Connection &conn = add_connection(cqe.res);
+    conn.fixed_file =
+        static_cast<unsigned>(conn.fd) < fixed_slots &&
+        ring->update_file(static_cast<unsigned>(conn.fd), conn.fd);
+    arm_recv(conn);
+  }
+
+  void received(Connection &conn, int res) {
+    conn.recv_pending = false;
+    if (res > 0) {
+      if (conn.closing) {
+        return;
+      }
+      conn.in.commit(static_cast<size_t>(res));
+      parse_input(conn);
+      conn.in.shrink_if_empty(INPUT_RING_BYTES);
+    } else if (res == 0) {
+      conn.closing = true;
+    } else if (res != -EAGAIN && res != -EINTR && res != -ECANCELED) {
+      LOG_WARN_EVERY(1, "Error receiving a message: {}", strerror(-res));
+      conn.closing = true;
+    }
+  }
+
+  void sent(Connection &conn, int res) {
+    conn.send_pending = false;
+    if (res >= 0) {
+      conn.sending.consume(static_cast<size_t>(res));
+    } else if (res != -EAGAIN && res != -EINTR) {
+      conn.sending.clear();
+      conn.out.clear();
+      conn.closing = true;
+    }
+  }
+};
+
+static bool lease_jobs(Connection &conn);
+static void reply_empty(Connection &conn);
+
+// workers parked by REQUEST <timeout_ms>, oldest first, on the list of every
+// queue they watch. a job pushed to a queue wakes the front worker on that
+// queue's list, which leaves all of its lists; the index lets a timed out or
+// disconnected worker do the same in O(watched queues).
+struct ParkedWorker {
+  EventLoop *loop;
+  int fd;
+  uint64_t conn_id;
+  uint64_t token;
+};
+using ParkedList = list<ParkedWorker>;
+mutex parked_mutex;
+unordered_map<uint32_t, ParkedList> parked_workers; // by queue
+unordered_map<uint64_t, vector<pair<uint32_t, ParkedList::iterator>>>
+    parked_index;
+atomic<size_t> parked_count{0}; // lets SUBMIT skip parked_mutex when idle
+atomic<uint64_t> next_park_token{0};
+
+// to_front is used when a woken worker lost its job to another worker, so
+// that it keeps its place in line
+void park_worker(Connection &conn, bool to_front) {
+  conn.parked = true;
+  conn.park_token = next_park_token.fetch_add(1, memory_order_relaxed) + 1;
+  ParkedWorker worker{conn.loop, conn.fd, conn.conn_id, conn.park_token};
+  lock_guard<mutex> lock(parked_mutex);
+  auto &entries = parked_index[conn.park_token];
+  for (const Connection::Watch &watch : conn.watched) {
+    ParkedList &line = parked_workers[watch.queue];
+    auto pos = to_front ? line.insert(line.begin(), worker)
+                        : line.insert(line.end(), worker);
+    entries.emplace_back(watch.queue, pos);
+  }
+  // paired with the fence in wake_parked_worker: either the submitter sees
+  // this worker parked or the lease attempt after parking sees the job
+  parked_count.fetch_add(1, memory_order_relaxed);
+  atomic_thread_fence(memory_order_seq_cst);
+}
+
+// with parked_mutex held
+static void remove_parked(uint64_t token) {
+  auto it = parked_index.find(token);
+  if (it == parked_index.end()) {
+    return;
+  }
+  for (auto &[queue, pos] : it->second) {
+    parked_workers[queue].erase(pos);
+  }
+  parked_index.erase(it);
+  parked_count.fetch_sub(1, memory_order_release);
+}
+
+void unpark_worker(Connection &conn) {
+  if (!conn.parked) {
+    return;
+  }
+  conn.parked = false;
+  conn.loop->wheel.cancel(conn.park_timer);
+  lock_guard<mutex> lock(parked_mutex);
+  remove_parked(conn.park_token);
+}
+
+void wake_parked_worker(uint32_t queue) {
+  atomic_thread_fence(memory_order_seq_cst);
+  if (parked_count.load(memory_order_relaxed) == 0) {
+    return;
+  }
+  ParkedWorker worker;
+  {
+    lock_guard<mutex> lock(parked_mutex);
+    auto line = parked_workers.find(queue);
+    if (line == parked_workers.end() || line->second.empty()) {
+      return;
+    }
+    worker = line->second.front();
+    remove_parked(worker.token);
+  }
+
+  worker.loop->post([worker, queue] {
+    bool delivered = false;
+    worker.loop->with_connection(
+        worker.fd, worker.conn_id, [&](Connection &conn) {
+          if (!conn.parked || conn.park_token != worker.token) {
+            return;
+          }
+          delivered = true;
+          conn.parked = false;
+          worker.loop->wheel.cancel(conn.park_timer);
+          if (lease_jobs(conn)) {
+            return;
+          }
+          if (steady_now_ns() >= conn.park_deadline_ns) {
+            reply_empty(conn);
+            return;
+          }
+          // back in line until what is left of its own timeout
+          park_worker(conn, true);
+          arm_park_timer(conn);
+        });
+    // the worker went away in the meantime, pass the wakeup on
+    if (!delivered) {
+      wake_parked_worker(queue);
+    }
+  });
+}
+
+// replies are encoded in whichever protocol the connection speaks
+static void reply_job_id(Connection &conn, uint64_t id) {
+  if (conn.binary) {
+    append_frame(conn.out, OP_JOB_ID, id);
+  } else {
+    conn.out += "JOB_ID " + to_string(id) + "\n";
+  }
+}
+
+// the job text as this connection gets it: as stored if it negotiated LZ4,
+// otherwise unpacked into a block of its own. packed payloads were checked
+// when they were submitted, so unpacking them cannot fail.
+static Payload job_text_for(const Connection &conn, const Job &job) {
+  if (!job.compressed || conn.compression) {
+    return job.job_text;
+  }
+  size_t len = lz4_packed_length(job.job_text);
+  Payload text = Payload::with_capacity(len);
+  lz4_decompress(job.job_text.data() + LZ4_PACKED_HEADER,
+                 job.job_text.size() - LZ4_PACKED_HEADER, text.mutable_data(),
+                 len);
+  text.resize(len);
+  return text;
+}
+
+static void append_job_line(Connection &conn, const Job &job) {
+  conn.out += to_string(job.job_id);
+  conn.out += ' ';
+  conn.out.append(job_text_for(conn, job));
+  conn.out += '\n';
+}
+
+// a single job keeps the original "<id> <payload>" reply. a batch is
+// announced as "JOBS <k>" followed by k such lines in text mode, and as k
+// JOB frames where all but the last carry FLAG_MORE in binary mode.
+static void reply_jobs(Connection &conn, const vector<const Job *> &batch) {
+  if (conn.binary) {
+    for (size_t i = 0; i < batch.size(); i++) {
+      uint8_t flags = (i + 1 < batch.size()) ? FLAG_MORE : 0;
+      if (batch[i]->compressed && conn.compression) {
+        flags |= FLAG_COMPRESSED;
+      }
+      Payload text = job_text_for(conn, *batch[i]);
+      append_frame_header(conn.out, OP_JOB, batch[i]->job_id, text.size(),
+                          flags);
+      conn.out.append(text);
+    }
+    return;
+  }
+  if (conn.prefetch > 1) {
+    conn.out += "JOBS " + to_string(batch.size()) + "\n";
+  }
+  for (const Job *job : batch) {
+    append_job_line(conn, *job);
+  }
+}
+
+static void reply_job_ids(Connection &conn, uint64_t first, uint32_t count) {
+  if (conn.binary) {
+    unsigned char n[4];
+    store_be32(n, count);
+    append_frame(conn.out, OP_JOB_IDS, first,
+                 string_view(reinterpret_cast<const char *>(n), sizeof(n)));
+  } else {
+    conn.out += "JOB_IDS " + to_string(first) + " " + to_string(count) + "\n";
+  }
+}
+
+static void reply_touched(Connection &conn, uint64_t id) {
+  if (conn.binary) {
+    append_frame(conn.out, OP_TOUCHED, id);
+  } else {
+    conn.out += "TOUCHED " + to_string(id) + "\n";
+  }
+}
+
+static void reply_prefetch(Connection &conn) {
+  if (conn.binary) {
+    append_frame(conn.out, OP_PREFETCH, conn.prefetch);
+  } else {
+    conn.out += "PREFETCH " + to_string(conn.prefetch) + "\n";
+  }
+}
+
+static void reply_empty(Connection &conn) {
+  if (conn.binary) {
+    append_frame(conn.out, OP_EMPTY, 0);
+  } else {
+    conn.out += "EMPTY\n";
+  }
+}
+
+static void reply_busy(Connection &conn) {
+  uint64_t ms = static_cast<uint64_t>(retry_after.count());
+  if (conn.binary) {
+    append_frame(conn.out, OP_BUSY, ms);
+  } else {
+    conn.out += "BUSY " + to_string(ms) + "\n";
+  }
+}
+
+static void reply_error(Connection &conn, string_view message) {
+  if (conn.binary) {
+    append_frame(conn.out, OP_ERROR, 0, message);
+  } else {
+    conn.out += "ERROR ";
+    conn.out.append(message.data(), message.size());
+    conn.out += '\n';
+  }
+}
+
+static void reply_using(Connection &conn, string_view name) {
+  if (conn.binary) {
+    append_frame(conn.out, OP_USE, 0, name);
+  } else {
+    conn.out += "USING ";
+    conn.out.append(name.data(), name.size());
+    conn.out += '\n';
+  }
+}
+
+static void reply_watching(Connection &conn, uint8_t opcode) {
+  if (conn.binary) {
+    append_frame(conn.out, opcode, conn.watched.size());
+  } else {
+    conn.out += "WATCHING " + to_string(conn.watched.size()) + "\n";
+  }
+}
+
+static void reply_queue(Connection &conn, const NamedQueue &queue) {
+  uint32_t weight = queue.weight.load(memory_order_relaxed);
+  if (conn.binary) {
+    append_frame(conn.out, OP_QUEUE, weight, queue.name);
+  } else {
+    conn.out += "QUEUE " + queue.name + " " + to_string(weight) + "\n";
+  }
+}
+
+static void send_held_reply(Connection &conn,
+                            const Connection::HeldReply &reply) {
+  switch (reply.opcode) {
+  case OP_BUSY:
+    reply_busy(conn);
+    break;
+  case OP_USE:
+    reply_using(conn, reply.text);
+    break;
+  default:
+    reply_error(conn, reply.text);
+  }
+}
+
+// replies to the producer side of a connection wait for the JOB_IDs of the
+// SUBMITs before them
+static void reply_in_order(Connection &conn, Connection::HeldReply reply) {
+  if (conn.submits_answered == conn.submits_logged) {
+    send_held_reply(conn, reply);
+  } else {
+    reply.after = conn.submits_logged;
+    conn.held_replies.push_back(std::move(reply));
+  }
+}
+
+static bool parse_id(string_view text, uint64_t &id) {
+  auto result = from_chars(text.data(), text.data() + text.size(), id);
+  return result.ec == errc() && result.ptr == text.data() + text.size();
+}
+
+// "<number> <rest>" with a non-empty rest, as used by the SUBMIT variants
+static bool split_number(string_view args, uint64_t &number,
+                         string_view &rest) {
+  size_t sp = args.find(' ');
+  if (sp == string_view::npos || sp + 1 == args.size() ||
+      !parse_id(args.substr(0, sp), number)) {
+    return false;
+  }
+  rest = args.substr(sp + 1);
+  return true;
+}
+
+// jobs become visible only once their ADD is durable: a worker can never run
+// a job the log does not have, so a producer told ERROR wal can safely send
+// it again. delayed ones go to the scheduler instead.
+static void enqueue_logged(vector<Job> &jobs) {
+  if (jobs.front().not_before_ms > 0) {
+    for (Job &job : jobs) {
+      scheduler.schedule(std::move(job));
+    }
+    return;
+  }
+  if (jobs.size() == 1) {
+    enqueue_job(std::move(jobs.front()));
+    return;
+  }
+  uint32_t queue = jobs.front().queue;
+  int64_t now = steady_now_ns();
+  for (Job &job : jobs) {
+    job.enqueued_ns = now;
+  }
+  queues->push(queues->at(queue), jobs);
+  for (size_t i = 0; i < jobs.size(); i++) {
+    wake_parked_worker(queue);
+  }
+}
+
+// the WAL callback of a SUBMIT, or of a SUBMIT_BATCH when batch is set: on
+// the producer's loop, queues the jobs (or drops them and gives their
+// admission back if the write failed), answers the producer if it is still
+// there, then sends whatever was held back behind the answer
+static WalWriter::Callback answer_when_logged(Connection &conn,
+                                              vector<Job> jobs,
+                                              bool batch = false) {
+  EventLoop *loop = conn.loop;
+  int fd = conn.fd;
+  uint64_t conn_id = conn.conn_id;
+  auto logged = make_shared<vector<Job>>(std::move(jobs));
+  return [loop, fd, conn_id, logged, batch](bool ok) {
+    loop->post([loop, fd, conn_id, logged, batch, ok] {
+      uint64_t first_id = logged->front().job_id;
+      uint32_t count = static_cast<uint32_t>(logged->size());
+      if (ok) {
+        enqueue_logged(*logged);
+      } else {
+        size_t bytes = 0;
+        for (const Job &job : *logged) {
+          bytes += job.job_text.size();
+        }
+        queues->release(queues->at(logged->front().queue), bytes, count);
       }
+      loop->with_connection(fd, conn_id, [&](Connection &conn) {
+        if (!ok) {
+          reply_error(conn, "wal");
+        } else if (batch) {
+          reply_job_ids(conn, first_id, count);
+        } else {
+          reply_job_id(conn, first_id);
+        }
+        conn.submits_answered++;
+        while (!conn.held_replies.empty() &&
+               conn.held_replies.front().after <= conn.submits_answered) {
+          send_held_reply(conn, conn.held_replies.front());
+          conn.held_replies.pop_front();
+        }
+      });
+    });
+  };
+}
+
+void submit_job(Connection &conn, Payload payload, uint8_t priority = 0,
+                int64_t not_before_ms = 0, bool compressed = false) {
+  // the producer only hears back once the ADD record is durable, and the job
+  // only becomes visible then, so its DONE can never reach the log ahead of
+  // it either.
+  if (conn.use_queue == QueueRegistry::NO_QUEUE) {
+    reply_in_order(conn, {0, OP_ERROR, "no queue in use"});
+    return;
+  }
+  NamedQueue &queue = queues->at(conn.use_queue);
+  size_t bytes = payload.size();
+  if (!queues->admit(queue, bytes)) {
+    Metrics::count(Counter::Refused);
+    reply_in_order(conn, {0, OP_BUSY, {}});
+    return;
+  }
+  Job job{queues->next_id(), std::move(payload), priority};
+  job.queue = queue.id;
+  job.compressed = compressed;
+  bool delayed = not_before_ms > wall_now_ms();
+  if (delayed) {
+    job.not_before_ms = not_before_ms;
+  } else if (busy_when_full && queue.store.would_spill(job.job_id)) {
+    queues->release(queue, bytes);
+    Metrics::count(Counter::Refused);
+    reply_in_order(conn, {0, OP_BUSY, {}});
+    return;
+  }
+  conn.submits_logged++;
+  // the record references the payload, the callback takes the job
+  Job logged = job;
+  vector<Job> jobs;
+  jobs.push_back(std::move(job));
+  write_ahead_log(logged, "ADD", answer_when_logged(conn, std::move(jobs)));
+  Metrics::count(Counter::Submitted);
+}
+
+// SUBMIT_BATCH: count jobs, each a u32 length and its text, that share one
+// priority and not-before time. they are admitted or refused as a whole, get
+// contiguous ids from one atomic add, are logged as one AddBatch record and,
+// once that is durable, go into the store with one lock acquisition per shard
+// while the producer hears back once, with the id range.
+void submit_batch(Connection &conn, string_view jobs, uint64_t count,
+                  uint8_t priority, int64_t not_before_ms) {
+  if (conn.use_queue == QueueRegistry::NO_QUEUE) {
+    reply_in_order(conn, {0, OP_ERROR, "no queue in use"});
+    return;
+  }
+  // every job is checked before any is taken, so a bad one refuses them all
+  vector<pair<string_view, bool>> texts;
+  texts.reserve(min<uint64_t>(count, jobs.size() / 5));
+  size_t bytes = 0;
+  while (!jobs.empty()) {
+    auto p = reinterpret_cast<const unsigned char *>(jobs.data());
+    uint32_t len = jobs.size() < 4 ? 0 : load_be32(p);
+    bool compressed = len & BATCH_COMPRESSED;
+    len &= ~BATCH_COMPRESSED;
+    if (len == 0 || len > jobs.size() - 4) {
+      reply_in_order(conn, {0, OP_ERROR, "malformed batch"});
+      return;
+    }
+    string_view text = jobs.substr(4, len);
+    if (compressed && (!conn.compression ||
+                       !lz4_packed_valid(text, max_payload_bytes))) {
+      reply_in_order(conn, {0, OP_ERROR, "invalid compressed payload"});
+      return;
+    }
+    texts.emplace_back(text, compressed);
+    bytes += len;
+    jobs.remove_prefix(4 + len);
+  }
+  if (texts.empty() || texts.size() != count) {
+    reply_in_order(conn, {0, OP_ERROR, "malformed batch"});
+    return;
+  }
 
-      lock_guard<mutex> lock(job_mutex);
-      auto it = inflight.find(client_fd);
-      if (it != inflight.end() && it->second.job_id == id) {
-        cout << "Job " << id << " FAILED by client " << client_fd
-             << ", requeuing." << endl;
-        jobs.push(it->second);
-        inflight.erase(it);
+  NamedQueue &queue = queues->at(conn.use_queue);
+  if (!queues->admit(queue, bytes, count)) {
+    Metrics::count(Counter::Refused, count);
+    reply_in_order(conn, {0, OP_BUSY, {}});
+    return;
+  }
+  uint64_t first = queues->next_ids(count);
+  bool delayed = not_before_ms > wall_now_ms();
+  if (!delayed && busy_when_full) {
+    for (uint64_t id = first; id < first + count; id++) {
+      if (queue.store.would_spill(id)) {
+        queues->release(queue, bytes, count);
+        Metrics::count(Counter::Refused, count);
+        reply_in_order(conn, {0, OP_BUSY, {}});
+        return;
       }
+    }
+  }
+
+  WalBatch logged(first, priority, delayed ? not_before_ms : 0, queue.id);
+  vector<Job> batch;
+  batch.reserve(count);
+  for (size_t i = 0; i < texts.size(); i++) {
+    Job &job = batch.emplace_back(first + i, Payload(texts[i].first),
+                                  priority);
+    job.queue = queue.id;
+    job.compressed = texts[i].second;
+    if (delayed) {
+      job.not_before_ms = not_before_ms;
+    }
+    logged.add(job.job_text, job.compressed);
+  }
+  conn.submits_logged++;
+  wal.append(logged, answer_when_logged(conn, std::move(batch), true));
+  Metrics::count(Counter::Submitted, count);
+}
+
+// the worker neither finished nor extended the lease in time, so the job is
+// presumed lost with it. the connection stays open and keeps its other
+// leases; a late ACK is still logged, a late FAIL is ignored.
+static void expire_lease(Connection &conn, uint64_t id) {
+  auto it = conn.leases.find(id);
+  if (it == conn.leases.end()) {
+    return;
+  }
+  LOG_WARN("Lease on job {} held by client {} expired, requeuing.", id,
+           conn.fd);
+  Job job = std::move(it->second.job);
+  conn.leases.erase(it);
+  Metrics::count(Counter::LeaseExpired);
+  Metrics::count(Counter::Requeued);
+  Metrics::gauge_add(Gauge::Inflight, -1);
+  enqueue_job(std::move(job), true);
+}
+
+// leases as many jobs as the connection's prefetch window has room for, with
+// one lock acquisition per shard visited, and sends them back as one reply.
+// returns false if there was nothing to lease.
+//
+// the watched queues take turns by deficit round robin: a queue whose turn
+// starts is credited its weight, and the turn moves on once that many jobs
+// have been leased from it, so under load every queue gets dispatches in
+// proportion to its weight however much the others hold. a queue that runs
+// out forfeits the rest of its turn. a turn may span several REQUESTs.
+static bool lease_jobs(Connection &conn) {
+  size_t room = conn.prefetch - conn.leases.size();
+  vector<Job> taken;
+  size_t n = conn.watched.size();
+  size_t misses = 0; // queues in a row that came up short
+  while (taken.size() < room && misses < n) {
+    Connection::Watch &watch = conn.watched[conn.drr_cursor % n];
+    NamedQueue &queue = queues->at(watch.queue);
+    if (watch.deficit == 0) {
+      watch.deficit = queue.weight.load(memory_order_relaxed);
+    }
+    size_t want = min(room - taken.size(), watch.deficit);
+    size_t got = queues->pop(queue, conn.home_shard, want, taken);
+    watch.deficit -= got;
+    if (got < want) {
+      watch.deficit = 0;
+      misses++;
+    } else {
+      misses = 0;
+    }
+    if (watch.deficit == 0) {
+      conn.drr_cursor = (conn.drr_cursor + 1) % n;
+    }
+  }
+  if (taken.empty()) {
+    return false;
+  }
+
+  int64_t now = steady_now_ns();
+  vector<const Job *> batch;
+  for (Job &job : taken) {
+    uint64_t id = job.job_id;
+    if (job.enqueued_ns > 0) {
+      Metrics::record(Timer::JobWait, now - job.enqueued_ns);
+    }
+    Connection::Lease &lease = conn.leases[id];
+    lease.job = std::move(job);
+    lease.leased_ns = now;
+    if (lease_timeout.count() > 0) {
+      lease.timer.on_expire = [&conn, id] { expire_lease(conn, id); };
+      conn.loop->wheel.arm(lease.timer, lease_timeout);
+    }
+    batch.push_back(&lease.job);
+  }
+  Metrics::count(Counter::Dispatched, batch.size());
+  Metrics::gauge_add(Gauge::Inflight, static_cast<int64_t>(batch.size()));
+  reply_jobs(conn, batch);
+  return true;
+}
+
+// REQUEST answers right away, REQUEST <timeout_ms> parks the worker until a
+// job shows up or the timeout passes and only then answers EMPTY
+void request_job(Connection &conn, uint64_t timeout_ms) {
+  if (conn.parked) {
+    reply_error(conn, "request already pending");
+    return;
+  }
+  if (conn.leases.size() >= conn.prefetch) {
+    reply_error(conn, "prefetch window full");
+    return;
+  }
+  if (lease_jobs(conn)) {
+    return;
+  }
+  if (timeout_ms == 0) {
+    reply_empty(conn);
+    return;
+  }
+  park_worker(conn, false);
+  // a job submitted between the attempt above and parking found nobody
+  // parked and woke no one, so look once more now that we are
+  if (lease_jobs(conn)) {
+    unpark_worker(conn);
+    return;
+  }
+  conn.park_deadline_ns =
+      steady_now_ns() + static_cast<int64_t>(timeout_ms) * 1000000;
+  arm_park_timer(conn);
+}
+
+// answers EMPTY at conn.park_deadline_ns unless a job comes first
+void arm_park_timer(Connection &conn) {
+  EventLoop *loop = conn.loop;
+  int fd = conn.fd;
+  uint64_t conn_id = conn.conn_id;
+  conn.park_timer.on_expire = [loop, fd, conn_id] {
+    loop->with_connection(fd, conn_id, [](Connection &conn) {
+      unpark_worker(conn);
+      reply_empty(conn);
+    });
+  };
+  int64_t left_ns = conn.park_deadline_ns - steady_now_ns();
+  loop->wheel.arm(conn.park_timer,
+                  chrono::milliseconds((max<int64_t>(left_ns, 0) + 999999) /
+                                       1000000));
+}
+
+// extends the lease by another full lease timeout
+void touch_job(Connection &conn, uint64_t id) {
+  auto it = conn.leases.find(id);
+  if (it == conn.leases.end()) {
+    reply_error(conn, "unknown lease");
+    return;
+  }
+  if (lease_timeout.count() > 0) {
+    conn.loop->wheel.arm(it->second.timer, lease_timeout);
+  }
+  reply_touched(conn, id);
+}
+
+// the lease ends with its job done, which gives its bytes back to admission
+static void
+finish_lease(Connection &conn,
+             unordered_map<uint64_t, Connection::Lease>::iterator it,
+             int64_t now) {
+  Metrics::record(Timer::LeaseDuration, now - it->second.leased_ns);
+  const Job &job = it->second.job;
+  queues->release(queues->at(job.queue), job.job_text.size());
+  conn.leases.erase(it);
+}
+
+void ack_job(Connection &conn, uint64_t id) {
+  auto it = conn.leases.find(id);
+  if (it != conn.leases.end()) {
+    LOG_INFO("Job {} ACKed by client {}", id, conn.fd);
+    Metrics::count(Counter::Acked);
+    Metrics::gauge_add(Gauge::Inflight, -1);
+    finish_lease(conn, it, steady_now_ns());
+    write_ahead_log({id, {}}, "DONE");
+  } else {
+    // not logged: recovery honours a DONE wherever it sits in the log, so
+    // one for an id not held here (gone back to the queue, leased to
+    // another worker or not handed out yet) would lose that job
+    LOG_WARN_EVERY(1, "received ACK for unknown job {} from client {}", id,
+                   conn.fd);
+  }
+}
 
+// ACK of [first, last] ranges of ids at once. ranges may come in any order
+// and overlap. only the ids this connection actually held are logged, as
+// one DoneRanges record: the rest of a range may be leased to other
+// workers, or not handed out yet, and must not be marked done.
+void ack_jobs(Connection &conn, vector<pair<uint64_t, uint64_t>> &ranges) {
+  sort(ranges.begin(), ranges.end());
+  size_t n = 0;
+  for (auto [first, last] : ranges) {
+    if (first > last) {
+      continue;
+    }
+    if (n > 0 && first <= ranges[n - 1].second + 1) {
+      ranges[n - 1].second = max(ranges[n - 1].second, last);
     } else {
-      cerr << "Invalid command " << line << endl;
+      ranges[n++] = {first, last};
+    }
+  }
+  ranges.resize(n);
+
+  // per range, whichever is shorter: its ids or the leases held
+  int64_t now = steady_now_ns();
+  vector<uint64_t> acked;
+  for (auto [first, last] : ranges) {
+    if (last - first < conn.leases.size()) {
+      for (uint64_t id = first;; id++) {
+        auto it = conn.leases.find(id);
+        if (it != conn.leases.end()) {
+          finish_lease(conn, it, now);
+          acked.push_back(id);
+        }
+        if (id == last) {
+          break;
+        }
+      }
       continue;
     }
+    for (auto it = conn.leases.begin(); it != conn.leases.end();) {
+      auto next = std::next(it);
+      if (it->first >= first && it->first <= last) {
+        acked.push_back(it->first);
+        finish_lease(conn, it, now);
+      }
+      it = next;
+    }
+  }
+  if (acked.empty()) {
+    LOG_WARN_EVERY(1, "received ACK of {} ranges holding no lease from "
+                      "client {}", ranges.size(), conn.fd);
+    return;
+  }
+
+  sort(acked.begin(), acked.end());
+  ranges.clear();
+  for (uint64_t id : acked) {
+    if (!ranges.empty() && id == ranges.back().second + 1) {
+      ranges.back().second = id;
+    } else {
+      ranges.emplace_back(id, id);
+    }
+  }
+  LOG_INFO("{} jobs ACKed by client {} in {} ranges", acked.size(), conn.fd,
+           ranges.size());
+  Metrics::count(Counter::Acked, acked.size());
+  Metrics::gauge_add(Gauge::Inflight, -static_cast<int64_t>(acked.size()));
+  wal.append(wal_done_ranges_record(ranges));
+}
+
+// "<id>[-<id>][,<id>[-<id>]...]"
+static bool parse_id_ranges(string_view text,
+                            vector<pair<uint64_t, uint64_t>> &ranges) {
+  while (true) {
+    size_t comma = text.find(',');
+    string_view item = text.substr(0, comma);
+    size_t dash = item.find('-');
+    uint64_t first = 0;
+    uint64_t last = 0;
+    if (!parse_id(item.substr(0, dash), first) ||
+        (dash != string_view::npos && !parse_id(item.substr(dash + 1), last))) {
+      return false;
+    }
+    if (dash == string_view::npos) {
+      last = first;
+    }
+    if (first > last) {
+      return false;
+    }
+    ranges.emplace_back(first, last);
+    if (comma == string_view::npos) {
+      return true;
+    }
+    text.remove_prefix(comma + 1);
   }
+}
+
+void fail_job(Connection &conn, uint64_t id) {
+  auto it = conn.leases.find(id);
+  if (it == conn.leases.end()) {
+    return;
+  }
+  LOG_INFO("Job {} FAILED by client {}, requeuing.", id, conn.fd);
+  Metrics::record(Timer::LeaseDuration, steady_now_ns() - it->second.leased_ns);
+  Metrics::count(Counter::Failed);
+  Metrics::count(Counter::Requeued);
+  Metrics::gauge_add(Gauge::Inflight, -1);
+  Job job = std::move(it->second.job);
+  conn.leases.erase(it);
+  enqueue_job(std::move(job), true);
+}
+
+void set_prefetch(Connection &conn, uint64_t count) {
+  if (count == 0 || count > max_prefetch) {
+    reply_error(conn, "invalid prefetch");
+    return;
+  }
+  conn.prefetch = static_cast<uint32_t>(count);
+  reply_prefetch(conn);
+}
+
+// USE <queue>: the queue the following SUBMITs go to, created on first use.
+// when it cannot be used they are refused until the next USE that succeeds.
+void use_queue(Connection &conn, string_view name) {
+  NamedQueue *queue = queues->find_or_create(name);
+  if (queue == nullptr) {
+    conn.use_queue = QueueRegistry::NO_QUEUE;
+    reply_in_order(conn, {0, OP_ERROR,
+                          QueueRegistry::valid_name(name) ? "too many queues"
+                                                          : "invalid queue"});
+    return;
+  }
+  conn.use_queue = queue->id;
+  reply_in_order(conn, {0, OP_USE, queue->name});
+}
+
+// WATCH <queue> / IGNORE <queue> change the set REQUESTs lease from, which
+// starts out as just "default". a parked REQUEST is on the lists of the
+// queues it watched when it parked, so the set is fixed until it returns.
+void watch_queue(Connection &conn, string_view name, uint8_t opcode) {
+  if (conn.parked) {
+    reply_error(conn, "request already pending");
+    return;
+  }
+  NamedQueue *queue = opcode == OP_WATCH ? queues->find_or_create(name)
+                                         : queues->find(name);
+  if (queue == nullptr) {
+    reply_error(conn, opcode == OP_WATCH && QueueRegistry::valid_name(name)
+                          ? "too many queues"
+                          : "invalid queue");
+    return;
+  }
+  auto it = find_if(conn.watched.begin(), conn.watched.end(),
+                    [&](const Connection::Watch &watch) {
+                      return watch.queue == queue->id;
+                    });
+  if (opcode == OP_WATCH && it == conn.watched.end()) {
+    conn.watched.push_back({queue->id});
+  } else if (opcode == OP_IGNORE && it != conn.watched.end()) {
+    if (conn.watched.size() == 1) {
+      reply_error(conn, "cannot ignore the last queue");
+      return;
+    }
+    conn.watched.erase(it);
+    conn.drr_cursor %= conn.watched.size();
+  }
+  reply_watching(conn, opcode);
+}
+
+// QUEUE <queue> <weight>: the queue's share against the other queues a worker
+// watches, 1 (the default) to 1000
+void set_queue_weight(Connection &conn, string_view name, uint64_t weight) {
+  if (weight == 0 || weight > QueueRegistry::MAX_WEIGHT) {
+    reply_error(conn, "invalid weight");
+    return;
+  }
+  NamedQueue *queue = queues->find_or_create(name);
+  if (queue == nullptr) {
+    reply_error(conn, QueueRegistry::valid_name(name) ? "too many queues"
+                                                      : "invalid queue");
+    return;
+  }
+  queues->set_weight(*queue, static_cast<uint32_t>(weight));
+  reply_queue(conn, *queue);
+}
+
+// LIMIT <queue> <max_jobs> <max_bytes>: how many jobs and payload bytes the
+// queue may hold before SUBMITs to it are answered BUSY, 0 for the broker's
+// --queue-max-jobs / --queue-max-bytes
+void set_queue_limits(Connection &conn, string_view name, uint64_t max_jobs,
+                      uint64_t max_bytes) {
+  NamedQueue *queue = queues->find_or_create(name);
+  if (queue == nullptr) {
+    reply_error(conn, QueueRegistry::valid_name(name) ? "too many queues"
+                                                      : "invalid queue");
+    return;
+  }
+  queues->set_limits(*queue, max_jobs, max_bytes);
+  if (conn.binary) {
+    unsigned char limits[16];
+    store_be64(limits, max_jobs);
+    store_be64(limits + 8, max_bytes);
+    append_frame_header(conn.out, OP_LIMIT, 0, sizeof(limits) + name.size());
+    conn.out.append(reinterpret_cast<const char *>(limits), sizeof(limits));
+    conn.out.append(name.data(), name.size());
+  } else {
+    conn.out += "LIMIT " + queue->name + " " + to_string(max_jobs) + " " +
+                to_string(max_bytes) + "\n";
+  }
+}
+
+// QUEUES answers "QUEUES <k>" followed by a line per queue:
+//   <name> <weight> <pending> <jobs held> <bytes held>
+void list_queues(Connection &conn) {
+  string body;
+  size_t count = 0;
+  queues->for_each([&](NamedQueue &queue) {
+    body += queue.name + " " +
+            to_string(queue.weight.load(memory_order_relaxed)) + " " +
+            to_string(queue.pending()) + " " +
+            to_string(queue.held_jobs.load(memory_order_relaxed)) + " " +
+            to_string(queue.held_bytes.load(memory_order_relaxed)) + "\n";
+    count++;
+  });
+  conn.out += "QUEUES " + to_string(count) + "\n";
+  conn.out += body;
+}
+
+// resident set size from /proc, 0 where that is not available. anonymous
+// memory leaves out the pages of the mapped WAL segment, which come and go
+// with the page cache.
+struct Resident {
+  double total = 0;
+  double anon = 0;
 };
 
-int main() {
-  int server_fd = ::socket(AF_INET, SOCK_STREAM, 0);
-  if (server_fd == -1) {
-    cerr << "Server not running" << endl;
-    return 1;
+static Resident resident_bytes() {
+  Resident bytes;
+  FILE *statm = fopen("/proc/self/statm", "r");
+  if (statm == nullptr) {
+    return bytes;
   }
+  unsigned long long size = 0, resident = 0, shared = 0;
+  int fields = fscanf(statm, "%llu %llu %llu", &size, &resident, &shared);
+  fclose(statm);
+  if (fields == 3) {
+    double page = static_cast<double>(sysconf(_SC_PAGESIZE));
+    bytes.total = static_cast<double>(resident) * page;
+    bytes.anon = static_cast<double>(resident - min(shared, resident)) * page;
+  }
+  return bytes;
+}
 
-  int opt = 1;
-  if (::setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) <
-      0) {
-    cerr << "Resuing a port had an issue" << endl;
-    ::close(server_fd);
-    return 1;
+static string render_stats(bool prometheus) {
+  Resident resident = resident_bytes();
+  vector<Metrics::Sample> extra = {
+      {"jobs_pending", "Jobs waiting to be dispatched.",
+       static_cast<double>(queues->pending())},
+      {"jobs_spilled", "Pending jobs spilled to disk.",
+       static_cast<double>(queues->spilled())},
+      {"jobs_scheduled", "Delayed jobs not due yet.",
+       static_cast<double>(scheduler.size())},
+      {"workers_parked", "Workers waiting in a long-poll REQUEST.",
+       static_cast<double>(parked_count.load(memory_order_relaxed))},
+      {"jobs_held", "Jobs admitted and not yet acknowledged.",
+       static_cast<double>(queues->held_jobs())},
+      {"bytes_held", "Payload bytes of the jobs held.",
+       static_cast<double>(queues->held_bytes())},
+      {"resident_bytes", "Resident set size of the broker process.",
+       resident.total},
+      {"resident_anon_bytes", "Resident memory not backed by a file.",
+       resident.anon},
+  };
+  return prometheus ? Metrics::render_prometheus(extra)
+                    : Metrics::render_text(extra);
+}
+
+// STATS [PROMETHEUS] answers "STATS <k>" followed by k lines in text mode and
+// one STATS_REPLY frame in binary mode
+void send_stats(Connection &conn, bool prometheus) {
+  string body = render_stats(prometheus);
+  if (conn.binary) {
+    append_frame(conn.out, OP_STATS_REPLY, 0, body);
+    return;
   }
+  size_t lines = static_cast<size_t>(count(body.begin(), body.end(), '\n'));
+  conn.out += "STATS " + to_string(lines) + "\n";
+  conn.out += body;
+}
+
+// lets Prometheus scrape the broker port directly: any HTTP GET is answered
+// with the metrics and the connection is closed
+void send_http_metrics(Connection &conn) {
+  string body = render_stats(true);
+  conn.out += "HTTP/1.0 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Content-Length: " +
+              to_string(body.size()) + "\r\n\r\n";
+  conn.out += body;
+  conn.closing = true;
+}
+
+// runs a single command line from a client. the line is a view into the
+// connection's input ring and is only valid for the duration of the call.
+// anything that has to go back to the client is appended to conn.out and
+// written by the event loop once the whole read has been processed.
+void handle_command(Connection &conn, string_view line) {
+  size_t sp = line.find(' ');
+  string_view cmd = (sp == string_view::npos) ? line : line.substr(0, sp);
+  string_view payload =
+      (sp == string_view::npos) ? string_view() : line.substr(sp + 1);
+
+  if (cmd == "SUBMIT") {
+    if (payload.empty()) {
+      return;
+    }
+    LOG_INFO("{} {}", cmd, payload);
+    submit_job(conn, Payload(payload));
+
+  } else if (cmd == "SUBMIT_PRIO") {
+    // SUBMIT_PRIO <priority> <payload>, priority 0-255
+    uint64_t priority = 0;
+    string_view text;
+    if (!split_number(payload, priority, text) || priority > 255) {
+      LOG_WARN_EVERY(1, "Invalid SUBMIT_PRIO format");
+      return;
+    }
+    LOG_INFO("{} {}", cmd, payload);
+    submit_job(conn, Payload(text), static_cast<uint8_t>(priority));
+
+  } else if (cmd == "SUBMIT_AT" || cmd == "SUBMIT_DELAY") {
+    // SUBMIT_AT <unix_ms> <payload>, SUBMIT_DELAY <ms> <payload>
+    uint64_t when = 0;
+    string_view text;
+    if (!split_number(payload, when, text) || when > INT64_MAX / 2) {
+      LOG_WARN_EVERY(1, "Invalid {} format", cmd);
+      return;
+    }
+    LOG_INFO("{} {}", cmd, payload);
+    int64_t not_before = static_cast<int64_t>(when);
+    if (cmd == "SUBMIT_DELAY") {
+      not_before += wall_now_ms();
+    }
+    submit_job(conn, Payload(text), 0, not_before);
+
+  } else if (cmd == "REQUEST") {
+    uint64_t timeout_ms = 0;
+    if (!payload.empty() && !parse_id(payload, timeout_ms)) {
+      LOG_WARN_EVERY(1, "Invalid REQUEST format");
+      return;
+    }
+    request_job(conn, timeout_ms);
+
+  } else if (cmd == "USE") {
+    use_queue(conn, payload);
 
-  sockaddr_in server_struct{.sin_family = AF_INET,
-                            .sin_addr.s_addr = htonl(INADDR_ANY),
-                            .sin_port = htons(static_cast<uint16_t>(PORT))};
+  } else if (cmd == "WATCH") {
+    watch_queue(conn, payload, OP_WATCH);
 
-  sockaddr_in client_struct;
+  } else if (cmd == "IGNORE") {
+    watch_queue(conn, payload, OP_IGNORE);
 
-  if (::bind(server_fd, reinterpret_cast<sockaddr *>(&server_struct),
-             sizeof(server_struct)) == -1) {
-    ::close(server_fd);
+  } else if (cmd == "QUEUE") {
+    uint64_t weight = 0;
+    size_t name_end = payload.find(' ');
+    if (name_end == string_view::npos ||
+        !parse_id(payload.substr(name_end + 1), weight)) {
+      LOG_WARN_EVERY(1, "Invalid QUEUE format");
+      return;
+    }
+    set_queue_weight(conn, payload.substr(0, name_end), weight);
+
+  } else if (cmd == "LIMIT") {
+    // LIMIT <queue> <max_jobs> <max_bytes>
+    uint64_t max_jobs = 0;
+    uint64_t max_bytes = 0;
+    size_t name_end = payload.find(' ');
+    string_view limits = name_end == string_view::npos
+                             ? string_view()
+                             : payload.substr(name_end + 1);
+    size_t sp = limits.find(' ');
+    if (sp == string_view::npos || !parse_id(limits.substr(0, sp), max_jobs) ||
+        !parse_id(limits.substr(sp + 1), max_bytes)) {
+      LOG_WARN_EVERY(1, "Invalid LIMIT format");
+      return;
+    }
+    set_queue_limits(conn, payload.substr(0, name_end), max_jobs, max_bytes);
+
+  } else if (cmd == "QUEUES") {
+    list_queues(conn);
+
+  } else if (cmd == "QUIT") {
+    conn.closing = true;
+
+  } else if (cmd == "ACK") {
+    // ACK <id>, or ACK <first>-<last>,<id>,... for many at once
+    uint64_t id = 0;
+    vector<pair<uint64_t, uint64_t>> ranges;
+    if (parse_id(payload, id)) {
+      ack_job(conn, id);
+    } else if (parse_id_ranges(payload, ranges)) {
+      ack_jobs(conn, ranges);
+    } else {
+      LOG_WARN_EVERY(1, "Invalid ACK format");
+    }
+
+  } else if (cmd == "FAIL") {
+    uint64_t id = 0;
+    if (!parse_id(payload, id)) {
+      LOG_WARN_EVERY(1, "Invalid FAIL format");
+      return;
+    }
+    fail_job(conn, id);
+
+  } else if (cmd == "TOUCH") {
+    uint64_t id = 0;
+    if (!parse_id(payload, id)) {
+      LOG_WARN_EVERY(1, "Invalid TOUCH format");
+      return;
+    }
+    touch_job(conn, id);
+
+  } else if (cmd == "PREFETCH") {
+    uint64_t count = 0;
+    if (!parse_id(payload, count)) {
+      LOG_WARN_EVERY(1, "Invalid PREFETCH format");
+      return;
+    }
+    set_prefetch(conn, count);
+
+  } else if (cmd == "STATS") {
+    if (!payload.empty() && payload != "PROMETHEUS") {
+      LOG_WARN_EVERY(1, "Invalid STATS format");
+      return;
+    }
+    send_stats(conn, !payload.empty());
+
+  } else if (cmd == "GET") {
+    send_http_metrics(conn);
+
+  } else if (cmd == "LOG_LEVEL") {
+    // LOG_LEVEL <debug|info|warn|error|off>, echoed back
+    LogLevel level;
+    if (!parse_log_level(payload, level)) {
+      reply_error(conn, "invalid log level");
+      return;
+    }
+    Logger::instance().set_level(level);
+    conn.out += "LOG_LEVEL ";
+    conn.out += payload;
+    conn.out += '\n';
+
+  } else if (cmd == "HELLO") {
+    // HELLO BINARY <version> [LZ4], echoed back before the switch
+    string expected = "BINARY " + to_string(BINARY_PROTOCOL_VERSION);
+    bool lz4 = payload == expected + " LZ4";
+    if (payload != expected && !lz4) {
+      reply_error(conn, "unsupported protocol");
+      return;
+    }
+    conn.out += "HELLO ";
+    conn.out += payload;
+    conn.out += '\n';
+    conn.binary = true;
+    conn.compression = lz4;
+
+  } else {
+    // a misbehaving client must not flood the log
+    LOG_WARN_EVERY(1, "Invalid command {}", line);
+  }
+}
+
+// binary counterpart of handle_command, payload points into the input ring
+void handle_frame(Connection &conn, const FrameHeader &header,
+                  string_view payload) {
+  switch (header.opcode) {
+  case OP_SUBMIT: {
+    // rejections queue behind the JOB_IDs still owed, like every answer to
+    // a SUBMIT, since the producer matches them in order
+    uint8_t priority = 0;
+    if (header.flags & FLAG_PRIORITY) {
+      if (payload.empty()) {
+        reply_in_order(conn, {0, OP_ERROR, "missing priority"});
+        return;
+      }
+      priority = static_cast<uint8_t>(payload[0]);
+      payload.remove_prefix(1);
+    }
+    int64_t not_before = 0;
+    if (header.flags & FLAG_NOT_BEFORE) {
+      if (payload.size() < 8) {
+        reply_in_order(conn, {0, OP_ERROR, "missing not-before time"});
+        return;
+      }
+      not_before = static_cast<int64_t>(
+          load_be64(reinterpret_cast<const unsigned char *>(payload.data())));
+      payload.remove_prefix(8);
+    }
+    if (payload.empty()) {
+      reply_in_order(conn, {0, OP_ERROR, "empty payload"});
+      return;
+    }
+    // checked once here, so that every worker can count on unpacking it
+    bool compressed = header.flags & FLAG_COMPRESSED;
+    if (compressed && (!conn.compression ||
+                       !lz4_packed_valid(payload, max_payload_bytes))) {
+      reply_in_order(conn, {0, OP_ERROR, "invalid compressed payload"});
+      return;
+    }
+    submit_job(conn, Payload(payload), priority, not_before, compressed);
+    break;
+  }
+  case OP_REQUEST:
+    // the job id field carries the long-poll timeout in milliseconds
+    request_job(conn, header.job_id);
+    break;
+  case OP_SUBMIT_BATCH: {
+    uint8_t priority = 0;
+    if (header.flags & FLAG_PRIORITY) {
+      if (payload.empty()) {
+        reply_in_order(conn, {0, OP_ERROR, "missing priority"});
+        return;
+      }
+      priority = static_cast<uint8_t>(payload[0]);
+      payload.remove_prefix(1);
+    }
+    int64_t not_before = 0;
+    if (header.flags & FLAG_NOT_BEFORE) {
+      if (payload.size() < 8) {
+        reply_in_order(conn, {0, OP_ERROR, "missing not-before time"});
+        return;
+      }
+      not_before = static_cast<int64_t>(
+          load_be64(reinterpret_cast<const unsigned char *>(payload.data())));
+      payload.remove_prefix(8);
+    }
+    submit_batch(conn, payload, header.job_id, priority, not_before);
+    break;
+  }
+  case OP_ACK:
+    ack_job(conn, header.job_id);
+    break;
+  case OP_ACK_RANGES: {
+    if (payload.empty() || payload.size() % 16 != 0) {
+      LOG_WARN_EVERY(1, "Invalid ACK_RANGES payload of {} bytes",
+                     payload.size());
+      return;
+    }
+    auto p = reinterpret_cast<const unsigned char *>(payload.data());
+    vector<pair<uint64_t, uint64_t>> ranges;
+    for (size_t at = 0; at < payload.size(); at += 16) {
+      ranges.emplace_back(load_be64(p + at), load_be64(p + at + 8));
+    }
+    ack_jobs(conn, ranges);
+    break;
+  }
+  case OP_FAIL:
+    fail_job(conn, header.job_id);
+    break;
+  case OP_QUIT:
+    conn.closing = true;
+    break;
+  case OP_TOUCH:
+    touch_job(conn, header.job_id);
+    break;
+  case OP_PREFETCH:
+    set_prefetch(conn, header.job_id);
+    break;
+  case OP_STATS:
+    send_stats(conn, header.job_id == 1);
+    break;
+  case OP_USE:
+    use_queue(conn, payload);
+    break;
+  case OP_WATCH:
+  case OP_IGNORE:
+    watch_queue(conn, payload, header.opcode);
+    break;
+  case OP_QUEUE:
+    set_queue_weight(conn, payload, header.job_id);
+    break;
+  case OP_LIMIT: {
+    if (payload.size() < 16) {
+      reply_error(conn, "missing limits");
+      return;
+    }
+    auto limits = reinterpret_cast<const unsigned char *>(payload.data());
+    set_queue_limits(conn, payload.substr(16), load_be64(limits),
+                     load_be64(limits + 8));
+    break;
+  }
+  default:
+    LOG_WARN_EVERY(1, "Invalid opcode {}", unsigned(header.opcode));
+    reply_error(conn, "invalid opcode");
+  }
+}
+
+static void usage(const char *prog) {
+  cerr << "Usage: " << prog
+       << " [--port=N] [--loops=N] [--shards=N] [--queue=locked|ring]"
+          " [--ring-slots=N] [--ring-full=spill|busy] [--max-payload-bytes=N]"
+          " [--max-prefetch=N] [--lease-timeout-ms=N] [--aging-ms=N]"
+          " [--log-level=debug|info|warn|error|off] [--io=epoll|uring]"
+          " [--wal-dir=DIR]"
+          " [--wal-delay-us=N]"
+          " [--wal-batch-bytes=N] [--wal-segment-bytes=N]"
+          " [--snapshot-segments=N] [--snapshot-interval-s=N]"
+          " [--recovery-threads=N] [--max-queues=N]"
+          " [--max-jobs=N] [--max-bytes=N] [--queue-max-jobs=N]"
+          " [--queue-max-bytes=N] [--retry-after-ms=N]"
+          " [--memory-window=N] [--spill-dir=DIR] [--spill-segment-bytes=N]"
+          " [--spill-read-bytes=N]"
+       << endl;
+}
+
+int main(int argc, char *argv[]) {
+  // one loop per core unless told otherwise
+  unsigned num_loops = thread::hardware_concurrency();
+  int port = DEFAULT_PORT;
+  size_t num_shards = 0; // 4 per loop unless set
+  QueueBackend backend = QueueBackend::Locked;
+  size_t ring_slots = 4096;
+  chrono::milliseconds aging{0};
+  size_t max_queues = 256;
+  QueueRegistry::Limits limits;
+  SpillConfig spill_config;
+  WalConfig wal_config;
+  bool want_uring = false;
+
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    size_t eq = arg.find('=');
+    string key = arg.substr(0, eq);
+    string value = (eq == string::npos) ? "" : arg.substr(eq + 1);
+    try {
+      if (key == "--port") {
+        unsigned long n = stoul(value);
+        if (n == 0 || n > 65535) {
+          usage(argv[0]);
+          return 1;
+        }
+        port = static_cast<int>(n);
+      } else if (key == "--loops") {
+        num_loops = static_cast<unsigned>(stoul(value));
+      } else if (key == "--wal-delay-us") {
+        wal_config.max_delay = chrono::microseconds(stoul(value));
+      } else if (key == "--wal-batch-bytes") {
+        wal_config.max_batch_bytes = stoul(value);
+      } else if (key == "--shards") {
+        num_shards = stoul(value);
+      } else if (key == "--queue") {
+        if (value == "locked") {
+          backend = QueueBackend::Locked;
+        } else if (value == "ring") {
+          backend = QueueBackend::Ring;
+        } else {
+          usage(argv[0]);
+          return 1;
+        }
+      } else if (key == "--ring-slots") {
+        ring_slots = stoul(value);
+      } else if (key == "--ring-full") {
+        if (value != "spill" && value != "busy") {
+          usage(argv[0]);
+          return 1;
+        }
+        busy_when_full = value == "busy";
+      } else if (key == "--max-payload-bytes") {
+        max_payload_bytes = stoul(value);
+      } else if (key == "--max-prefetch") {
+        max_prefetch = static_cast<uint32_t>(stoul(value));
+      } else if (key == "--lease-timeout-ms") {
+        lease_timeout = chrono::milliseconds(stoul(value));
+      } else if (key == "--log-level") {
+        LogLevel level;
+        if (!parse_log_level(value, level)) {
+          usage(argv[0]);
+          return 1;
+        }
+        Logger::instance().set_level(level);
+      } else if (key == "--io") {
+        if (value != "epoll" && value != "uring") {
+          usage(argv[0]);
+          return 1;
+        }
+        want_uring = value == "uring";
+      } else if (key == "--aging-ms") {
+        aging = chrono::milliseconds(stoul(value));
+      } else if (key == "--wal-dir") {
+        wal_config.dir = value;
+      } else if (key == "--wal-segment-bytes") {
+        wal_config.segment_bytes = stoul(value);
+      } else if (key == "--snapshot-segments") {
+        wal_config.snapshot_segments = stoul(value);
+      } else if (key == "--snapshot-interval-s") {
+        wal_config.snapshot_interval = chrono::seconds(stoul(value));
+      } else if (key == "--recovery-threads") {
+        wal_config.recovery_threads = static_cast<unsigned>(stoul(value));
+      } else if (key == "--max-queues") {
+        max_queues = stoul(value);
+      } else if (key == "--max-jobs") {
+        limits.max_jobs = stoull(value);
+      } else if (key == "--max-bytes") {
+        limits.max_bytes = stoull(value);
+      } else if (key == "--queue-max-jobs") {
+        limits.queue_max_jobs = stoull(value);
+      } else if (key == "--queue-max-bytes") {
+        limits.queue_max_bytes = stoull(value);
+      } else if (key == "--retry-after-ms") {
+        retry_after = chrono::milliseconds(stoul(value));
+      } else if (key == "--memory-window") {
+        spill_config.window = stoul(value);
+      } else if (key == "--spill-dir") {
+        spill_config.dir = value;
+      } else if (key == "--spill-segment-bytes") {
+        spill_config.segment_bytes = stoul(value);
+      } else if (key == "--spill-read-bytes") {
+        spill_config.read_bytes = max<size_t>(1, stoul(value));
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } catch (...) {
+      usage(argv[0]);
+      return 1;
+    }
+  }
+  if (num_loops == 0) {
+    num_loops = 1;
+  }
+  if (num_shards == 0) {
+    num_shards = 4 * static_cast<size_t>(num_loops);
+  }
+  queues = make_unique<QueueRegistry>(max_queues, num_shards, backend,
+                                     ring_slots, aging);
+  queues->limits = limits;
+  // recovered jobs past the window already spill
+  if (!queues->start_spilling(spill_config, [](NamedQueue &queue, size_t jobs) {
+        for (size_t i = 0; i < jobs && parked_count.load() > 0; i++) {
+          wake_parked_worker(queue.id);
+        }
+      })) {
+    LOG_ERROR("Could not open {}: {}", spill_config.dir, strerror(errno));
     return 1;
   }
 
-  if (::listen(server_fd, SOMAXCONN) == -1) {
-    ::close(server_fd);
+  if (!wal.open(wal_config)) {
+    LOG_ERROR("Could not open {}: {}", wal_config.dir, strerror(errno));
     return 1;
   }
+  read_ahead_log(wal_config);
+  // new queues and weights are logged ahead of the jobs that use them
+  queues->on_change = [](const NamedQueue &queue) {
+    wal.append(wal_queue_record(
+        queue.id, queue.weight.load(memory_order_relaxed), queue.name,
+        queue.max_jobs.load(memory_order_relaxed),
+        queue.max_bytes.load(memory_order_relaxed)));
+  };
+  scheduler.start(enqueue_due_jobs);
 
-  cout << "TCP Server Opened in localhost " << PORT << endl;
-  read_ahead_log();
+  vector<unique_ptr<EventLoop>> loops;
+  for (unsigned i = 0; i < num_loops; i++) {
+    auto loop = make_unique<EventLoop>();
+    if (!loop->open(port, want_uring)) {
+      LOG_ERROR("Server not running: {}", strerror(errno));
+      return 1;
+    }
+    loops.push_back(std::move(loop));
+  }
 
-  while (true) {
-    socklen_t len_client = sizeof(client_struct);
-    int client_fd = ::accept(
-        server_fd, reinterpret_cast<sockaddr *>(&client_struct), &len_client);
+  LOG_INFO("TCP Server Opened in localhost {} with {} event loops ({})", port,
+           num_loops, loops[0]->uses_uring() ? "io_uring" : "epoll");
 
-    if (client_fd == -1) {
-      cerr << "Client connection failed" << endl;
-      continue;
-    }
+  vector<thread> threads;
+  for (unsigned i = 1; i < num_loops; i++) {
+    threads.emplace_back(&EventLoop::run, loops[i].get());
+  }
+  loops[0]->run();
 
-    thread t1(handle_client, client_fd);
-    t1.detach();
+  for (auto &t : threads) {
+    t.join();
   }
 }
@@ -0,0 +1,249 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <dirent.h>
+#include <fcntl.h>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "job_store.h"
+
+struct SpillConfig {
+  std::string dir = "spill";
+  // jobs a queue keeps in memory before new ones go to disk, 0 to never spill
+  size_t window = 0;
+  // the tail segment is closed and a new one started past this size
+  size_t segment_bytes = 64 << 20;
+  // bytes read back per batch, and read ahead of it
+  size_t read_bytes = 4 << 20;
+  // appends are handed to the spill thread once this much is buffered
+  size_t write_bytes = 1 << 20;
+};
+
+// on-disk layout, all inside SpillConfig::dir:
+//   <queue id>-<seq>.spill   segments of one queue, read and deleted in order
+//
+// a record is a u32 length of everything after it, then u64 job id,
+// u64 enqueued_ns, u8 priority, u8 compressed and the payload, integers
+// little endian.
+// nothing is checksummed or synced: the WAL already holds every job durably,
+// and spill files are never read across a restart.
+const size_t SPILL_RECORD_HEADER = 4 + 8 + 8 + 1 + 1;
+
+inline void spill_put_le(char *at, uint64_t v, int bytes) {
+  for (int i = 0; i < bytes; i++) {
+    at[i] = static_cast<char>(v >> (8 * i));
+  }
+}
+
+inline uint64_t spill_get_le(const char *at, int bytes) {
+  uint64_t v = 0;
+  for (int i = 0; i < bytes; i++) {
+    v |= static_cast<uint64_t>(static_cast<uint8_t>(at[i])) << (8 * i);
+  }
+  return v;
+}
+
+inline std::string spill_segment_path(const std::string &dir, uint32_t queue,
+                                      uint64_t seq) {
+  char name[48];
+  std::snprintf(name, sizeof(name), "%u-%020llu.spill", queue,
+                static_cast<unsigned long long>(seq));
+  return dir + "/" + name;
+}
+
+// creates the directory, or empties it of what an earlier run spilled
+inline bool reset_spill_dir(const std::string &dir) {
+  if (::mkdir(dir.c_str(), 0755) == -1 && errno != EEXIST) {
+    return false;
+  }
+  DIR *d = ::opendir(dir.c_str());
+  if (d == nullptr) {
+    return false;
+  }
+  while (dirent *entry = ::readdir(d)) {
+    std::string name = entry->d_name;
+    if (name.size() > 6 && name.compare(name.size() - 6, 6, ".spill") == 0) {
+      ::unlink((dir + "/" + name).c_str());
+    }
+  }
+  ::closedir(d);
+  return true;
+}
+
+// the part of one queue's backlog that does not fit its memory window, oldest
+// first. append() runs on the event loops and only copies the job into a
+// write buffer under the mutex, so a SUBMIT never waits on the disk.
+// everything else runs on the one spill thread: flush() writes the buffer to
+// the tail segment, read() takes the oldest records back from the head one in
+// large sequential reads, and tells the kernel to start reading the next
+// batch so it is in the page cache by the time it is wanted. a segment that
+// has been read to the end is deleted.
+class SpillFile {
+public:
+  SpillFile(const SpillConfig &config, uint32_t queue)
+      : config(config), queue(queue) {}
+  SpillFile(const SpillFile &) = delete;
+  SpillFile &operator=(const SpillFile &) = delete;
+
+  ~SpillFile() {
+    for (Segment &segment : segments) {
+      ::close(segment.fd);
+      ::unlink(spill_segment_path(config.dir, queue, segment.seq).c_str());
+    }
+  }
+
+  // returns the bytes now buffered, for the caller to decide when to flush
+  size_t append(const Job &job) {
+    char head[SPILL_RECORD_HEADER];
+    spill_put_le(head, SPILL_RECORD_HEADER - 4 + job.job_text.size(), 4);
+    spill_put_le(head + 4, job.job_id, 8);
+    spill_put_le(head + 12, static_cast<uint64_t>(job.enqueued_ns), 8);
+    head[20] = static_cast<char>(job.priority);
+    head[21] = job.compressed ? 1 : 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    buffer.append(head, sizeof(head));
+    buffer.append(job.job_text.data(), job.job_text.size());
+    return buffer.size();
+  }
+
+  // spill thread only. false on a write error, in which case what could not
+  // be written stays buffered for the next try.
+  bool flush() {
+    if (unwritten.empty()) {
+      std::lock_guard<std::mutex> lock(mutex);
+      unwritten.swap(buffer);
+    }
+    size_t done = 0;
+    while (done < unwritten.size()) {
+      if ((segments.empty() ||
+           segments.back().size >= config.segment_bytes) &&
+          !open_segment()) {
+        break;
+      }
+      Segment &tail = segments.back();
+      ssize_t n = ::pwrite(tail.fd, unwritten.data() + done,
+                           unwritten.size() - done,
+                           static_cast<off_t>(tail.size));
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      // should a short write end a segment mid-record, the record continues
+      // in the next one: read() carries partial records across segments
+      done += static_cast<size_t>(n);
+      tail.size += static_cast<size_t>(n);
+    }
+    unwritten.erase(0, done);
+    if (unwritten.empty()) {
+      unwritten.shrink_to_fit();
+    }
+    return unwritten.empty();
+  }
+
+  // spill thread only: appends the oldest records that were flushed, about
+  // read_bytes of them, to out. false on a read error.
+  bool read(std::vector<Job> &out) {
+    while (!segments.empty()) {
+      Segment &head = segments.front();
+      if (head.read == head.size) {
+        // the tail may still grow, every other segment is done with
+        if (segments.size() == 1) {
+          return true;
+        }
+        ::close(head.fd);
+        ::unlink(spill_segment_path(config.dir, queue, head.seq).c_str());
+        segments.pop_front();
+        continue;
+      }
+      size_t want = std::min(config.read_bytes, head.size - head.read);
+      size_t carried = chunk.size();
+      chunk.resize(carried + want);
+      ssize_t n = ::pread(head.fd, &chunk[carried], want,
+                          static_cast<off_t>(head.read));
+      if (n < 0 && errno == EINTR) {
+        chunk.resize(carried);
+        continue;
+      }
+      if (n <= 0) {
+        chunk.resize(carried);
+        return false;
+      }
+      chunk.resize(carried + static_cast<size_t>(n));
+      head.read += static_cast<size_t>(n);
+      ::posix_fadvise(head.fd, static_cast<off_t>(head.read),
+                      static_cast<off_t>(config.read_bytes),
+                      POSIX_FADV_WILLNEED);
+      size_t used = decode(out);
+      chunk.erase(0, used);
+      if (used > 0) {
+        return true;
+      }
+    }
+    return true;
+  }
+
+private:
+  struct Segment {
+    uint64_t seq;
+    int fd;
+    size_t size = 0; // written
+    size_t read = 0; // taken into chunk
+  };
+
+  SpillConfig config;
+  uint32_t queue;
+  std::mutex mutex; // buffer
+  std::string buffer;
+  // spill thread only
+  std::string unwritten; // taken from buffer, not yet on disk
+  std::deque<Segment> segments;
+  uint64_t next_seq = 1;
+  std::string chunk; // read but not decoded, at most a partial record
+
+  bool open_segment() {
+    uint64_t seq = next_seq++;
+    int fd = ::open(spill_segment_path(config.dir, queue, seq).c_str(),
+                    O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1) {
+      return false;
+    }
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    segments.push_back({seq, fd});
+    return true;
+  }
+
+  // whole records at the front of chunk, returns the bytes they took
+  size_t decode(std::vector<Job> &out) {
+    size_t at = 0;
+    while (chunk.size() - at >= SPILL_RECORD_HEADER) {
+      const char *p = chunk.data() + at;
+      size_t len = static_cast<size_t>(spill_get_le(p, 4));
+      if (chunk.size() - at < 4 + len) {
+        break;
+      }
+      Job job{spill_get_le(p + 4, 8),
+              Payload(std::string_view(p + SPILL_RECORD_HEADER,
+                                       len + 4 - SPILL_RECORD_HEADER)),
+              static_cast<uint8_t>(p[20])};
+      job.enqueued_ns = static_cast<int64_t>(spill_get_le(p + 12, 8));
+      job.compressed = p[21] != 0;
+      job.queue = queue;
+      out.push_back(std::move(job));
+      at += 4 + len;
+    }
+    return at;
+  }
+};
@@ -0,0 +1,50 @@
+// checks that a SUBMIT the broker rejects is answered in submit order: a
+// valid SUBMIT, one with a bad compressed payload, an empty one and another
+// valid one go out in a single write, and the replies must come back as
+// JOB_ID, ERROR, ERROR, JOB_ID. a producer matches answers to submits in
+// that order, so an early ERROR would settle the wrong futures.
+//
+//   (libdsjq_client.a built in the repo root, see client.h)
+//   g++ -std=c++20 -O2 -pthread -I.. pipelined_submit_errors.cpp -L.. -ldsjq_client -o pipelined_submit_errors
+//   ./pipelined_submit_errors    (against a running broker, exits 1 on failure)
+
+#include <cstdio>
+#include <string>
+
+#include "client.h"
+
+using namespace std;
+
+int main() {
+  BrokerConnection conn{ClientOptions{}};
+  if (!conn.open()) {
+    fprintf(stderr, "no broker\n");
+    return 1;
+  }
+  string frames;
+  append_frame(frames, OP_SUBMIT, 0, "first");
+  // this connection did not negotiate LZ4, so the flag alone is invalid
+  append_frame(frames, OP_SUBMIT, 0, "not packed", FLAG_COMPRESSED);
+  append_frame(frames, OP_SUBMIT, 0, "");
+  append_frame(frames, OP_SUBMIT, 0, "last");
+  if (!conn.send(frames)) {
+    fprintf(stderr, "send failed\n");
+    return 1;
+  }
+
+  const uint8_t expected[] = {OP_JOB_ID, OP_ERROR, OP_ERROR, OP_JOB_ID};
+  bool ok = true;
+  for (uint8_t opcode : expected) {
+    FrameHeader header;
+    string payload;
+    if (!conn.read_frame(header, payload)) {
+      fprintf(stderr, "connection closed\n");
+      return 1;
+    }
+    printf("0x%02x %llu %s\n", header.opcode,
+           static_cast<unsigned long long>(header.job_id), payload.c_str());
+    ok = ok && header.opcode == opcode;
+  }
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,138 @@
+// checks that ACKs of ids the connection does not hold never reach the WAL:
+// on a fresh log it ACKs an id not handed out yet, SUBMITs a job (which then
+// gets that id), ACKs it again and an id far ahead from a second
+// connection, kills the broker without warning and starts it again on the
+// same log. the job must come back. recovery honours a DONE wherever it is
+// in the log, so a logged one would lose it.
+//
+// starts the broker itself, on port 5103 so as not to share 5003 with a
+// broker already running (it listens with SO_REUSEPORT), in a directory of
+// its own under /tmp.
+//
+//   (libdsjq_client.a built in the repo root, see client.h)
+//   g++ -std=c++20 -O2 -pthread -I.. unknown_ack_restart.cpp -L.. -ldsjq_client -o unknown_ack_restart
+//   ./unknown_ack_restart ../server    (exits 1 on failure)
+
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "client.h"
+
+using namespace std;
+
+static string dir;
+const int PORT = 5103;
+
+static ClientOptions options() {
+  ClientOptions options;
+  options.port = PORT;
+  return options;
+}
+
+static pid_t start_broker(const char *server) {
+  pid_t pid = fork();
+  if (pid == 0) {
+    // away from any write-ahead.log of an older version it would import
+    if (chdir(dir.c_str()) != 0) {
+      _exit(127);
+    }
+    string wal = "--wal-dir=" + dir + "/wal";
+    string spill = "--spill-dir=" + dir + "/spill";
+    string port = "--port=" + to_string(PORT);
+    execl(server, server, port.c_str(), wal.c_str(), spill.c_str(),
+          "--log-level=warn", static_cast<char *>(nullptr));
+    _exit(127);
+  }
+  return pid;
+}
+
+static void stop_broker(pid_t pid) {
+  kill(pid, SIGKILL);
+  waitpid(pid, nullptr, 0);
+}
+
+// sends frames and reads one reply
+static bool exchange(BrokerConnection &conn, const string &frames,
+                     FrameHeader &header, string &payload) {
+  return conn.send(frames) && conn.read_frame(header, payload);
+}
+
+int main(int argc, char *argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <path to server>\n", argv[0]);
+    return 1;
+  }
+  char tmpl[] = "/tmp/dsjq-unknown-ack-XXXXXX";
+  if (mkdtemp(tmpl) == nullptr) {
+    perror("mkdtemp");
+    return 1;
+  }
+  dir = tmpl;
+  // the broker runs from dir
+  char *server = realpath(argv[1], nullptr);
+  if (server == nullptr) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  pid_t broker = start_broker(server);
+  uint64_t id = 0;
+  {
+    BrokerConnection producer{options()};
+    BrokerConnection other{options()};
+    FrameHeader header;
+    string payload;
+    string frames;
+    // ACK has no reply, so each rides ahead of a frame that has one
+    append_frame(frames, OP_ACK, 1);
+    append_frame(frames, OP_SUBMIT, 0, "precious");
+    if (!producer.open() || !exchange(producer, frames, header, payload) ||
+        header.opcode != OP_JOB_ID) {
+      fprintf(stderr, "SUBMIT failed\n");
+      stop_broker(broker);
+      return 1;
+    }
+    id = header.job_id;
+    frames.clear();
+    append_frame(frames, OP_ACK, id);
+    append_frame(frames, OP_ACK, id + 1000);
+    append_frame(frames, OP_STATS, 0);
+    if (!other.open() || !exchange(other, frames, header, payload)) {
+      fprintf(stderr, "ACK failed\n");
+      stop_broker(broker);
+      return 1;
+    }
+  }
+  // let a wrongly logged DONE reach the disk before the crash
+  usleep(100 * 1000);
+  stop_broker(broker);
+
+  broker = start_broker(server);
+  bool ok = false;
+  {
+    BrokerConnection worker{options()};
+    FrameHeader header;
+    string payload;
+    string frames;
+    append_frame(frames, OP_REQUEST, 0);
+    if (worker.open() && exchange(worker, frames, header, payload)) {
+      ok = header.opcode == OP_JOB && header.job_id == id &&
+           payload == "precious";
+      printf("after restart: 0x%02x %llu %s\n", header.opcode,
+             static_cast<unsigned long long>(header.job_id),
+             payload.c_str());
+    }
+  }
+  stop_broker(broker);
+  free(server);
+  string cleanup = "rm -rf " + dir;
+  if (system(cleanup.c_str()) != 0) {
+    fprintf(stderr, "could not remove %s\n", dir.c_str());
+  }
+  printf("%s\n", ok ? "PASS" : "FAIL");
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,202 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+class TimingWheel;
+
+// intrusive timer, embedded in whatever owns the timeout (a lease, a parked
+// request). arming and cancelling only relink the node, and destroying an
+// armed node cancels it, so owners can simply go away.
+struct TimerNode {
+  std::function<void()> on_expire;
+
+  TimerNode() = default;
+  explicit TimerNode(std::function<void()> fn) : on_expire(std::move(fn)) {}
+  TimerNode(const TimerNode &) = delete;
+  TimerNode &operator=(const TimerNode &) = delete;
+  inline ~TimerNode();
+
+  bool armed() const { return wheel != nullptr; }
+
+private:
+  friend class TimingWheel;
+  TimerNode *prev = nullptr;
+  TimerNode *next = nullptr;
+  uint64_t expires = 0; // absolute tick
+  TimingWheel *wheel = nullptr;
+};
+
+// hierarchical hashed timing wheel: four levels of 256 slots at a 1 ms tick
+// cover ~49 days, anything further out is parked in the last level and
+// re-filed when its slot comes around. arm and cancel are O(1); advancing
+// fires the current level 0 slot and, every 256 ticks, cascades one slot of
+// the level above down, so the cost per tick does not depend on how many
+// timers are armed.
+class TimingWheel {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  explicit TimingWheel(Clock::time_point start = Clock::now())
+      : origin(start) {
+    for (auto &level : levels) {
+      for (auto &slot : level) {
+        slot.prev = slot.next = &slot;
+      }
+    }
+  }
+
+  TimingWheel(const TimingWheel &) = delete;
+  TimingWheel &operator=(const TimingWheel &) = delete;
+
+  // (re)arms node to fire after delay
+  void arm(TimerNode &node, std::chrono::milliseconds delay) {
+    cancel(node);
+    uint64_t ticks = delay.count() > 0 ? static_cast<uint64_t>(delay.count())
+                                       : 0;
+    node.expires = current + (ticks == 0 ? 1 : ticks);
+    node.wheel = this;
+    file(node);
+    armed_count++;
+  }
+
+  void cancel(TimerNode &node) {
+    if (node.wheel != this) {
+      return;
+    }
+    unlink(node);
+    node.wheel = nullptr;
+    armed_count--;
+  }
+
+  size_t size() const { return armed_count; }
+
+  // fires every timer that is due by now, in tick order
+  void advance(Clock::time_point now) {
+    uint64_t target = ticks_at(now);
+    if (armed_count == 0 && target > current) {
+      // nothing to fire or cascade, skip the idle stretch in one step
+      current = target;
+    }
+    while (current < target) {
+      tick();
+    }
+  }
+
+  // how long an event loop may sleep before the wheel needs another advance,
+  // -1 if nothing is armed
+  int next_timeout_ms(Clock::time_point now) const {
+    if (armed_count == 0) {
+      return -1;
+    }
+    // a due level 0 slot, or else the next cascade, whichever comes first
+    uint64_t wait = SLOTS - (current & MASK);
+    for (uint64_t i = 0; i < wait; i++) {
+      const TimerNode &slot = levels[0][(current + i) & MASK];
+      if (slot.next != &slot) {
+        wait = i;
+        break;
+      }
+    }
+    uint64_t now_ticks = ticks_at(now);
+    uint64_t due = current + wait + 1;
+    return due > now_ticks ? static_cast<int>(due - now_ticks) : 0;
+  }
+
+private:
+  static const int LEVELS = 4;
+  static const uint64_t BITS = 8;
+  static const uint64_t SLOTS = 1 << BITS;
+  static const uint64_t MASK = SLOTS - 1;
+
+  Clock::time_point origin;
+  uint64_t current = 0; // next tick to process
+  size_t armed_count = 0;
+  // each slot is the sentinel of a circular doubly linked list
+  TimerNode levels[LEVELS][SLOTS];
+
+  uint64_t ticks_at(Clock::time_point now) const {
+    if (now <= origin) {
+      return 0;
+    }
+    auto elapsed =
+        std::chrono::duration_cast<std::chrono::milliseconds>(now - origin);
+    return static_cast<uint64_t>(elapsed.count()) + 1;
+  }
+
+  void file(TimerNode &node) {
+    uint64_t delta = node.expires - current;
+    TimerNode *slot;
+    if (delta < SLOTS) {
+      slot = &levels[0][node.expires & MASK];
+    } else if (delta < (1ull << (2 * BITS))) {
+      slot = &levels[1][(node.expires >> BITS) & MASK];
+    } else if (delta < (1ull << (3 * BITS))) {
+      slot = &levels[2][(node.expires >> (2 * BITS)) & MASK];
+    } else {
+      // too far out for the top level: park it in the furthest slot, it
+      // gets re-filed with its real expiry when that slot cascades
+      uint64_t capped = delta < (1ull << (4 * BITS))
+                            ? node.expires
+                            : current + (1ull << (4 * BITS)) - 1;
+      slot = &levels[3][(capped >> (3 * BITS)) & MASK];
+    }
+    node.prev = slot->prev;
+    node.next = slot;
+    slot->prev->next = &node;
+    slot->prev = &node;
+  }
+
+  static void unlink(TimerNode &node) {
+    node.prev->next = node.next;
+    node.next->prev = node.prev;
+    node.prev = node.next = nullptr;
+  }
+
+  // moves every timer of one upper level slot down to where it now belongs
+  void cascade(int level) {
+    TimerNode &slot = levels[level][(current >> (level * BITS)) & MASK];
+    TimerNode *node = slot.next;
+    slot.prev = slot.next = &slot;
+    while (node != &slot) {
+      TimerNode *next = node->next;
+      file(*node);
+      node = next;
+    }
+  }
+
+  void tick() {
+    if ((current & MASK) == 0) {
+      for (int level = 1; level < LEVELS; level++) {
+        cascade(level);
+        if (((current >> (level * BITS)) & MASK) != 0) {
+          break;
+        }
+      }
+    }
+
+    TimerNode &slot = levels[0][current & MASK];
+    current++;
+    // detach the node and run a copy of its callback, which may re-arm the
+    // node or destroy its owner (and with it the original callback)
+    while (slot.next != &slot) {
+      TimerNode &node = *slot.next;
+      unlink(node);
+      node.wheel = nullptr;
+      armed_count--;
+      if (node.on_expire) {
+        std::function<void()> fire = node.on_expire;
+        fire();
+      }
+    }
+  }
+};
+
+TimerNode::~TimerNode() {
+  if (wheel != nullptr) {
+    wheel->cancel(*this);
+  }
+}
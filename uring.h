@@ -0,0 +1,237 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "metrics.h"
+
+// a minimal io_uring, straight on top of the system calls so that the broker
+// keeps building without liburing. one ring is owned by one thread: the
+// caller fills submission entries with get_sqe(), and a single enter() both
+// submits everything queued so far and waits for completions, so a loop
+// iteration that reads from and writes to many sockets costs one system call.
+//
+// resources are registered by slot in sparse tables that are filled in as
+// sockets come and go: a fixed file spares the kernel the fd lookup and
+// reference count on every request, a fixed buffer the page pinning on every
+// read into it.
+class Uring {
+public:
+  Uring() = default;
+  Uring(const Uring &) = delete;
+  Uring &operator=(const Uring &) = delete;
+
+  ~Uring() {
+    if (sq_ring != MAP_FAILED) {
+      ::munmap(sq_ring, sq_ring_bytes);
+    }
+    if (cq_ring != MAP_FAILED && cq_ring != sq_ring) {
+      ::munmap(cq_ring, cq_ring_bytes);
+    }
+    if (sqes != MAP_FAILED) {
+      ::munmap(sqes, sqes_bytes);
+    }
+    if (ring_fd != -1) {
+      ::close(ring_fd);
+    }
+  }
+
+  // false, with errno set, when the kernel has no io_uring, it is disabled,
+  // or it lacks one of the features we rely on: waiting with a timeout in
+  // the same call that submits (EXT_ARG), retrying sockets by internal poll
+  // rather than blocking a worker thread (FAST_POLL), never dropping
+  // completions (NODROP) and one mapping for both rings (SINGLE_MMAP).
+  bool init(unsigned entries) {
+    io_uring_params params{};
+    params.flags = IORING_SETUP_CLAMP;
+    ring_fd = static_cast<int>(::syscall(__NR_io_uring_setup, entries, &params));
+    if (ring_fd == -1) {
+      return false;
+    }
+    const unsigned required = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_NODROP |
+                              IORING_FEAT_EXT_ARG | IORING_FEAT_FAST_POLL;
+    if ((params.features & required) != required) {
+      errno = ENOSYS;
+      return false;
+    }
+
+    sq_ring_bytes = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_ring_bytes =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    sq_ring_bytes = cq_ring_bytes = std::max(sq_ring_bytes, cq_ring_bytes);
+    sq_ring = ::mmap(nullptr, sq_ring_bytes, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (sq_ring == MAP_FAILED) {
+      return false;
+    }
+    cq_ring = sq_ring;
+    sqes_bytes = params.sq_entries * sizeof(io_uring_sqe);
+    sqes = ::mmap(nullptr, sqes_bytes, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED) {
+      return false;
+    }
+
+    char *sq = static_cast<char *>(sq_ring);
+    sq_head = reinterpret_cast<std::atomic<unsigned> *>(sq + params.sq_off.head);
+    sq_tail = reinterpret_cast<std::atomic<unsigned> *>(sq + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned *>(sq + params.sq_off.ring_mask);
+    sq_entries = params.sq_entries;
+    sq_array = reinterpret_cast<unsigned *>(sq + params.sq_off.array);
+    char *cq = static_cast<char *>(cq_ring);
+    cq_head = reinterpret_cast<std::atomic<unsigned> *>(cq + params.cq_off.head);
+    cq_tail = reinterpret_cast<std::atomic<unsigned> *>(cq + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned *>(cq + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe *>(cq + params.cq_off.cqes);
+    // the index array is the identity, so it is filled in once
+    for (unsigned i = 0; i < sq_entries; i++) {
+      sq_array[i] = i;
+    }
+    local_tail = sq_tail->load(std::memory_order_relaxed);
+    return true;
+  }
+
+  // a zeroed entry to fill, or null when the submission queue is full, in
+  // which case the caller enter()s once without waiting and tries again
+  io_uring_sqe *get_sqe() {
+    unsigned head = sq_head->load(std::memory_order_acquire);
+    if (local_tail - head >= sq_entries) {
+      return nullptr;
+    }
+    io_uring_sqe *sqe = static_cast<io_uring_sqe *>(sqes) + (local_tail & sq_mask);
+    std::memset(sqe, 0, sizeof(*sqe));
+    local_tail++;
+    return sqe;
+  }
+
+  // like get_sqe() but never fails: a full queue is submitted first
+  io_uring_sqe *next_sqe() {
+    io_uring_sqe *sqe = get_sqe();
+    while (sqe == nullptr) {
+      enter(0, -1);
+      sqe = get_sqe();
+    }
+    return sqe;
+  }
+
+  // submits every queued entry and waits for at least wait_nr completions,
+  // for no longer than timeout_ms unless that is negative. returns false on
+  // an error other than an interrupted or timed out wait.
+  bool enter(unsigned wait_nr, int timeout_ms) {
+    sq_tail->store(local_tail, std::memory_order_release);
+    unsigned to_submit = local_tail - submitted;
+    unsigned flags = 0;
+    io_uring_getevents_arg arg{};
+    __kernel_timespec ts{};
+    if (wait_nr > 0) {
+      flags |= IORING_ENTER_GETEVENTS;
+      if (timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = static_cast<long long>(timeout_ms % 1000) * 1000000;
+        arg.ts = reinterpret_cast<uint64_t>(&ts);
+        flags |= IORING_ENTER_EXT_ARG;
+      }
+    }
+    if (to_submit == 0 && wait_nr == 0) {
+      return true;
+    }
+    Metrics::count(Counter::Syscalls);
+    long ret = ::syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr,
+                         flags, (flags & IORING_ENTER_EXT_ARG) ? &arg : nullptr,
+                         sizeof(arg));
+    if (ret >= 0) {
+      submitted += static_cast<unsigned>(ret);
+      return true;
+    }
+    return errno == EINTR || errno == ETIME || errno == EBUSY ||
+           errno == EAGAIN;
+  }
+
+  // hands every available completion to fn and marks them seen
+  template <typename Fn> unsigned for_each_completion(Fn &&fn) {
+    unsigned head = cq_head->load(std::memory_order_relaxed);
+    unsigned tail = cq_tail->load(std::memory_order_acquire);
+    unsigned n = 0;
+    while (head != tail) {
+      io_uring_cqe cqe = cqes[head & cq_mask];
+      head++;
+      n++;
+      // released before the handler runs so that it may queue and submit
+      cq_head->store(head, std::memory_order_release);
+      fn(cqe);
+      tail = cq_tail->load(std::memory_order_acquire);
+    }
+    return n;
+  }
+
+  // sparse tables of slots, all empty to begin with
+  bool register_files(unsigned slots) {
+    io_uring_rsrc_register reg{};
+    reg.nr = slots;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    return do_register(IORING_REGISTER_FILES2, &reg, sizeof(reg));
+  }
+
+  bool register_buffers(unsigned slots) {
+    io_uring_rsrc_register reg{};
+    reg.nr = slots;
+    reg.flags = IORING_RSRC_REGISTER_SPARSE;
+    return do_register(IORING_REGISTER_BUFFERS2, &reg, sizeof(reg));
+  }
+
+  // fd -1 empties the slot
+  bool update_file(unsigned slot, int fd) {
+    io_uring_rsrc_update2 up{};
+    up.offset = slot;
+    up.data = reinterpret_cast<uint64_t>(&fd);
+    up.nr = 1;
+    return do_register(IORING_REGISTER_FILES_UPDATE2, &up, sizeof(up));
+  }
+
+  // a null base empties the slot
+  bool update_buffer(unsigned slot, void *base, size_t len) {
+    iovec iov{base, len};
+    io_uring_rsrc_update2 up{};
+    up.offset = slot;
+    up.data = reinterpret_cast<uint64_t>(&iov);
+    up.nr = 1;
+    return do_register(IORING_REGISTER_BUFFERS_UPDATE, &up, sizeof(up));
+  }
+
+private:
+  int ring_fd = -1;
+  void *sq_ring = MAP_FAILED;
+  void *cq_ring = MAP_FAILED;
+  void *sqes = MAP_FAILED;
+  size_t sq_ring_bytes = 0;
+  size_t cq_ring_bytes = 0;
+  size_t sqes_bytes = 0;
+
+  std::atomic<unsigned> *sq_head = nullptr;
+  std::atomic<unsigned> *sq_tail = nullptr;
+  unsigned sq_mask = 0;
+  unsigned sq_entries = 0;
+  unsigned *sq_array = nullptr;
+  unsigned local_tail = 0; // entries handed out, published by enter()
+  unsigned submitted = 0;  // entries the kernel has consumed
+
+  std::atomic<unsigned> *cq_head = nullptr;
+  std::atomic<unsigned> *cq_tail = nullptr;
+  unsigned cq_mask = 0;
+  io_uring_cqe *cqes = nullptr;
+
+  bool do_register(unsigned opcode, void *arg, unsigned size) {
+    Metrics::count(Counter::Syscalls);
+    return ::syscall(__NR_io_uring_register, ring_fd, opcode, arg, size) >= 0;
+  }
+};
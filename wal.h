@@ -0,0 +1,1561 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+#include "crc32c.h"
+#include "io_chain.h"
+#include "log.h"
+#include "metrics.h"
+#include "payload.h"
+
+// on-disk layout, all inside WalConfig::dir:
+//   <seq>.log           log segments, sealed once they reach segment_bytes
+//   snapshot-<seq>.snap pending set after replaying every segment <= seq
+// recovery loads the newest snapshot and replays only the segments after it,
+// and the compactor deletes everything a snapshot covers.
+struct WalConfig {
+  std::string dir = "wal";
+  // pre-segmentation log, imported as the first segment if still around
+  std::string legacy_path = "write-ahead.log";
+  // how long the writer lingers after the first record of a batch to let
+  // other connections join the same sync
+  std::chrono::microseconds max_delay{500};
+  // a batch is flushed right away once it holds this many bytes
+  size_t max_batch_bytes = 1 << 20;
+  // segments are preallocated to this size and sealed once full
+  size_t segment_bytes = 64 << 20;
+  // snapshot as soon as this many segments are sealed but not yet covered
+  size_t snapshot_segments = 4;
+  // ... or at least this often while the log keeps growing
+  std::chrono::seconds snapshot_interval{60};
+  // threads that parse the log at startup, 0 for one per core
+  unsigned recovery_threads = 0;
+};
+
+// segments and snapshots share one binary format: a 16 byte file header
+// (magic, version) followed by records
+//
+//   u32 crc32c   of everything after this field up to the end of the record
+//   u32 length   bytes after the 8 byte header
+//   u8  type     WalRecord::Type, | WAL_COMPRESSED for an Add / AddTo whose
+//                payload is LZ4 packed (see lz4.h)
+//   u8  priority  for Queue: flags, WAL_QUEUE_LIMITS
+//   varint id    the job id, the largest id handed out for MaxId, the queue
+//                id for Queue, the first job id for AddBatch and the start
+//                of the first range for DoneRanges
+//   varint not_before_ms        Add / AddTo / AddBatch only, 0 for none
+//   varint queue                AddTo / AddBatch only: an Add outside the
+//                               default queue
+//   varint count                AddBatch: jobs, DoneRanges: ranges
+//   varint weight               Queue only
+//   varint max_jobs, max_bytes  Queue with WAL_QUEUE_LIMITS only
+//   payload      the rest of the record: the job for Add / AddTo, the
+//                queue name for Queue, and for
+//                AddBatch  count times varint (length << 1 | compressed)
+//                          and that many bytes of job, ids counting up from
+//                          id, priority, not-before time and queue shared
+//                DoneRanges  varint length of the first range, then per
+//                          further range varint gap since the end of the
+//                          previous one and varint length, ascending
+//
+// the version goes up with every record type or flag added, so that a
+// broker refuses logs newer than it can read instead of stopping at the
+// first record it does not know. version 1 had Add, Done and MaxId only;
+// version 2 adds Queue, AddTo, AddBatch, DoneRanges and WAL_COMPRESSED.
+//
+// integers are little endian. the unused tail of a preallocated segment is
+// zeros, and a zero length marks the end of the log, as does the first
+// record whose checksum does not match: a write torn by a crash.
+const char WAL_MAGIC[8] = {'D', 'S', 'J', 'Q', 'W', 'A', 'L', '\0'};
+const uint32_t WAL_VERSION = 2;
+const size_t WAL_FILE_HEADER = 16;
+const size_t WAL_RECORD_HEADER = 8;
+const uint8_t WAL_QUEUE_LIMITS = 0x01;
+const uint8_t WAL_COMPRESSED = 0x80;
+
+struct WalRecord {
+  // AddTo is only ever on disk: it is written for an Add whose queue is not
+  // the default one and decoded back into one. AddBatch and DoneRanges log
+  // a SUBMIT_BATCH and a multi-id ACK as one record each.
+  enum Type : uint8_t {
+    Add = 1,
+    Done = 2,
+    MaxId = 3,
+    AddTo = 4,
+    Queue = 5,
+    AddBatch = 6,
+    DoneRanges = 7,
+  };
+
+  Type type = Add;
+  uint8_t priority = 0;
+  uint64_t id = 0;
+  int64_t not_before_ms = 0;
+  uint32_t queue = 0;  // Add, AddBatch
+  bool compressed = false; // Add
+  uint64_t count = 0;  // AddBatch, DoneRanges
+  uint32_t weight = 0; // Queue
+  uint64_t max_jobs = 0; // Queue
+  uint64_t max_bytes = 0;
+  std::string_view payload;
+};
+
+inline void wal_put_varint(std::string &out, uint64_t v) {
+  while (v >= 0x80) {
+    out += static_cast<char>((v & 0x7f) | 0x80);
+    v >>= 7;
+  }
+  out += static_cast<char>(v);
+}
+
+inline bool wal_get_varint(const char *&p, const char *end, uint64_t &v) {
+  v = 0;
+  for (int shift = 0; shift < 64 && p < end; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*p++);
+    v |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline void wal_put_u32(char *at, uint32_t v) {
+  for (int i = 0; i < 4; i++) {
+    at[i] = static_cast<char>(v >> (8 * i));
+  }
+}
+
+inline uint32_t wal_get_u32(const char *at) {
+  uint32_t v = 0;
+  for (int i = 0; i < 4; i++) {
+    v |= static_cast<uint32_t>(static_cast<uint8_t>(at[i])) << (8 * i);
+  }
+  return v;
+}
+
+// everything of a record but its payload, checksum included, so that the
+// payload itself can be written from its slab block without another copy
+inline std::string wal_record_head(const WalRecord &record) {
+  std::string head(WAL_RECORD_HEADER, '\0');
+  bool add_to = record.type == WalRecord::Add && record.queue != 0;
+  bool batch = record.type == WalRecord::AddBatch;
+  uint8_t type = add_to ? WalRecord::AddTo : record.type;
+  if (record.type == WalRecord::Add && record.compressed) {
+    type |= WAL_COMPRESSED;
+  }
+  head += static_cast<char>(type);
+  head += static_cast<char>(record.priority);
+  wal_put_varint(head, record.id);
+  if (record.type == WalRecord::Add || batch) {
+    wal_put_varint(head, static_cast<uint64_t>(record.not_before_ms));
+  }
+  if (add_to || batch) {
+    wal_put_varint(head, record.queue);
+  }
+  if (batch || record.type == WalRecord::DoneRanges) {
+    wal_put_varint(head, record.count);
+  }
+  if (record.type == WalRecord::Queue) {
+    wal_put_varint(head, record.weight);
+    if (record.priority & WAL_QUEUE_LIMITS) {
+      wal_put_varint(head, record.max_jobs);
+      wal_put_varint(head, record.max_bytes);
+    }
+  }
+  wal_put_u32(&head[4], static_cast<uint32_t>(head.size() - WAL_RECORD_HEADER +
+                                              record.payload.size()));
+  uint32_t crc = crc32c(head.data() + 4, head.size() - 4);
+  crc = crc32c_extend(crc, record.payload.data(), record.payload.size());
+  wal_put_u32(&head[0], crc);
+  return head;
+}
+
+inline std::string wal_add_head(uint64_t id, uint8_t priority,
+                                int64_t not_before_ms,
+                                std::string_view payload, uint32_t queue = 0,
+                                bool compressed = false) {
+  WalRecord record;
+  record.priority = priority;
+  record.id = id;
+  record.not_before_ms = not_before_ms;
+  record.queue = queue;
+  record.compressed = compressed;
+  record.payload = payload;
+  return wal_record_head(record);
+}
+
+inline std::string wal_record(const WalRecord &record) {
+  return wal_record_head(record).append(record.payload);
+}
+
+inline std::string wal_id_record(WalRecord::Type type, uint64_t id) {
+  WalRecord record;
+  record.type = type;
+  record.id = id;
+  return wal_record(record);
+}
+
+inline std::string wal_add_record(uint64_t id, uint8_t priority,
+                                  int64_t not_before_ms,
+                                  std::string_view payload,
+                                  uint32_t queue = 0,
+                                  bool compressed = false) {
+  return wal_add_head(id, priority, not_before_ms, payload, queue, compressed)
+      .append(payload);
+}
+
+inline std::string wal_queue_record(uint32_t queue, uint32_t weight,
+                                    std::string_view name,
+                                    uint64_t max_jobs = 0,
+                                    uint64_t max_bytes = 0) {
+  WalRecord record;
+  record.type = WalRecord::Queue;
+  record.id = queue;
+  record.weight = weight;
+  if (max_jobs != 0 || max_bytes != 0) {
+    record.priority = WAL_QUEUE_LIMITS;
+    record.max_jobs = max_jobs;
+    record.max_bytes = max_bytes;
+  }
+  record.payload = name;
+  return wal_record(record);
+}
+
+// a SUBMIT_BATCH as one AddBatch record, built a job at a time. the jobs get
+// ids first_id, first_id + 1, ... in the order they are added, and their
+// payloads are held by reference like a single Add's until the writer copies
+// them into the segment.
+class WalBatch {
+public:
+  struct Job {
+    std::string prefix; // varint (length << 1 | compressed)
+    Payload payload;
+  };
+
+  WalBatch(uint64_t first_id, uint8_t priority, int64_t not_before_ms,
+           uint32_t queue) {
+    record.type = WalRecord::AddBatch;
+    record.id = first_id;
+    record.priority = priority;
+    record.not_before_ms = not_before_ms;
+    record.queue = queue;
+  }
+
+  void add(const Payload &payload, bool compressed) {
+    Job &job = added.emplace_back();
+    wal_put_varint(job.prefix, payload.size() << 1 | (compressed ? 1 : 0));
+    job.payload = payload;
+    body_bytes += job.prefix.size() + payload.size();
+  }
+
+  size_t size() const { return added.size(); }
+  const std::vector<Job> &jobs() const { return added; }
+
+  // everything ahead of the first job, checksum over all of them included
+  std::string head() const {
+    WalRecord counted = record;
+    counted.count = added.size();
+    std::string head = wal_record_head(counted);
+    wal_put_u32(&head[4], static_cast<uint32_t>(head.size() -
+                                                WAL_RECORD_HEADER +
+                                                body_bytes));
+    uint32_t crc = crc32c(head.data() + 4, head.size() - 4);
+    for (const Job &job : added) {
+      crc = crc32c_extend(crc, job.prefix.data(), job.prefix.size());
+      crc = crc32c_extend(crc, job.payload.data(), job.payload.size());
+    }
+    wal_put_u32(&head[0], crc);
+    return head;
+  }
+
+  // the whole record as one string
+  std::string serialize() const {
+    std::string out = head();
+    for (const Job &job : added) {
+      out += job.prefix;
+      out.append(job.payload.data(), job.payload.size());
+    }
+    return out;
+  }
+
+private:
+  WalRecord record;
+  std::vector<Job> added;
+  size_t body_bytes = 0;
+};
+
+// the next job of an AddBatch payload, false if it is malformed
+inline bool wal_batch_next(const char *&p, const char *end,
+                           std::string_view &job, bool &compressed) {
+  uint64_t v;
+  if (!wal_get_varint(p, end, v) ||
+      (v >> 1) > static_cast<uint64_t>(end - p)) {
+    return false;
+  }
+  compressed = (v & 1) != 0;
+  job = std::string_view(p, static_cast<size_t>(v >> 1));
+  p += v >> 1;
+  return true;
+}
+
+// one DoneRanges record for the ids of ranges, ascending and disjoint
+// [first, last] pairs
+inline std::string
+wal_done_ranges_record(const std::vector<std::pair<uint64_t, uint64_t>> &ranges) {
+  std::string body;
+  uint64_t at = ranges.front().first;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    if (i > 0) {
+      wal_put_varint(body, ranges[i].first - at);
+    }
+    wal_put_varint(body, ranges[i].second - ranges[i].first + 1);
+    at = ranges[i].second + 1;
+  }
+  WalRecord record;
+  record.type = WalRecord::DoneRanges;
+  record.id = ranges.front().first;
+  record.count = ranges.size();
+  record.payload = body;
+  return wal_record(record);
+}
+
+// the next [first, last] range of a DoneRanges payload. at starts out as the
+// record's id and follows the end of the ranges read so far.
+inline bool wal_range_next(const char *&p, const char *end, bool first_range,
+                           uint64_t &at, uint64_t &first, uint64_t &last) {
+  uint64_t gap = 0;
+  uint64_t length = 0;
+  if ((!first_range && !wal_get_varint(p, end, gap)) ||
+      !wal_get_varint(p, end, length) || length == 0 ||
+      gap > UINT64_MAX - at || length - 1 > UINT64_MAX - (at + gap)) {
+    return false;
+  }
+  first = at + gap;
+  last = first + (length - 1);
+  at = last + 1;
+  return true;
+}
+
+inline std::string wal_file_header() {
+  std::string header(WAL_MAGIC, sizeof(WAL_MAGIC));
+  header.resize(WAL_FILE_HEADER, '\0');
+  wal_put_u32(&header[8], WAL_VERSION);
+  return header;
+}
+
+inline bool wal_is_binary(const char *data, size_t len) {
+  return len >= WAL_FILE_HEADER &&
+         std::memcmp(data, WAL_MAGIC, sizeof(WAL_MAGIC)) == 0;
+}
+
+// of a file wal_is_binary() accepted. every version up to ours reads back,
+// older records mean the same in newer versions.
+inline bool wal_version_known(const char *data) {
+  uint32_t version = wal_get_u32(data + 8);
+  return version >= 1 && version <= WAL_VERSION;
+}
+
+enum class WalScan { Ok, End, Corrupt };
+
+// decodes the record at p in place; the payload points into the buffer
+inline WalScan wal_decode(const char *p, const char *end, WalRecord &record,
+                          size_t &consumed) {
+  if (end - p < static_cast<ptrdiff_t>(WAL_RECORD_HEADER)) {
+    return WalScan::End;
+  }
+  uint32_t length = wal_get_u32(p + 4);
+  if (length == 0) {
+    return WalScan::End;
+  }
+  if (length < 3 ||
+      static_cast<size_t>(end - p) - WAL_RECORD_HEADER < length ||
+      crc32c(p + 4, 4 + length) != wal_get_u32(p)) {
+    return WalScan::Corrupt;
+  }
+  const char *body = p + WAL_RECORD_HEADER;
+  const char *body_end = body + length;
+  uint8_t type = static_cast<uint8_t>(body[0]);
+  record.compressed = (type & WAL_COMPRESSED) != 0;
+  type &= static_cast<uint8_t>(~WAL_COMPRESSED);
+  if (type < WalRecord::Add || type > WalRecord::DoneRanges ||
+      (record.compressed && type != WalRecord::Add &&
+       type != WalRecord::AddTo)) {
+    return WalScan::Corrupt;
+  }
+  record.type = static_cast<WalRecord::Type>(type);
+  record.priority = static_cast<uint8_t>(body[1]);
+  const char *q = body + 2;
+  uint64_t not_before = 0;
+  uint64_t queue = 0;
+  uint64_t weight = 0;
+  record.max_jobs = 0;
+  record.max_bytes = 0;
+  bool batch = type == WalRecord::AddBatch;
+  bool add = type == WalRecord::Add || type == WalRecord::AddTo || batch;
+  bool counted = batch || type == WalRecord::DoneRanges;
+  bool limits =
+      type == WalRecord::Queue && (record.priority & WAL_QUEUE_LIMITS);
+  record.count = 0;
+  if (!wal_get_varint(q, body_end, record.id) ||
+      (add && !wal_get_varint(q, body_end, not_before)) ||
+      ((type == WalRecord::AddTo || batch) &&
+       !wal_get_varint(q, body_end, queue)) ||
+      (counted && !wal_get_varint(q, body_end, record.count)) ||
+      (type == WalRecord::Queue && !wal_get_varint(q, body_end, weight)) ||
+      (limits && (!wal_get_varint(q, body_end, record.max_jobs) ||
+                  !wal_get_varint(q, body_end, record.max_bytes))) ||
+      queue > UINT32_MAX || weight > UINT32_MAX) {
+    return WalScan::Corrupt;
+  }
+  if (type == WalRecord::AddTo) {
+    record.type = WalRecord::Add;
+  }
+  record.not_before_ms = static_cast<int64_t>(not_before);
+  record.queue = static_cast<uint32_t>(queue);
+  record.weight = static_cast<uint32_t>(weight);
+  record.payload = std::string_view(q, static_cast<size_t>(body_end - q));
+  // the jobs or ranges must fill the payload exactly, so that whoever steps
+  // through them later need not check again
+  if (counted) {
+    uint64_t at = record.id;
+    uint64_t n = 0;
+    for (; n < record.count && q < body_end; n++) {
+      std::string_view job;
+      bool packed = false;
+      uint64_t first, last;
+      if (batch ? !wal_batch_next(q, body_end, job, packed)
+                : !wal_range_next(q, body_end, n == 0, at, first, last)) {
+        return WalScan::Corrupt;
+      }
+    }
+    if (n != record.count || q != body_end || n == 0 ||
+        (batch && record.count - 1 > UINT64_MAX - record.id)) {
+      return WalScan::Corrupt;
+    }
+  }
+  consumed = WAL_RECORD_HEADER + length;
+  return WalScan::Ok;
+}
+
+// a read-only mapping of a whole file, for scanning records in place
+class MappedFile {
+public:
+  explicit MappedFile(const std::string &path) {
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1) {
+      return;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) == 0 && st.st_size > 0) {
+      void *p = ::mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ,
+                       MAP_PRIVATE, fd, 0);
+      if (p != MAP_FAILED) {
+        addr = static_cast<const char *>(p);
+        len = static_cast<size_t>(st.st_size);
+        ::madvise(p, len, MADV_SEQUENTIAL);
+      }
+    }
+    opened = true;
+    ::close(fd);
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  ~MappedFile() {
+    if (addr != nullptr) {
+      ::munmap(const_cast<char *>(addr), len);
+    }
+  }
+
+  bool ok() const { return opened; }
+  const char *data() const { return addr; }
+  size_t size() const { return len; }
+
+private:
+  const char *addr = nullptr;
+  size_t len = 0;
+  bool opened = false;
+};
+
+// the text format of earlier versions, one record per line:
+// ADD <id> <payload>, ADDP <id> <priority> <payload>,
+// ADDAT <id> <not_before_ms> <priority> <payload>, DONE <id> and MAX_ID <n>.
+// only read, to convert old logs.
+inline bool parse_text_wal_line(std::string_view line, WalRecord &record) {
+  auto field = [&line](uint64_t &value) {
+    size_t sp = line.find(' ');
+    std::string_view text = line.substr(0, sp);
+    line = sp == std::string_view::npos ? std::string_view() : line.substr(sp + 1);
+    value = 0;
+    if (text.empty()) {
+      return false;
+    }
+    for (char c : text) {
+      if (c < '0' || c > '9') {
+        return false;
+      }
+      value = value * 10 + static_cast<uint64_t>(c - '0');
+    }
+    return true;
+  };
+  size_t sp = line.find(' ');
+  std::string_view cmd = line.substr(0, sp);
+  line = sp == std::string_view::npos ? std::string_view() : line.substr(sp + 1);
+
+  uint64_t priority = 0;
+  uint64_t not_before = 0;
+  record = WalRecord();
+  if (cmd == "ADD") {
+    if (!field(record.id)) {
+      return false;
+    }
+  } else if (cmd == "ADDP") {
+    if (!field(record.id) || !field(priority)) {
+      return false;
+    }
+  } else if (cmd == "ADDAT") {
+    if (!field(record.id) || !field(not_before) || !field(priority)) {
+      return false;
+    }
+  } else if (cmd == "DONE" || cmd == "MAX_ID") {
+    record.type = cmd == "DONE" ? WalRecord::Done : WalRecord::MaxId;
+    return field(record.id);
+  } else {
+    return false;
+  }
+  record.priority = static_cast<uint8_t>(std::min<uint64_t>(priority, 255));
+  record.not_before_ms = static_cast<int64_t>(not_before);
+  record.payload = line;
+  return true;
+}
+
+inline bool fsync_dir(const std::string &dir);
+
+// rewrites a text log (segment, snapshot or the legacy write-ahead.log) as a
+// binary one at to, record for record. a trailing line without its newline
+// is a torn write and is dropped, as the text reader always did.
+inline bool convert_text_wal(const std::string &from, const std::string &to) {
+  std::ifstream in(from, std::ios::binary);
+  if (!in) {
+    return false;
+  }
+  std::string tmp = to + ".tmp";
+  {
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out << wal_file_header();
+    std::string line;
+    WalRecord record;
+    while (std::getline(in, line)) {
+      if (in.eof()) {
+        break;
+      }
+      if (parse_text_wal_line(line, record)) {
+        out << wal_record(record);
+      }
+    }
+    if (!out.flush()) {
+      return false;
+    }
+  }
+  int fd = ::open(tmp.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  bool synced = ::fsync(fd) == 0;
+  ::close(fd);
+  if (!synced || ::rename(tmp.c_str(), to.c_str()) == -1) {
+    return false;
+  }
+  if (from != to) {
+    ::unlink(from.c_str());
+  }
+  std::string dir = to.substr(0, to.rfind('/'));
+  return fsync_dir(dir.empty() ? "." : dir);
+}
+
+// a job that is still pending as far as the log is concerned
+struct WalJob {
+  Payload payload;
+  uint8_t priority = 0;
+  int64_t not_before_ms = 0;
+  uint32_t queue = 0;
+  bool compressed = false;
+};
+
+// a named queue as last logged
+struct WalQueue {
+  uint32_t id;
+  uint32_t weight;
+  std::string name;
+  uint64_t max_jobs = 0;
+  uint64_t max_bytes = 0;
+};
+
+// runs fn(i) for every i < n on up to threads threads, handing out indices
+// one at a time so that uneven items balance out
+template <typename Fn>
+void wal_parallel_for(size_t n, unsigned threads, const Fn &fn) {
+  if (threads <= 1 || n <= 1) {
+    for (size_t i = 0; i < n; i++) {
+      fn(i);
+    }
+    return;
+  }
+  std::atomic<size_t> next{0};
+  auto work = [&] {
+    for (size_t i = next++; i < n; i = next++) {
+      fn(i);
+    }
+  };
+  std::vector<std::thread> pool;
+  for (unsigned t = 1; t < std::min<size_t>(threads, n); t++) {
+    pool.emplace_back(work);
+  }
+  work();
+  for (auto &thread : pool) {
+    thread.join();
+  }
+}
+
+// the pending set a sequence of log files describes, in job id order
+struct WalRecovery {
+  uint64_t max_job_id = 0;
+  std::vector<WalQueue> queues; // by id
+  std::vector<std::pair<uint64_t, WalJob>> pending;
+};
+
+// rebuilds the pending set from files given in log order (a snapshot, then
+// segments). every job id is added once and done at most once, so the pending
+// set is simply every ADD without a DONE and the records can be read in any
+// order, which lets recovery run in phases that each spread over threads:
+//
+//  1. per file: hop from record to record by length alone and cut the file
+//     into chunks of about CHUNK_BYTES
+//  2. per chunk: check and decode the records in place into ADDs (pointing
+//     at the mapped payload), DONEs and spans of DONE ids (a DoneRanges
+//     record is kept as its ranges). a file is cut short at its first
+//     torn or corrupt record, and its later chunks are dropped. the few
+//     queue records are kept with their position, the last one of a queue
+//     wins.
+//  3. per chunk: scatter ADDs and DONEs into job id ranges
+//  4. per range: sort, drop the DONE ones and copy the survivors' payloads
+//     out of the mappings
+//
+// the ranges are contiguous, so concatenating them gives id order.
+class WalRecoverer {
+public:
+  static const size_t CHUNK_BYTES = 4 << 20;
+
+  WalRecovery run(const std::vector<std::string> &paths, unsigned threads) {
+    threads = std::max(1u, threads);
+    for (const std::string &path : paths) {
+      files.push_back(std::make_unique<File>(path));
+    }
+    wal_parallel_for(files.size(), threads, [&](size_t i) { split(i); });
+    for (size_t f = 0; f < files.size(); f++) {
+      for (const Chunk &chunk : files[f]->chunks) {
+        Work &work = chunks.emplace_back();
+        work.file = f;
+        work.begin = chunk.begin;
+        work.end = chunk.end;
+      }
+    }
+    wal_parallel_for(chunks.size(), threads, [&](size_t i) { decode(i); });
+    drop_after_corruption();
+
+    WalRecovery recovery;
+    recovery.queues = latest_queues();
+    uint64_t lowest = UINT64_MAX;
+    uint64_t highest = 0;
+    for (const Work &work : chunks) {
+      recovery.max_job_id = std::max(recovery.max_job_id, work.max_id);
+      if (!work.adds.empty()) {
+        lowest = std::min(lowest, work.min_add);
+        highest = std::max(highest, work.max_add);
+      }
+    }
+    if (highest == 0) {
+      return recovery;
+    }
+
+    // a few ranges per thread keep them balanced even if ids cluster
+    size_t ranges = threads == 1 ? 1 : threads * 4;
+    uint64_t span = (highest - lowest) / ranges + 1;
+    wal_parallel_for(chunks.size(), threads, [&](size_t i) {
+      scatter(chunks[i], ranges, lowest, span);
+    });
+    std::vector<std::vector<std::pair<uint64_t, WalJob>>> merged(ranges);
+    wal_parallel_for(ranges, threads,
+                     [&](size_t r) { merge(r, merged[r]); });
+
+    size_t total = 0;
+    for (auto &range : merged) {
+      total += range.size();
+    }
+    recovery.pending.reserve(total);
+    for (auto &range : merged) {
+      std::move(range.begin(), range.end(),
+                std::back_inserter(recovery.pending));
+    }
+    return recovery;
+  }
+
+private:
+  struct Chunk {
+    const char *begin;
+    const char *end;
+  };
+
+  struct File {
+    std::string path;
+    MappedFile map;
+    std::vector<Chunk> chunks;
+    // the first torn or corrupt record found, by chunk then position
+    std::atomic<size_t> corrupt_chunk{SIZE_MAX};
+
+    explicit File(const std::string &p) : path(p), map(p) {}
+  };
+
+  struct Add {
+    uint64_t id;
+    uint32_t order; // chunk index, the later ADD of an id wins
+    uint8_t priority;
+    bool compressed;
+    uint32_t queue;
+    int64_t not_before_ms;
+    std::string_view payload;
+  };
+
+  // ids first to last, all done
+  struct Span {
+    uint64_t first;
+    uint64_t last;
+  };
+
+  struct QueueRecord {
+    size_t order; // chunk index
+    const char *at;
+    WalQueue queue;
+  };
+
+  struct Work {
+    size_t file = 0;
+    const char *begin = nullptr;
+    const char *end = nullptr;
+    std::vector<Add> adds;
+    std::vector<uint64_t> dones;
+    std::vector<Span> spans;
+    std::vector<QueueRecord> queues;
+    uint64_t max_id = 0;
+    uint64_t min_add = UINT64_MAX;
+    uint64_t max_add = 0;
+    const char *corrupt_at = nullptr;
+    std::vector<std::vector<Add>> add_ranges;
+    std::vector<std::vector<uint64_t>> done_ranges;
+    std::vector<std::vector<Span>> span_ranges;
+  };
+
+  std::vector<std::unique_ptr<File>> files;
+  std::vector<Work> chunks;
+
+  void split(size_t f) {
+    File &file = *files[f];
+    if (!file.map.ok() || file.map.size() == 0) {
+      return; // gone, or created by a crashed run and never written
+    }
+    if (!wal_is_binary(file.map.data(), file.map.size())) {
+      LOG_WARN("WAL file {} has no binary header, skipped", file.path);
+      return;
+    }
+    if (!wal_version_known(file.map.data())) {
+      LOG_ERROR("WAL file {} is version {}, newer than {}, skipped",
+                file.path, wal_get_u32(file.map.data() + 8), WAL_VERSION);
+      return;
+    }
+    const char *p = file.map.data() + WAL_FILE_HEADER;
+    const char *end = file.map.data() + file.map.size();
+    const char *chunk = p;
+    // lengths are not checked here: a bad one only makes for odd chunk
+    // boundaries past the record that decode() will stop at anyway
+    while (end - p >= static_cast<ptrdiff_t>(WAL_RECORD_HEADER)) {
+      uint32_t length = wal_get_u32(p + 4);
+      if (length == 0 ||
+          static_cast<size_t>(end - p) - WAL_RECORD_HEADER < length) {
+        break;
+      }
+      p += WAL_RECORD_HEADER + length;
+      if (static_cast<size_t>(p - chunk) >= CHUNK_BYTES) {
+        file.chunks.push_back({chunk, p});
+        chunk = p;
+      }
+    }
+    // the last chunk runs to the end so that decode() sees the torn tail
+    file.chunks.push_back({chunk, end});
+  }
+
+  void decode(size_t i) {
+    Work &work = chunks[i];
+    const char *p = work.begin;
+    WalRecord record;
+    size_t consumed = 0;
+    while (p < work.end) {
+      WalScan scan = wal_decode(p, work.end, record, consumed);
+      if (scan == WalScan::Corrupt) {
+        work.corrupt_at = p;
+        File &file = *files[work.file];
+        size_t seen = file.corrupt_chunk.load();
+        while (i < seen && !file.corrupt_chunk.compare_exchange_weak(seen, i)) {
+        }
+      }
+      if (scan != WalScan::Ok) {
+        break;
+      }
+      switch (record.type) {
+      case WalRecord::Add:
+        work.adds.push_back({record.id, static_cast<uint32_t>(i),
+                             record.priority, record.compressed, record.queue,
+                             record.not_before_ms, record.payload});
+        work.min_add = std::min(work.min_add, record.id);
+        work.max_add = std::max(work.max_add, record.id);
+        work.max_id = std::max(work.max_id, record.id);
+        break;
+      case WalRecord::AddBatch: {
+        const char *q = record.payload.data();
+        const char *end = q + record.payload.size();
+        for (uint64_t n = 0; n < record.count; n++) {
+          std::string_view job;
+          bool compressed = false;
+          wal_batch_next(q, end, job, compressed);
+          work.adds.push_back({record.id + n, static_cast<uint32_t>(i),
+                               record.priority, compressed, record.queue,
+                               record.not_before_ms, job});
+        }
+        uint64_t last = record.id + record.count - 1;
+        work.min_add = std::min(work.min_add, record.id);
+        work.max_add = std::max(work.max_add, last);
+        work.max_id = std::max(work.max_id, last);
+        break;
+      }
+      case WalRecord::Done:
+        work.dones.push_back(record.id);
+        break;
+      case WalRecord::DoneRanges: {
+        const char *q = record.payload.data();
+        const char *end = q + record.payload.size();
+        uint64_t at = record.id;
+        for (uint64_t n = 0; n < record.count; n++) {
+          Span span;
+          wal_range_next(q, end, n == 0, at, span.first, span.last);
+          work.spans.push_back(span);
+        }
+        break;
+      }
+      case WalRecord::MaxId:
+        work.max_id = std::max(work.max_id, record.id);
+        break;
+      case WalRecord::Queue:
+        if (record.id <= UINT32_MAX) {
+          work.queues.push_back({i, p,
+                                 {static_cast<uint32_t>(record.id),
+                                  record.weight, std::string(record.payload),
+                                  record.max_jobs, record.max_bytes}});
+        }
+        break;
+      case WalRecord::AddTo: // decoded as Add
+        break;
+      }
+      p += consumed;
+    }
+  }
+
+  // a file ends at its first bad record, as if it had been read in order
+  void drop_after_corruption() {
+    for (size_t i = 0; i < chunks.size(); i++) {
+      Work &work = chunks[i];
+      File &file = *files[work.file];
+      size_t corrupt = file.corrupt_chunk.load();
+      if (i == corrupt) {
+        LOG_WARN("WAL file {} is torn or corrupt at offset {}, ignoring the "
+                 "rest of it",
+                 file.path,
+                 static_cast<uint64_t>(work.corrupt_at - file.map.data()));
+      } else if (i > corrupt) {
+        work.adds.clear();
+        work.dones.clear();
+        work.spans.clear();
+        work.queues.clear();
+        work.max_id = 0;
+      }
+    }
+  }
+
+  std::vector<WalQueue> latest_queues() {
+    std::vector<QueueRecord> all;
+    for (Work &work : chunks) {
+      std::move(work.queues.begin(), work.queues.end(),
+                std::back_inserter(all));
+    }
+    std::stable_sort(all.begin(), all.end(),
+                     [](const QueueRecord &a, const QueueRecord &b) {
+                       if (a.queue.id != b.queue.id) {
+                         return a.queue.id < b.queue.id;
+                       }
+                       return a.order != b.order ? a.order < b.order
+                                                 : a.at < b.at;
+                     });
+    std::vector<WalQueue> latest;
+    for (size_t i = 0; i < all.size(); i++) {
+      if (i + 1 == all.size() || all[i + 1].queue.id != all[i].queue.id) {
+        latest.push_back(std::move(all[i].queue));
+      }
+    }
+    return latest;
+  }
+
+  void scatter(Work &work, size_t ranges, uint64_t lowest, uint64_t span) {
+    auto range_of = [&](uint64_t id) {
+      return id < lowest ? 0 : std::min<size_t>((id - lowest) / span, ranges - 1);
+    };
+    work.add_ranges.resize(ranges);
+    work.done_ranges.resize(ranges);
+    work.span_ranges.resize(ranges);
+    for (const Add &add : work.adds) {
+      work.add_ranges[range_of(add.id)].push_back(add);
+    }
+    for (uint64_t id : work.dones) {
+      work.done_ranges[range_of(id)].push_back(id);
+    }
+    // a span is cut where it crosses into the next job id range
+    for (const Span &ids : work.spans) {
+      for (size_t r = range_of(ids.first), last = range_of(ids.last);
+           r <= last; r++) {
+        uint64_t begin = r == 0 ? 0 : lowest + r * span;
+        uint64_t end =
+            r + 1 == ranges ? UINT64_MAX : lowest + (r + 1) * span - 1;
+        work.span_ranges[r].push_back(
+            {std::max(ids.first, begin), std::min(ids.last, end)});
+      }
+    }
+    std::vector<Add>().swap(work.adds);
+    std::vector<uint64_t>().swap(work.dones);
+    std::vector<Span>().swap(work.spans);
+  }
+
+  void merge(size_t r, std::vector<std::pair<uint64_t, WalJob>> &out) {
+    std::vector<Add> adds;
+    std::vector<uint64_t> dones;
+    std::vector<Span> spans;
+    for (const Work &work : chunks) {
+      adds.insert(adds.end(), work.add_ranges[r].begin(),
+                  work.add_ranges[r].end());
+      dones.insert(dones.end(), work.done_ranges[r].begin(),
+                   work.done_ranges[r].end());
+      spans.insert(spans.end(), work.span_ranges[r].begin(),
+                   work.span_ranges[r].end());
+    }
+    std::sort(adds.begin(), adds.end(), [](const Add &a, const Add &b) {
+      return a.id != b.id ? a.id < b.id : a.order < b.order;
+    });
+    std::sort(dones.begin(), dones.end());
+    std::sort(spans.begin(), spans.end(), [](const Span &a, const Span &b) {
+      return a.first < b.first;
+    });
+
+    // spans may overlap. one passed over ends below an earlier id and so
+    // below this one too, and none after the current one starts before it.
+    auto span = spans.begin();
+    auto done = dones.begin();
+    for (size_t i = 0; i < adds.size(); i++) {
+      const Add &add = adds[i];
+      if (i + 1 < adds.size() && adds[i + 1].id == add.id) {
+        continue;
+      }
+      while (done != dones.end() && *done < add.id) {
+        ++done;
+      }
+      if (done != dones.end() && *done == add.id) {
+        continue;
+      }
+      while (span != spans.end() && span->last < add.id) {
+        ++span;
+      }
+      if (span != spans.end() && span->first <= add.id) {
+        continue;
+      }
+      out.emplace_back(add.id,
+                       WalJob{Payload(add.payload), add.priority,
+                              add.not_before_ms, add.queue, add.compressed});
+    }
+  }
+};
+
+inline WalRecovery recover_wal(const std::vector<std::string> &paths,
+                               unsigned threads) {
+  return WalRecoverer().run(paths, threads);
+}
+
+inline std::string wal_segment_path(const std::string &dir, uint64_t seq) {
+  char name[32];
+  std::snprintf(name, sizeof(name), "%020llu.log",
+                static_cast<unsigned long long>(seq));
+  return dir + "/" + name;
+}
+
+inline std::string wal_snapshot_path(const std::string &dir, uint64_t seq) {
+  char name[40];
+  std::snprintf(name, sizeof(name), "snapshot-%020llu.snap",
+                static_cast<unsigned long long>(seq));
+  return dir + "/" + name;
+}
+
+struct WalFiles {
+  std::vector<uint64_t> segments; // ascending
+  std::vector<uint64_t> snapshots; // ascending
+};
+
+// matches exactly <prefix><20 digits><suffix>, so leftover .tmp files and
+// anything else in the directory are skipped
+inline bool parse_wal_name(const std::string &name, const std::string &prefix,
+                           const std::string &suffix, uint64_t &seq) {
+  if (name.size() != prefix.size() + 20 + suffix.size() ||
+      name.compare(0, prefix.size(), prefix) != 0 ||
+      name.compare(name.size() - suffix.size(), suffix.size(), suffix) != 0) {
+    return false;
+  }
+  seq = 0;
+  for (size_t i = prefix.size(); i < prefix.size() + 20; i++) {
+    if (name[i] < '0' || name[i] > '9') {
+      return false;
+    }
+    seq = seq * 10 + static_cast<uint64_t>(name[i] - '0');
+  }
+  return true;
+}
+
+inline WalFiles list_wal_files(const std::string &dir) {
+  WalFiles files;
+  DIR *d = ::opendir(dir.c_str());
+  if (d == nullptr) {
+    return files;
+  }
+  while (dirent *entry = ::readdir(d)) {
+    uint64_t seq;
+    if (parse_wal_name(entry->d_name, "snapshot-", ".snap", seq)) {
+      files.snapshots.push_back(seq);
+    } else if (parse_wal_name(entry->d_name, "", ".log", seq)) {
+      files.segments.push_back(seq);
+    }
+  }
+  ::closedir(d);
+  std::sort(files.segments.begin(), files.segments.end());
+  std::sort(files.snapshots.begin(), files.snapshots.end());
+  return files;
+}
+
+inline bool fsync_dir(const std::string &dir) {
+  int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd == -1) {
+    return false;
+  }
+  bool ok = ::fsync(fd) == 0;
+  ::close(fd);
+  return ok;
+}
+
+// converts whatever is still in the text format of earlier versions in
+// place. fails on a binary file of a version this broker cannot read, which
+// it must not recover from (or compact) without.
+inline bool convert_text_wal_files(const std::string &dir) {
+  WalFiles files = list_wal_files(dir);
+  std::vector<std::string> paths;
+  for (uint64_t seq : files.segments) {
+    paths.push_back(wal_segment_path(dir, seq));
+  }
+  for (uint64_t seq : files.snapshots) {
+    paths.push_back(wal_snapshot_path(dir, seq));
+  }
+  for (const std::string &path : paths) {
+    char magic[WAL_FILE_HEADER] = {};
+    std::ifstream in(path, std::ios::binary);
+    in.read(magic, sizeof(magic));
+    if (wal_is_binary(magic, static_cast<size_t>(in.gcount()))) {
+      if (!wal_version_known(magic)) {
+        LOG_ERROR("WAL file {} is version {}, this broker reads up to {}",
+                  path, wal_get_u32(magic + 8), WAL_VERSION);
+        errno = EPROTO;
+        return false;
+      }
+      continue;
+    }
+    in.close();
+    LOG_INFO("Converting text WAL file {} to the binary format", path);
+    if (!convert_text_wal(path, path)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+// newest snapshot plus every segment after it
+inline WalRecovery load_wal_state(const std::string &dir, unsigned threads) {
+  WalFiles files = list_wal_files(dir);
+  std::vector<std::string> paths;
+  uint64_t covered = 0;
+  if (!files.snapshots.empty()) {
+    covered = files.snapshots.back();
+    paths.push_back(wal_snapshot_path(dir, covered));
+  }
+  for (uint64_t seq : files.segments) {
+    if (seq > covered) {
+      paths.push_back(wal_segment_path(dir, seq));
+    }
+  }
+  return recover_wal(paths, threads);
+}
+
+// group-commit write-ahead log. connections hand finished records to
+// append(), which only copies them into the pending batch (job payloads are
+// referenced, not copied). a single writer thread keeps the active segment
+// mapped and turns each batch into one copy into the mapping plus one msync
+// of the pages it touched, then reports durability to every record of the
+// batch. segments are preallocated, so appending never changes a file's
+// size. a second thread folds sealed segments into snapshots and deletes
+// them.
+class WalWriter {
+public:
+  // called on the writer thread once the record is on disk (or failed to get
+  // there), so it must be cheap and must not block
+  using Callback = std::function<void(bool durable)>;
+
+  bool open(const WalConfig &cfg) {
+    config = cfg;
+    if (::mkdir(config.dir.c_str(), 0755) == -1 && errno != EEXIST) {
+      return false;
+    }
+
+    WalFiles files = list_wal_files(config.dir);
+    uint64_t last = 0;
+    if (!files.segments.empty()) {
+      last = files.segments.back();
+    }
+    if (!files.snapshots.empty()) {
+      last = std::max(last, files.snapshots.back());
+    }
+    if (last == 0 && ::access(config.legacy_path.c_str(), F_OK) == 0) {
+      last = 1;
+      if (!convert_text_wal(config.legacy_path,
+                            wal_segment_path(config.dir, last))) {
+        return false;
+      }
+    }
+    if (!convert_text_wal_files(config.dir)) {
+      return false;
+    }
+    // never append to a segment left over from a previous run, its tail may
+    // be torn
+    active_seq = last;
+    if (!open_segment(last + 1, 0)) {
+      return false;
+    }
+    // segments from earlier runs are sealed as far as the compactor cares
+    sealed_seq = last;
+    snapshot_seq = files.snapshots.empty() ? 0 : files.snapshots.back();
+
+    writer = std::thread(&WalWriter::run, this);
+    compactor = std::thread(&WalWriter::run_compactor, this);
+    return true;
+  }
+
+  // a whole record, e.g. DONE
+  void append(const std::string &record, Callback on_durable = nullptr) {
+    append(record, Payload(), std::move(on_durable));
+  }
+
+  // a record made of its head and a shared job payload, see wal_add_head().
+  // large payloads are held by reference until they are copied into the
+  // segment.
+  void append(std::string_view head, const Payload &payload,
+              Callback on_durable = nullptr) {
+    bool wake;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      wake = pending.empty();
+      if (wake) {
+        pending_since_ns = steady_now_ns();
+      }
+      pending.append(head);
+      pending.append(payload);
+      if (on_durable) {
+        pending_callbacks.push_back(std::move(on_durable));
+      }
+      wake = wake || pending.size() >= config.max_batch_bytes;
+    }
+    if (wake) {
+      cv.notify_one();
+    }
+  }
+
+  // a SUBMIT_BATCH, one record and one callback for all of its jobs
+  void append(const WalBatch &batch, Callback on_durable = nullptr) {
+    std::string head = batch.head();
+    bool wake;
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      wake = pending.empty();
+      if (wake) {
+        pending_since_ns = steady_now_ns();
+      }
+      pending.append(head);
+      for (const WalBatch::Job &job : batch.jobs()) {
+        pending.append(job.prefix);
+        pending.append(job.payload);
+      }
+      if (on_durable) {
+        pending_callbacks.push_back(std::move(on_durable));
+      }
+      wake = wake || pending.size() >= config.max_batch_bytes;
+    }
+    if (wake) {
+      cv.notify_one();
+    }
+  }
+
+  void close() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    cv.notify_one();
+    if (writer.joinable()) {
+      writer.join();
+    }
+    {
+      std::lock_guard<std::mutex> lock(compact_mutex);
+      compact_stopping = true;
+    }
+    compact_cv.notify_one();
+    if (compactor.joinable()) {
+      compactor.join();
+    }
+    close_segment();
+  }
+
+  ~WalWriter() { close(); }
+
+private:
+  WalConfig config;
+  int fd = -1;
+  char *map = nullptr;     // the active segment, map_bytes long
+  size_t map_bytes = 0;
+  size_t active_bytes = 0; // header and records written so far
+  uint64_t active_seq = 0;
+  std::thread writer;
+  std::thread compactor;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  static const int IOV_PER_GATHER = 256;
+  IoChain pending;
+  std::vector<Callback> pending_callbacks;
+  int64_t pending_since_ns = 0; // when the oldest pending record came in
+  bool stopping = false;
+  bool rotate_requested = false;
+
+  // compactor state, guarded by compact_mutex
+  std::mutex compact_mutex;
+  std::condition_variable compact_cv;
+  uint64_t sealed_seq = 0;
+  uint64_t snapshot_seq = 0;
+  bool compact_stopping = false;
+
+  // creates and maps a segment of segment_bytes, or more if a single batch
+  // of room bytes needs it. the blocks are allocated up front, so later
+  // appends never grow the file and a sync never has to update its size.
+  bool open_segment(uint64_t seq, size_t room) {
+    size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    size_t bytes = std::max(config.segment_bytes, WAL_FILE_HEADER + room);
+    bytes = (bytes + page - 1) / page * page;
+    int next = ::open(wal_segment_path(config.dir, seq).c_str(),
+                      O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (next == -1) {
+      return false;
+    }
+    int err = ::posix_fallocate(next, 0, static_cast<off_t>(bytes));
+    if (err != 0 && (err == EINVAL || err == EOPNOTSUPP)) {
+      // no preallocation on this file system, a sparse file will do
+      err = ::ftruncate(next, static_cast<off_t>(bytes)) == 0 ? 0 : errno;
+    }
+    void *p = err == 0 ? ::mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                                MAP_SHARED, next, 0)
+                       : MAP_FAILED;
+    if (p == MAP_FAILED) {
+      if (err != 0) {
+        errno = err;
+      }
+      ::close(next);
+      return false;
+    }
+    std::string header = wal_file_header();
+    std::memcpy(p, header.data(), header.size());
+    if (::fsync(next) == -1) {
+      ::munmap(p, bytes);
+      ::close(next);
+      return false;
+    }
+
+    close_segment();
+    fd = next;
+    map = static_cast<char *>(p);
+    map_bytes = bytes;
+    active_seq = seq;
+    active_bytes = WAL_FILE_HEADER;
+    return fsync_dir(config.dir);
+  }
+
+  // a sealed segment gives back its unused preallocated tail
+  void close_segment() {
+    if (map != nullptr) {
+      ::munmap(map, map_bytes);
+      map = nullptr;
+    }
+    if (fd != -1) {
+      if (active_bytes < map_bytes) {
+        int ignored = ::ftruncate(fd, static_cast<off_t>(active_bytes));
+        (void)ignored;
+      }
+      ::close(fd);
+      fd = -1;
+    }
+  }
+
+  void run() {
+    IoChain batch;
+    std::vector<Callback> callbacks;
+    int64_t batch_since_ns = 0;
+
+    while (true) {
+      bool rotate;
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        cv.wait(lock, [&] {
+          return stopping || rotate_requested || !pending.empty();
+        });
+        if (pending.empty() && !rotate_requested) {
+          return;
+        }
+        // linger so that records arriving from other connections share this
+        // sync instead of paying for their own
+        auto deadline = std::chrono::steady_clock::now() + config.max_delay;
+        cv.wait_until(lock, deadline, [&] {
+          return stopping || pending.size() >= config.max_batch_bytes;
+        });
+        batch.swap(pending);
+        callbacks.swap(pending_callbacks);
+        batch_since_ns = pending_since_ns;
+        rotate = rotate_requested;
+        rotate_requested = false;
+      }
+
+      bool durable = true;
+      if (!batch.empty()) {
+        durable = write_and_sync(batch);
+        if (durable) {
+          // one sample per batch, for its oldest record
+          Metrics::record(Timer::WalWrite, steady_now_ns() - batch_since_ns);
+        } else {
+          LOG_ERROR("WAL write failed: {}", strerror(errno));
+        }
+      }
+      for (auto &callback : callbacks) {
+        callback(durable);
+      }
+      batch.clear();
+      callbacks.clear();
+
+      if (active_bytes > WAL_FILE_HEADER &&
+          (rotate || active_bytes >= config.segment_bytes)) {
+        seal();
+        if (!open_segment(active_seq + 1, 0)) {
+          LOG_ERROR("WAL rotation failed: {}", strerror(errno));
+        }
+      }
+    }
+  }
+
+  // closes the active segment and hands it to the compactor. the next one is
+  // opened by the caller, with as much room as it needs.
+  void seal() {
+    bool written = active_bytes > WAL_FILE_HEADER;
+    uint64_t sealed = active_seq;
+    close_segment();
+    if (written) {
+      {
+        std::lock_guard<std::mutex> lock(compact_mutex);
+        sealed_seq = sealed;
+      }
+      compact_cv.notify_one();
+    }
+  }
+
+  // copies the batch into the mapping and makes exactly the pages it
+  // touched durable. consumes the batch.
+  bool write_and_sync(IoChain &data) {
+    // whole batches go into one segment, so a record never straddles two
+    if (map != nullptr && active_bytes + data.size() > map_bytes) {
+      seal();
+    }
+    if (map == nullptr && !open_segment(active_seq + 1, data.size())) {
+      data.clear();
+      return false;
+    }
+    size_t start = active_bytes;
+    iovec iov[IOV_PER_GATHER];
+    while (!data.empty()) {
+      int count = data.gather(iov, IOV_PER_GATHER);
+      size_t len = 0;
+      for (int i = 0; i < count; i++) {
+        std::memcpy(map + active_bytes + len, iov[i].iov_base, iov[i].iov_len);
+        len += iov[i].iov_len;
+      }
+      active_bytes += len;
+      data.consume(len);
+    }
+
+    size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+    size_t from = start / page * page;
+    int64_t sync_start = steady_now_ns();
+    Metrics::count(Counter::Syscalls);
+    bool ok = ::msync(map + from, active_bytes - from, MS_SYNC) == 0;
+    Metrics::record(Timer::WalFsync, steady_now_ns() - sync_start);
+    return ok;
+  }
+
+  // folds sealed segments into a new snapshot, either once enough of them
+  // pile up or when the interval passes, in which case the active segment is
+  // sealed first so that the snapshot catches up with it.
+  void run_compactor() {
+    auto last_snapshot = std::chrono::steady_clock::now();
+    std::unique_lock<std::mutex> lock(compact_mutex);
+
+    while (!compact_stopping) {
+      auto deadline = last_snapshot + config.snapshot_interval;
+      compact_cv.wait_until(lock, deadline, [&] {
+        return compact_stopping ||
+               sealed_seq >= snapshot_seq + config.snapshot_segments;
+      });
+      if (compact_stopping) {
+        return;
+      }
+
+      if (sealed_seq <= snapshot_seq) {
+        if (std::chrono::steady_clock::now() >= deadline) {
+          last_snapshot = std::chrono::steady_clock::now();
+          {
+            std::lock_guard<std::mutex> writer_lock(mutex);
+            rotate_requested = true;
+          }
+          cv.notify_one();
+        }
+        continue;
+      }
+
+      uint64_t upto = sealed_seq;
+      uint64_t from = snapshot_seq;
+      lock.unlock();
+      bool ok = write_snapshot(from, upto);
+      lock.lock();
+      if (ok) {
+        snapshot_seq = upto;
+        last_snapshot = std::chrono::steady_clock::now();
+      } else {
+        LOG_ERROR("WAL snapshot failed: {}", strerror(errno));
+        // don't spin on a persistent error
+        compact_cv.wait_for(lock, std::chrono::seconds(1));
+      }
+    }
+  }
+
+  bool write_snapshot(uint64_t from, uint64_t upto) {
+    std::vector<std::string> paths;
+    if (from > 0) {
+      paths.push_back(wal_snapshot_path(config.dir, from));
+    }
+    for (uint64_t seq : list_wal_files(config.dir).segments) {
+      if (seq > from && seq <= upto) {
+        paths.push_back(wal_segment_path(config.dir, seq));
+      }
+    }
+    // in the background, so one thread: recovery is where speed matters
+    WalRecovery state = recover_wal(paths, 1);
+
+    std::string path = wal_snapshot_path(config.dir, upto);
+    std::string tmp = path + ".tmp";
+    {
+      std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+      out << wal_file_header();
+      out << wal_id_record(WalRecord::MaxId, state.max_job_id);
+      // queues before their jobs
+      for (const WalQueue &queue : state.queues) {
+        out << wal_queue_record(queue.id, queue.weight, queue.name,
+                                queue.max_jobs, queue.max_bytes);
+      }
+      for (const auto &[id, job] : state.pending) {
+        out << wal_add_record(id, job.priority, job.not_before_ms,
+                              job.payload.view(), job.queue, job.compressed);
+      }
+      if (!out.flush()) {
+        return false;
+      }
+    }
+    int tmp_fd = ::open(tmp.c_str(), O_RDONLY | O_CLOEXEC);
+    if (tmp_fd == -1) {
+      return false;
+    }
+    bool synced = ::fsync(tmp_fd) == 0;
+    ::close(tmp_fd);
+    if (!synced || ::rename(tmp.c_str(), path.c_str()) == -1 ||
+        !fsync_dir(config.dir)) {
+      return false;
+    }
+
+    // the new snapshot is durable, everything it covers can go
+    WalFiles files = list_wal_files(config.dir);
+    for (uint64_t seq : files.segments) {
+      if (seq <= upto) {
+        ::unlink(wal_segment_path(config.dir, seq).c_str());
+      }
+    }
+    for (uint64_t seq : files.snapshots) {
+      if (seq < upto) {
+        ::unlink(wal_snapshot_path(config.dir, seq).c_str());
+      }
+    }
+    return true;
+  }
+};
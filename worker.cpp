@@ -1,95 +1,78 @@
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
-#include <unistd.h>
-
+#include <algorithm>
 #include <chrono>
 #include <iostream>
+#include <mutex>
 #include <string>
 #include <thread>
 
-using namespace std;
-
-const int PORT = 5003;
+#include "worker_runtime.h"
 
-static bool send_all(int fd, const string &s) {
-  const char *p = s.c_str();
-  size_t left = s.size();
-  while (left > 0) {
-    ssize_t n = ::send(fd, p, left, 0);
-    if (n <= 0)
-      return false;
-    p += n;
-    left -= static_cast<size_t>(n);
-  }
-  return true;
-}
+using namespace std;
 
-static bool recv_line(int fd, string &out) {
-  out.clear();
-  char c;
-  while (true) {
-    ssize_t n = ::recv(fd, &c, 1, 0);
-    if (n <= 0)
-      return false;
-    if (c == '\n')
-      break;
-    if (c != '\r')
-      out.push_back(c);
-  }
-  return true;
+static void usage(const char *prog) {
+  cerr << "Usage: " << prog
+       << " [prefetch] [--executors=N] [--connections=N] [--work-ms=N]"
+          " [--queues=NAME,...] [--compress]"
+       << endl;
 }
 
-int main() {
-  int sock = ::socket(AF_INET, SOCK_STREAM, 0);
-  if (sock == -1) {
-    cerr << "Failed to create socket\n";
-    return 1;
-  }
-
-  sockaddr_in server{};
-  server.sin_family = AF_INET;
-  server.sin_port = htons(PORT);
-  inet_pton(AF_INET, "127.0.0.1", &server.sin_addr);
-
-  if (::connect(sock, (sockaddr *)&server, sizeof(server)) == -1) {
-    cerr << "Failed to connect\n";
-    close(sock);
-    return 1;
-  }
-
-  while (true) {
-    if (!send_all(sock, "REQUEST\n"))
-      break;
-
-    string response;
-    if (!recv_line(sock, response))
-      break;
-
-    if (response == "EMPTY") {
-      this_thread::sleep_for(chrono::milliseconds(300));
-      continue;
+int main(int argc, char *argv[]) {
+  WorkerRuntimeOptions options;
+  chrono::milliseconds work{1000};
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    size_t eq = arg.find('=');
+    string key = arg.substr(0, eq);
+    string value = (eq == string::npos) ? "" : arg.substr(eq + 1);
+    try {
+      if (key == "--executors") {
+        options.executors = static_cast<unsigned>(stoul(value));
+      } else if (key == "--connections") {
+        options.connections = static_cast<unsigned>(stoul(value));
+      } else if (key == "--work-ms") {
+        work = chrono::milliseconds(stoul(value));
+      } else if (key == "--compress") {
+        options.client.compression = true;
+      } else if (key == "--queues") {
+        size_t start = 0;
+        while (start <= value.size()) {
+          size_t comma = min(value.find(',', start), value.size());
+          if (comma == start) {
+            usage(argv[0]); // an empty name, e.g. "a," or "a,,b"
+            return 1;
+          }
+          options.queues.push_back(value.substr(start, comma - start));
+          start = comma + 1;
+        }
+      } else if (eq == string::npos && i == 1) {
+        // how many jobs the broker may lease to each connection at once
+        options.prefetch = static_cast<uint32_t>(stoul(arg));
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } catch (...) {
+      usage(argv[0]);
+      return 1;
     }
+  }
 
-    cout << "Got job: " << response << endl;
-
-    // Parse job ID from "JOB <id> <payload>"
-    // The server sends: "<id> <value>"
-    size_t first_space = response.find(' ');
-    if (first_space == string::npos) {
-      cerr << "Error: Malformed job response" << endl;
-      continue;
+  mutex print_mutex;
+  WorkerRuntime runtime(options, [&](JobContext &context) {
+    {
+      lock_guard<mutex> lock(print_mutex);
+      cout << "Got job: " << context.job.id << " " << context.job.payload
+           << endl;
     }
-    string id_str = response.substr(0, first_space);
-
     // Simulate work
-    this_thread::sleep_for(chrono::seconds(1));
-
-    string ack_msg = "ACK " + id_str + "\n";
-    if (!send_all(sock, ack_msg))
-      break;
+    this_thread::sleep_for(work);
+    return JobResult::Ack;
+  });
+  if (!runtime.start()) {
+    cerr << "Failed to connect\n";
+    return 1;
   }
-
-  close(sock);
-  return 0;
+  runtime.wait();
+  cerr << "Lost the broker after " << runtime.acked() << " jobs" << endl;
+  return 1;
 }
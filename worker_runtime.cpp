@@ -0,0 +1,204 @@
+#include "worker_runtime.h"
+
+#include <algorithm>
+
+void JobContext::touch() {
+  conn.touch(job.id);
+  conn.flush();
+}
+
+WorkerRuntime::WorkerRuntime(WorkerRuntimeOptions options, JobHandler handler)
+    : options(std::move(options)), handler(std::move(handler)) {
+  this->options.executors = std::max(1u, this->options.executors);
+  this->options.connections = std::max(1u, this->options.connections);
+  if (this->options.prefetch == 0) {
+    unsigned per_connection =
+        (this->options.executors + this->options.connections - 1) /
+        this->options.connections;
+    this->options.prefetch = 2 * per_connection;
+  }
+}
+
+bool WorkerRuntime::start() {
+  connections.resize(options.connections);
+  for (Connection &slot : connections) {
+    slot.conn = std::make_unique<WorkerConnection>(
+        options.client, options.prefetch, options.queues);
+    if (!slot.conn->open()) {
+      connections.clear();
+      return false;
+    }
+    slot.session = slot.conn->session();
+  }
+  live_fetchers = connections.size();
+  for (size_t i = 0; i < connections.size(); i++) {
+    connections[i].fetcher = std::thread(&WorkerRuntime::fetch, this, i);
+  }
+  for (unsigned i = 0; i < options.executors; i++) {
+    executors.emplace_back(&WorkerRuntime::execute, this);
+  }
+  return true;
+}
+
+void WorkerRuntime::wait() {
+  {
+    std::unique_lock<std::mutex> lock(mutex);
+    fetchers_done.wait(lock, [this] { return live_fetchers == 0; });
+  }
+  stop();
+}
+
+void WorkerRuntime::stop() {
+  std::call_once(stop_once, [this] {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+      ready.clear();
+    }
+    work_ready.notify_all();
+    capacity.notify_all();
+    // executors first, so that the jobs they are running get acknowledged
+    // while the connections are still up
+    for (auto &thread : executors) {
+      thread.join();
+    }
+    for (Connection &slot : connections) {
+      slot.conn->shutdown();
+    }
+    for (Connection &slot : connections) {
+      if (slot.fetcher.joinable()) {
+        slot.fetcher.join();
+      }
+    }
+  });
+}
+
+void WorkerRuntime::fetch(size_t index) {
+  Connection &slot = connections[index];
+  WorkerConnection &conn = *slot.conn;
+  uint32_t window = conn.prefetch();
+  // after an EMPTY reply with jobs still running, wait for one of them to
+  // finish before asking again rather than polling
+  bool ran_dry = false;
+  size_t held_when_dry = 0;
+  std::deque<ClientJob> jobs;
+
+  while (true) {
+    uint64_t timeout_ms = 0;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      capacity.wait(lock, [&] {
+        return stopping ||
+               (slot.held <= window / 2 &&
+                (!ran_dry || slot.held == 0 || slot.held < held_when_dry));
+      });
+      if (stopping) {
+        break;
+      }
+      if (slot.held == 0) {
+        timeout_ms = options.long_poll_ms;
+      }
+    }
+
+    RequestStatus status = conn.request(jobs, timeout_ms);
+    std::unique_lock<std::mutex> lock(mutex);
+    if (stopping) {
+      break;
+    }
+    switch (status) {
+    case RequestStatus::Jobs:
+      for (ClientJob &job : jobs) {
+        ready.push_back({std::move(job), index, slot.session});
+      }
+      slot.held += jobs.size();
+      jobs.clear();
+      ran_dry = false;
+      lock.unlock();
+      work_ready.notify_all();
+      break;
+    case RequestStatus::Error:
+      lock.unlock();
+      // e.g. a window the broker sees as full, give the ACKs time to land
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+      lock.lock();
+      [[fallthrough]];
+    case RequestStatus::Empty:
+      ran_dry = true;
+      held_when_dry = slot.held;
+      break;
+    case RequestStatus::Disconnected: {
+      // the broker requeues every lease of the old session
+      ready.erase(std::remove_if(ready.begin(), ready.end(),
+                                 [index](const Job &job) {
+                                   return job.connection == index;
+                                 }),
+                  ready.end());
+      slot.held = 0;
+      // jobs of the old session finishing meanwhile must not count against
+      // (or acknowledge on) the new one
+      slot.session = 0;
+      lock.unlock();
+      bool reopened = conn.open();
+      lock.lock();
+      if (!reopened || stopping) {
+        live_fetchers--;
+        lock.unlock();
+        fetchers_done.notify_all();
+        return;
+      }
+      slot.session = conn.session();
+      window = conn.prefetch();
+      ran_dry = false;
+      break;
+    }
+    }
+  }
+  std::lock_guard<std::mutex> lock(mutex);
+  live_fetchers--;
+  fetchers_done.notify_all();
+}
+
+void WorkerRuntime::execute() {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      work_ready.wait(lock, [this] { return stopping || !ready.empty(); });
+      if (stopping) {
+        return;
+      }
+      job = std::move(ready.front());
+      ready.pop_front();
+    }
+    JobResult result = JobResult::Fail;
+    JobContext context(job.job, *connections[job.connection].conn);
+    try {
+      result = handler(context);
+    } catch (...) {
+      result = JobResult::Fail;
+    }
+    finish(job, result);
+  }
+}
+
+void WorkerRuntime::finish(const Job &job, JobResult result) {
+  WorkerConnection &conn = *connections[job.connection].conn;
+  {
+    std::lock_guard<std::mutex> lock(mutex);
+    Connection &slot = connections[job.connection];
+    if (job.session != slot.session || slot.held == 0) {
+      return; // the lease went with the connection it came on
+    }
+    // queued before the fetcher can add a REQUEST behind it, so the broker
+    // sees the window free up first
+    if (result == JobResult::Ack) {
+      conn.ack(job.job.id);
+    } else {
+      conn.fail(job.job.id);
+    }
+    slot.held--;
+  }
+  (result == JobResult::Ack ? acked_count : failed_count)++;
+  capacity.notify_all();
+  conn.flush();
+}
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "client.h"
+
+enum class JobResult { Ack, Fail };
+
+class WorkerRuntime;
+
+// what a handler gets: the job, and a way to keep its lease alive when it
+// runs for longer than the broker's lease timeout
+class JobContext {
+public:
+  const ClientJob &job;
+
+  void touch();
+
+private:
+  friend class WorkerRuntime;
+  JobContext(const ClientJob &job, WorkerConnection &conn)
+      : job(job), conn(conn) {}
+  WorkerConnection &conn;
+};
+
+// the handler runs on an executor thread, many at once. an exception FAILs
+// the job.
+using JobHandler = std::function<JobResult(JobContext &)>;
+
+struct WorkerRuntimeOptions {
+  ClientOptions client;
+  unsigned executors = 4;
+  unsigned connections = 1;
+  // leases per connection, 0 for enough to keep every executor busy with as
+  // many jobs again waiting
+  uint32_t prefetch = 0;
+  uint64_t long_poll_ms = 30000;
+  // the named queues to lease from, none for just "default"
+  std::vector<std::string> queues;
+};
+
+// runs jobs on a pool of executor threads behind one or a few broker
+// connections. every connection has a fetcher thread that keeps the shared
+// ready queue topped up: it asks for more while the connection's leases are
+// at or below half its window, so a batch is on its way before the executors
+// run dry, and long-polls once they have. executors ACK or FAIL a job as soon
+// as it is done; jobs finishing together go out in one write.
+//
+// a connection that drops takes its leases with it: its jobs still queued
+// are dropped (the broker hands them out again) and those still running are
+// not acknowledged.
+class WorkerRuntime {
+public:
+  WorkerRuntime(WorkerRuntimeOptions options, JobHandler handler);
+  WorkerRuntime(const WorkerRuntime &) = delete;
+  WorkerRuntime &operator=(const WorkerRuntime &) = delete;
+  ~WorkerRuntime() { stop(); }
+
+  // false if one of the connections could not be opened
+  bool start();
+  // until every connection is gone for good, then stop()s
+  void wait();
+  // stops fetching and lets running jobs finish and be acknowledged. queued
+  // jobs are left to the broker to requeue.
+  void stop();
+
+  uint64_t acked() const { return acked_count.load(); }
+  uint64_t failed() const { return failed_count.load(); }
+
+private:
+  struct Job {
+    ClientJob job;
+    size_t connection;
+    uint64_t session;
+  };
+
+  struct Connection {
+    std::unique_ptr<WorkerConnection> conn;
+    std::thread fetcher;
+    // 0 while reconnecting, which no job carries: sessions start at 1
+    uint64_t session = 0;
+    size_t held = 0; // leased this session and not yet acknowledged
+  };
+
+  WorkerRuntimeOptions options;
+  JobHandler handler;
+
+  std::mutex mutex; // everything below
+  std::condition_variable work_ready;
+  std::condition_variable capacity;
+  std::deque<Job> ready;
+  std::vector<Connection> connections;
+  std::vector<std::thread> executors;
+  std::condition_variable fetchers_done;
+  size_t live_fetchers = 0;
+  bool stopping = false;
+  std::once_flag stop_once;
+  std::atomic<uint64_t> acked_count{0};
+  std::atomic<uint64_t> failed_count{0};
+
+  void fetch(size_t index);
+  void execute();
+  void finish(const Job &job, JobResult result);
+};